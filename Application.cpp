@@ -72,6 +72,21 @@ Application::loop()
     if (clock()) {
         clock()->loop();
     }
+    
+    // No one sees metrics unless the EventLog is being read
+    if (EventLog::readers() && System::millis() - _metricsTime >= MetricsRate) {
+        _metricsTime = System::millis();
+        sampleMetrics();
+    }
+}
+
+void
+Application::sampleMetrics()
+{
+    std::string s = System::format("{\"cpuUptime\":%u,\"freeHeap\":%u,\"cpuTemp\":%.1f,\"flashUsed\":%u,\"flashTotal\":%u}",
+                                   unsigned(_portal->getCPUUptime()), unsigned(System::freeHeap()), _portal->getCPUTemperature(),
+                                   unsigned(WebFileSystem::usedBytes()), unsigned(WebFileSystem::totalBytes()));
+    EventLog::add(EventLog::Type::Metrics, s);
 }
 
 void
@@ -122,6 +137,7 @@ Application::startNetwork()
 	System::delay(500);
  
     _portal->addStaticHTTPHandler("/fs", "/");
+    _portal->addEventStreamHandler("/events");
     
     _shell.begin(this);
     
@@ -53,6 +53,9 @@ static constexpr uint32_t ConfigRate = 200;
 static constexpr uint32_t ConnectedRate = 2000;
 static constexpr uint32_t BlinkSampleRate = 50;
 
+// rate metrics are added to the EventLog while anyone is reading it
+static constexpr uint32_t MetricsRate = 2000;
+
 enum class State {
 	Connecting, NetConfig, NetFail, UpdateFail, 
 	Startup, Idle, ShowMain, ForceShowMain, ShowSecondary,
@@ -123,6 +126,20 @@ public:
     {
         _portal->addHTTPHandler(endpoint, WiFiPortal::HTTPMethod::Get, h);
     }
+    void addHTTPHandler(const char* endpoint, WiFiPortal::HTTPMethod method, WiFiPortal::RequestHandlerCB h)
+    {
+        _portal->addHTTPHandler(endpoint, method, h);
+    }
+    void setCacheControl(const char* uri, const char* value) { _portal->setCacheControl(uri, value); }
+    void setWorkerThreads(uint8_t count, uint16_t maxQueued) { _portal->setWorkerThreads(count, maxQueued); }
+    void setRouteConcurrency(const char* endpoint, uint8_t max) { _portal->setRouteConcurrency(endpoint, max); }
+    void addWebSocketHandler(const char* endpoint, WiFiPortal::WebSocketCB cb) { _portal->addWebSocketHandler(endpoint, cb); }
+    void sendWebSocketMessage(uint32_t client, std::string_view message) { _portal->sendWebSocketMessage(client, message); }
+    void broadcastWebSocketMessage(const char* endpoint, std::string_view message, uint32_t except = 0)
+    {
+        _portal->broadcastWebSocketMessage(endpoint, message, except);
+    }
+    void addEventStreamHandler(const char* endpoint) { _portal->addEventStreamHandler(endpoint); }
 
     int8_t handleShellCommand(const std::string& incomingCmd, PrintCB printCB = nullptr)
     {
@@ -140,6 +157,7 @@ protected:
 private:
 	void startNetwork();
 	void startStateMachine();
+    void sampleMetrics();
  
 	mil::StateMachine<State, Input> _stateMachine;
 	mil::Blinker _blinker;
@@ -158,6 +176,8 @@ private:
     bool _havePostUserQuestion = false;
     
     std::unique_ptr<Clock> _clock;
+    
+    uint32_t _metricsTime = 0;
 };
 
 }
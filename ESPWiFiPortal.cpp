@@ -22,6 +22,9 @@ using namespace mil;
 static const char *TAG = "WiFiPortal";
 static const char* PROV_AP_SSID = "ESP32-Provisioning";
 
+// Files are streamed in chunks this size
+static constexpr size_t STREAM_CHUNK_SIZE = 4096;
+
 void
 ESPWiFiPortal::begin(WebFileSystem* wfs)
 {
@@ -36,7 +39,7 @@ ESPWiFiPortal::setConfigHandler(HandlerCB f)
 }
 
 int32_t
-ESPWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB requestCB)
+ESPWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, RequestHandlerCB requestCB)
 {
     if (!_server) {
         System::logE(TAG, "addHTTPHandler: server not running");
@@ -44,9 +47,15 @@ ESPWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB
     }
     
     if (method == HTTPMethod::Post) {
-        _server->on(endpoint, HTTP_POST, [this]() { _server->send(200, "text/plain", ""); },  [this, requestCB]() { requestCB(this); });
+        _server->on(endpoint, HTTP_POST, [this]() { _server->send(200, "text/plain", ""); },  [this, requestCB]()
+        {
+            if (_server->upload().status == UPLOAD_FILE_START) {
+                _uploadStartTime = System::millis();
+            }
+            requestCB(*_context, *_context);
+        });
     } else {
-        _server->on(endpoint, [this, requestCB]() { requestCB(this); });
+        _server->on(endpoint, [this, requestCB]() { requestCB(*_context, *_context); });
     }
     return 0;
 }
@@ -198,6 +207,10 @@ ESPWiFiPortal::startWebServer(bool provision)
         }
     }
 
+    // WebServer only keeps the request headers it's told to collect
+    static const char* headerKeys[] = { "Range", "If-Range", "If-None-Match", "If-Modified-Since" };
+    _server->collectHeaders(headerKeys, sizeof(headerKeys) / sizeof(headerKeys[0]));
+
     _server->begin();
 }
 
@@ -286,6 +299,7 @@ ESPWiFiPortal::getSSID()
 void
 ESPWiFiPortal::sendHTTPResponse(int code, const char* mimetype, const char* data)
 {
+    addCacheControlHeader(code);
     _server->send(code, mimetype, data);
 }
 
@@ -296,6 +310,7 @@ ESPWiFiPortal::sendHTTPResponse(int code, const char* mimetype, const char* data
         _server->sendHeader("Content-Encoding", "gzip", true);
     }
     
+    addCacheControlHeader(code);
     _server->setContentLength(length);
     _server->send(code, mimetype);
     _server->sendContent(data, length);
@@ -310,7 +325,88 @@ ESPWiFiPortal::streamHTTPResponse(File& file, const char* mimetype, bool attach)
     disp += file.name();
     disp += "\"";
     _server->sendHeader("Content-Disposition", disp.c_str(), true);
-    _server->streamFile(file, mimetype);
+    _server->sendHeader("Accept-Ranges", "bytes");
+    
+    size_t size = file.size();
+    
+    // Validators come from the file's size and modification time
+    std::string etag;
+    time_t lastWrite = file.getLastWrite();
+    if (lastWrite) {
+        etag = HTTPParser::makeETag(size, lastWrite);
+        std::string lastModified = HTTPParser::httpDate(lastWrite);
+        _server->sendHeader("ETag", etag.c_str());
+        _server->sendHeader("Last-Modified", lastModified.c_str());
+        
+        if (HTTPParser::notModified(getHTTPHeader("If-None-Match"), getHTTPHeader("If-Modified-Since"), etag, lastModified)) {
+            sendHTTPResponse(304, mimetype, "");
+            return;
+        }
+    }
+    
+    // Send the whole file unless a single satisfiable range was asked for
+    int code = 200;
+    size_t start = 0;
+    size_t remaining = size;
+    
+    std::string range = getHTTPHeader("Range");
+    if (!range.empty() && HTTPParser::ifRangeMatches(getHTTPHeader("If-Range"), etag)) {
+        switch (HTTPParser::parseRange(range, size, start, remaining)) {
+            case HTTPParser::RangeStatus::None:
+                break;
+            case HTTPParser::RangeStatus::Partial:
+                code = 206;
+                _server->sendHeader("Content-Range", HTTPParser::contentRange(start, remaining, size).c_str());
+                file.seek(start);
+                break;
+            case HTTPParser::RangeStatus::Unsatisfiable:
+                _server->sendHeader("Content-Range", HTTPParser::contentRange(0, 0, size).c_str());
+                _server->send(416, "text/plain", "");
+                return;
+        }
+    }
+    
+    // WebServer::streamFile goes through WiFiClient::write(Stream&), which
+    // copies about a TCP segment at a time. Send the headers and then write
+    // the file in larger chunks
+    addCacheControlHeader(code);
+    _server->setContentLength(remaining);
+    _server->send(code, mimetype, "");
+    
+    std::unique_ptr<uint8_t[]> buf(new (std::nothrow) uint8_t[STREAM_CHUNK_SIZE]);
+    if (!buf) {
+        System::logE(TAG, "streamHTTPResponse: out of memory");
+        _server->client().stop();
+        return;
+    }
+    
+    while (remaining > 0) {
+        int size = file.read(buf.get(), std::min(remaining, STREAM_CHUNK_SIZE));
+        if (size <= 0 || _server->client().write(buf.get(), size) != size_t(size)) {
+            // Content-Length has been sent, so the only thing left to do is close
+            System::logE(TAG, "streamHTTPResponse: file send failed");
+            _server->client().stop();
+            return;
+        }
+        remaining -= size;
+    }
+}
+
+void
+ESPWiFiPortal::Context::beginChunked(int code, const char* mimetype)
+{
+    // With an unknown length WebServer sends HTTP/1.1 responses chunked and
+    // sendContent encodes each chunk
+    _portal->addCacheControlHeader(code);
+    _portal->_server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+    _portal->_server->send(code, mimetype, "");
+}
+
+void
+ESPWiFiPortal::Context::sendChunk(const char* data, size_t length)
+{
+    // An empty chunk ends the response
+    _portal->_server->sendContent(data ?: "", length);
 }
 
 WiFiPortal::HTTPUploadStatus
@@ -349,12 +445,45 @@ ESPWiFiPortal::httpUploadBuffer() const
     return _server->upload().buf;
 }
 
+uint32_t
+ESPWiFiPortal::httpUploadRate() const
+{
+    uint32_t elapsed = System::millis() - _uploadStartTime;
+    return elapsed ? uint32_t(uint64_t(_server->upload().totalSize) * 1000 / elapsed) : 0;
+}
+
 std::string
 ESPWiFiPortal::getHTTPArg(const char* name)
 {
     return _server->arg(name).c_str();
 }
 
+std::string
+ESPWiFiPortal::getHTTPHeader(const char* name)
+{
+    // Only the headers passed to collectHeaders() in startWebServer are available
+    return _server->header(name).c_str();
+}
+
+void
+ESPWiFiPortal::addHTTPResponseHeader(const char* name, const char* value)
+{
+    _server->sendHeader(name, value);
+}
+
+void
+ESPWiFiPortal::addCacheControlHeader(int code)
+{
+    if (code != 200 && code != 206 && code != 304) {
+        return;
+    }
+    
+    const std::string& cacheControl = HTTPParser::cacheControl(_cacheControl, _server->uri().c_str());
+    if (!cacheControl.empty()) {
+        _server->sendHeader("Cache-Control", cacheControl.c_str());
+    }
+}
+
 std::string
 ESPWiFiPortal::getCPUModel() const
 {
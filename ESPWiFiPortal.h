@@ -22,12 +22,15 @@ public:
     virtual void begin(WebFileSystem*) override;
 
     virtual void setConfigHandler(HandlerCB) override;
-    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB requestCB) override;
+    using WiFiPortal::addHTTPHandler;
+    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod method, RequestHandlerCB requestCB) override;
     virtual void addStaticHTTPHandler(const char *uri, const char *path) override;
     virtual bool autoConnect(char const *apName, char const *apPassword = NULL) override;
     virtual void process() override;
     virtual std::string getIP() override;
     virtual const char* getSSID() override;
+    virtual Request* currentRequest() const override { return _context.get(); }
+    virtual Response* currentResponse() const override { return _context.get(); }
     virtual void sendHTTPResponse(int code, const char* mimetype = nullptr, const char* data = "") override;
     virtual void sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip) override;
     virtual void streamHTTPResponse(File& file, const char* mimetype, bool attach) override;
@@ -36,7 +39,11 @@ public:
     virtual size_t httpUploadTotalSize() const override;
     virtual size_t httpUploadCurrentSize() const override;
     virtual const uint8_t* httpUploadBuffer() const override;
+    virtual uint32_t httpUploadRate() const override;
     virtual std::string getHTTPArg(const char* name) override;
+    virtual std::string getHTTPHeader(const char* name) override;
+    virtual void addHTTPResponseHeader(const char* name, const char* value) override;
+    virtual void setCacheControl(const char* uri, const char* value) override { _cacheControl[uri] = value; }
     virtual std::string getCPUModel() const override;
     virtual uint32_t getCPUFrequency() const override;
     virtual float getCPUTemperature() const override;
@@ -47,6 +54,42 @@ public:
     virtual void eraseNVSParam(const char* id) override;
 
 private:
+    // The Arduino WebServer handles one request at a time, so the Request
+    // and Response passed to handlers mostly forward to the calls above
+    class Context : public Request, public Response
+    {
+      public:
+        Context(ESPWiFiPortal* portal) : _portal(portal) { }
+        
+        virtual std::string path() const override { return _portal->_server->uri().c_str(); }
+        virtual std::string arg(const char* name) const override { return _portal->getHTTPArg(name); }
+        virtual std::string header(const char* name) const override { return _portal->getHTTPHeader(name); }
+        
+        // WebServer parses the query and form bodies itself and doesn't
+        // give access to the raw body
+        virtual void parseQuery(const char* queryString) override { }
+        virtual HTTPUploadStatus uploadStatus() const override { return _portal->httpUploadStatus(); }
+        virtual std::string uploadFilename() const override { return _portal->httpUploadFilename(); }
+        virtual size_t uploadTotalSize() const override { return _portal->httpUploadTotalSize(); }
+        virtual size_t uploadCurrentSize() const override { return _portal->httpUploadCurrentSize(); }
+        virtual const uint8_t* uploadBuffer() const override { return _portal->httpUploadBuffer(); }
+        virtual uint32_t uploadRate() const override { return _portal->httpUploadRate(); }
+        virtual int read(char* buf, size_t size) override { return 0; }
+        
+        using Response::send;
+        virtual void addHeader(const char* name, const char* value) override { _portal->addHTTPResponseHeader(name, value); }
+        virtual void send(int code, const char* mimetype, const char* data, size_t length, bool gzip) override
+        {
+            _portal->sendHTTPResponse(code, mimetype, data, length, gzip);
+        }
+        virtual void stream(File& file, const char* mimetype, bool attach) override { _portal->streamHTTPResponse(file, mimetype, attach); }
+        virtual void beginChunked(int code, const char* mimetype) override;
+        virtual void sendChunk(const char* data, size_t length) override;
+    
+      private:
+        ESPWiFiPortal* _portal;
+    };
+    
     void scanNetworks();
     void startProvisioning();
     void startWebServer(bool provision);
@@ -56,11 +99,16 @@ private:
     void getWifiSetupHandler();
     
     void redirectRoot();
+    void addCacheControlHeader(int code);
+    
+    std::unique_ptr<Context> _context = std::make_unique<Context>(this);
     
     Preferences _prefs;
     std::unique_ptr<WebServer> _server;
     WebFileSystem* _wfs = nullptr;
     HandlerCB _configHandler;
+    uint32_t _uploadStartTime = 0;
+    std::map<std::string, std::string> _cacheControl;
 
     struct KnownNetwork
     {
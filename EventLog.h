@@ -0,0 +1,249 @@
+/*-------------------------------------------------------------------------
+This source file is a part of mil
+
+For the latest info, see http://www.marrin.org/
+
+Copyright (c) 2025, Chris Marrin
+All rights reserved.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "mil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// EventLog is a fixed size ring of recent events: log lines, Lua print
+// output and metrics samples. It's how they get to the browser as
+// Server-Sent Events.
+//
+// Adding an event is lock free, never allocates and never waits, so it
+// can be done from the log hot path on any thread. Each slot has a
+// sequence word. A producer claims the next event number, marks its slot
+// as being written, copies the event in and marks it done. When the ring
+// wraps the oldest event is overwritten. If the slot is still being
+// written from a lap ago the new event is dropped instead of waiting.
+//
+// Sequence numbers are as wide as the native atomics, 32 bits on the
+// ESP32, so they are allowed to wrap and are always compared by their
+// difference.
+//
+// Any number of Readers can follow the log, each with its own cursor.
+// A reader that falls behind doesn't hold up anyone. It just finds its
+// events overwritten and is told how many it missed.
+
+namespace mil {
+
+class EventLog
+{
+  public:
+    enum class Type : uint8_t { Log, Print, Metrics };
+
+#if defined ARDUINO || defined ESP_PLATFORM
+    static constexpr size_t Capacity = 32;
+    using Seq = uint32_t;
+#else
+    static constexpr size_t Capacity = 256;
+    using Seq = uint64_t;
+#endif
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+    // Longer events are truncated
+    static constexpr size_t MaxEventSize = 126;
+
+    struct Event
+    {
+        Type type;
+        uint8_t size;
+        char data[MaxEventSize];
+
+        std::string_view view() const { return std::string_view(data, size); }
+    };
+
+    // The parts are concatenated into one event
+    static void add(Type type, std::initializer_list<std::string_view> parts)
+    {
+        Seq seq = _head.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = _slots[seq & (Capacity - 1)];
+
+        // The slot is free if it holds an older event that is done. If it's
+        // still being written, or a producer that claimed it a lap later
+        // got there first, this event is dropped
+        Seq state = slot.state.load(std::memory_order_relaxed);
+        if ((state & 1) || diff(state, writingState(seq)) > 0) {
+            return;
+        }
+        if (!slot.state.compare_exchange_strong(state, writingState(seq), std::memory_order_relaxed)) {
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+
+        size_t size = 0;
+        for (std::string_view part : parts) {
+            size_t n = std::min(part.size(), MaxEventSize - size);
+            memcpy(slot.event.data + size, part.data(), n);
+            size += n;
+        }
+        slot.event.type = type;
+        slot.event.size = uint8_t(size);
+
+        slot.state.store(doneState(seq), std::memory_order_release);
+    }
+
+    static void add(Type type, std::string_view s) { add(type, { s }); }
+
+    // Producers of events that are expensive to make, like metrics, can
+    // skip them when no one is reading
+    static uint32_t readers() { return _readers.load(std::memory_order_relaxed); }
+
+    // A Reader starts with the oldest event still in the log
+    class Reader
+    {
+      public:
+        Reader()
+        {
+            Seq head = _head.load(std::memory_order_relaxed);
+            _next = (head > Capacity) ? head - Capacity : 0;
+            _readers.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        ~Reader() { _readers.fetch_sub(1, std::memory_order_relaxed); }
+
+        // Copy out the next event. Return false if there isn't one yet
+        bool next(Event& event)
+        {
+            while (true) {
+                Seq head = _head.load(std::memory_order_acquire);
+                if (diff(_next, head) >= 0) {
+                    return false;
+                }
+
+                // Anything more than a lap behind has been overwritten
+                if (head - _next > Capacity) {
+                    _dropped += head - Capacity - _next;
+                    _next = head - Capacity;
+                }
+
+                const Slot& slot = _slots[_next & (Capacity - 1)];
+                Seq state = slot.state.load(std::memory_order_acquire);
+
+                if (state == writingState(_next)) {
+                    return false;
+                }
+
+                if (diff(state, writingState(_next)) < 0) {
+                    // The event was claimed but not written. Either its
+                    // producer hasn't gotten to it yet or it was dropped.
+                    // Give it until the next call before skipping it
+                    if (_stalled != _next) {
+                        _stalled = _next;
+                        return false;
+                    }
+                    _dropped++;
+                    _next++;
+                    continue;
+                }
+
+                if (state == doneState(_next)) {
+                    memcpy(&event, &slot.event, sizeof(Event));
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (slot.state.load(std::memory_order_relaxed) == state) {
+                        _next++;
+                        return true;
+                    }
+                }
+
+                // Overwritten by a later lap while we were looking
+                _dropped++;
+                _next++;
+            }
+        }
+
+        // The number of events lost since the last call, either
+        // overwritten before this reader got to them or dropped by
+        // their producer. Ask after each event from next() to find
+        // out if there was a gap before it
+        uint64_t takeDropped()
+        {
+            uint64_t dropped = _dropped;
+            _dropped = 0;
+            return dropped;
+        }
+
+      private:
+        Seq _next = 0;
+        Seq _stalled = Seq(-1);
+        uint64_t _dropped = 0;
+    };
+
+    // Format an event for a text/event-stream. The event name is the type.
+    // Each line of the event is a data line
+    static void appendServerSentEvent(std::string& s, const Event& event)
+    {
+        static constexpr const char* Names[] = { "log", "print", "metrics" };
+
+        s += "event: ";
+        s += Names[size_t(event.type)];
+        s += '\n';
+
+        // A print usually ends with a newline. The event already does
+        std::string_view data = event.view();
+        if (!data.empty() && data.back() == '\n') {
+            data.remove_suffix(1);
+        }
+        while (true) {
+            size_t eol = data.find('\n');
+            s += "data: ";
+            s += data.substr(0, eol);
+            s += '\n';
+            if (eol == std::string_view::npos) {
+                break;
+            }
+            data.remove_prefix(eol + 1);
+        }
+        s += '\n';
+    }
+
+    static void appendDropped(std::string& s, uint64_t count)
+    {
+        s += "event: dropped\ndata: ";
+        s += std::to_string(count);
+        s += "\n\n";
+    }
+
+  private:
+    // Event n is being written while its slot's state is 2n+1 and is done
+    // when it's 2n+2. So 0 is an empty slot, which is done with event -1
+    static constexpr Seq writingState(Seq seq) { return 2 * seq + 1; }
+    static constexpr Seq doneState(Seq seq) { return 2 * seq + 2; }
+
+    // Positive if a is after b, even across a wrap
+    static constexpr std::make_signed_t<Seq> diff(Seq a, Seq b) { return std::make_signed_t<Seq>(a - b); }
+
+    // Chips without atomic instructions, like the ESP32-C3, can only
+    // emulate them, so the check is left to the ones that have them
+#if !defined __riscv || defined __riscv_atomic
+    static_assert(std::atomic<Seq>::is_always_lock_free, "EventLog needs lock free atomics");
+#endif
+
+    struct Slot
+    {
+        std::atomic<Seq> state;    // Zero, since the slots are static
+        Event event;
+    };
+
+    static inline Slot _slots[Capacity];
+    static inline std::atomic<Seq> _head { 0 };
+    static inline std::atomic<uint32_t> _readers { 0 };
+};
+
+}
@@ -14,11 +14,208 @@ All rights reserved.
 #include "WebFileSystem.h"
 
 #include <cstring>
+#include <strings.h>
 
 using namespace mil;
 
+void*
+Arena::allocate(size_t size, size_t align)
+{
+    _used += size;
+    
+    if (_current < _blocks.size()) {
+        size_t offset = (_offset + align - 1) & ~(align - 1);
+        if (offset + size <= _blocks[_current].size) {
+            _offset = offset + size;
+            return _blocks[_current].data.get() + offset;
+        }
+        
+        // Move on to the next block big enough. Blocks are allocated with
+        // new[], so the start of each is aligned for anything
+        while (++_current < _blocks.size()) {
+            if (size <= _blocks[_current].size) {
+                _offset = size;
+                return _blocks[_current].data.get();
+            }
+        }
+    }
+    
+    size_t blockSize = std::max(size, _blockSize);
+    _blocks.push_back({ std::make_unique<char[]>(blockSize), blockSize });
+    _capacity += blockSize;
+    _current = _blocks.size() - 1;
+    _offset = size;
+    return _blocks[_current].data.get();
+}
+
+std::string_view
+Arena::copy(std::string_view s)
+{
+    if (s.empty()) {
+        return std::string_view();
+    }
+    char* p = static_cast<char*>(allocate(s.size(), 1));
+    memcpy(p, s.data(), s.size());
+    return std::string_view(p, s.size());
+}
+
+const char*
+Arena::copyString(std::string_view s)
+{
+    char* p = static_cast<char*>(allocate(s.size() + 1, 1));
+    memcpy(p, s.data(), s.size());
+    p[s.size()] = '\0';
+    return p;
+}
+
+void
+HTTPReader::consume(size_t size)
+{
+    _start += size;
+    if (_limit != NoLimit) {
+        _limit -= size;
+    }
+    if (_start == _end) {
+        _start = _end = 0;
+    }
+}
+
+void
+HTTPReader::compact()
+{
+    if (_start > 0) {
+        memmove(_buffer.data(), _buffer.data() + _start, _end - _start);
+        _end -= _start;
+        _start = 0;
+    }
+}
+
+uint8_t*
+HTTPReader::prepare(size_t& space)
+{
+    if (_end == _buffer.size()) {
+        compact();
+    }
+    space = _buffer.size() - _end;
+    return _buffer.data() + _end;
+}
+
+bool
+HTTPReader::fill(size_t size)
+{
+    // Data past the limit can't be had. Read up to it anyway, for callers
+    // that take whatever is there
+    bool limited = size > _limit;
+    size = std::min(std::min(size, _limit), _buffer.size());
+    
+    while (_end - _start < size) {
+        if (!_readCB) {
+            return false;
+        }
+        
+        size_t space;
+        uint8_t* buf = prepare(space);
+        ssize_t result = _readCB(buf, space);
+        if (result <= 0) {
+            return false;
+        }
+        _end += result;
+    }
+    return !limited;
+}
+
+std::string_view
+HTTPReader::read(size_t maxSize)
+{
+    if (peek().empty() && !fill(1)) {
+        return std::string_view();
+    }
+    
+    std::string_view data = peek();
+    data = data.substr(0, std::min(data.size(), maxSize));
+    consume(data.size());
+    return data;
+}
+
+bool
+HTTPReader::getLine(std::string_view& line)
+{
+    size_t searched = 0;
+    
+    while (true) {
+        std::string_view data = peek();
+        size_t pos = data.find('\n', searched);
+        if (pos != std::string_view::npos) {
+            line = data.substr(0, pos);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            consume(pos + 1);
+            return true;
+        }
+        
+        // No end of line before the limit means there never will be
+        searched = data.size();
+        if (searched >= _buffer.size() || searched >= _limit || !fill(searched + 1)) {
+            return false;
+        }
+    }
+}
+
+BoundaryMatcher::BoundaryMatcher(const std::string& delimiter)
+    : _delimiter(delimiter)
+{
+    // Skips are clamped to 255. A shorter skip is always safe, and
+    // delimiters are limited to 74 bytes anyway (RFC 2046)
+    size_t length = _delimiter.length();
+    uint8_t maxSkip = uint8_t(std::min(length, size_t(255)));
+    memset(_skip, maxSkip, sizeof(_skip));
+    
+    for (size_t i = 0; i + 1 < length; ++i) {
+        _skip[uint8_t(_delimiter[i])] = uint8_t(std::min(length - 1 - i, size_t(255)));
+    }
+}
+
+size_t
+BoundaryMatcher::find(std::string_view data, size_t& safeSize) const
+{
+    size_t length = _delimiter.length();
+    const char* d = _delimiter.data();
+    const char* p = data.data();
+    size_t size = data.size();
+    
+    // Compare the last byte of the window first, then the rest. Either
+    // way, step by the skip for the last byte
+    size_t i = 0;
+    char last = d[length - 1];
+    while (i + length <= size) {
+        char c = p[i + length - 1];
+        if (c == last && memcmp(p + i, d, length - 1) == 0) {
+            safeSize = i;
+            return i;
+        }
+        i += _skip[uint8_t(c)];
+    }
+    
+    // No match. Every position before size - length + 1 has been ruled out.
+    // Look for the start of a partial delimiter in the tail.
+    safeSize = size;
+    for (size_t start = (size >= length) ? (size - length + 1) : 0; start < size; ++start) {
+        const void* found = memchr(p + start, d[0], size - start);
+        if (!found) {
+            break;
+        }
+        start = static_cast<const char*>(found) - p;
+        if (memcmp(p + start, d, size - start) == 0) {
+            safeSize = start;
+            break;
+        }
+    }
+    return std::string_view::npos;
+}
+
 bool
-HTTPParser::parseMultipart(size_t size, const std::string& boundary, HandlerCB requestCB, ReadCB readCB)
+HTTPParser::parseMultipart(size_t size, const std::string& boundary, HandlerCB requestCB, HTTPReader& reader)
 {
     // For now we handle ContentType: multipart. We accept exactly 2 parts. The first
     // is a key value pair which is placed in _argMap. The second is the uploaded file
@@ -31,27 +228,36 @@ HTTPParser::parseMultipart(size_t size, const std::string& boundary, HandlerCB r
     bool done = false;
     
     while (!done) {
-        std::string line;
+        std::string_view line;
         
         // If we just uploaded a file then we already read the boundary following it.
         // Otherwise the next line is a boundary
         if (nextLineIsBoundary) {
-            line = getLine(readCB);
+            if (!reader.getLine(line)) {
+                setErrorResponse(400, "read error");
+                return false;
+            }
 
-            // Ignore the first 2 characters of the boundary
-            if (line.length() < 2 || line.substr(2) != boundary) {
+            // Ignore the first 2 characters of the boundary. A trailing "--" marks the last one
+            if (line.length() < 2 || line.substr(2, boundary.length()) != boundary) {
                 setErrorResponse(400, "missing boundary");
                 return false;
             }
+            if (line.substr(2 + boundary.length()) == "--") {
+                break;
+            }
         } else {
             // For next time. If we upload a file then we set this to false
             nextLineIsBoundary = true;
         }
         
         // First line of each section is a Content-Disposition
-        line = getLine(readCB);
+        if (!reader.getLine(line)) {
+            setErrorResponse(400, "read error");
+            return false;
+        }
 
-        std::vector<std::string> parsedValue = parseKeyValue(line);
+        std::vector<std::string> parsedValue = parseKeyValue(std::string(line));
         
         if (parsedValue.size() < 2 || parsedValue[0] != "Content-Disposition") {
             setErrorResponse(400, "missing Content-Disposition");
@@ -84,14 +290,16 @@ HTTPParser::parseMultipart(size_t size, const std::string& boundary, HandlerCB r
         if (parsedValue.size() < 5) {
             // This is a query param. The key is in multipart[2]. The value is
             // content, which comes after a blank line
-            line = getLine(readCB);
-            if (line[0] != '\0') {
+            if (!reader.getLine(line) || !line.empty()) {
                 setErrorResponse(400, "should be blank line");
                 return false;
             }
             
-            line = getLine(readCB);
-            _args[key] = line;
+            if (!reader.getLine(line)) {
+                setErrorResponse(400, "read error");
+                return false;
+            }
+            addArg(key, line);
         } else {
             if (parsedValue[3] != "filename") {
                 setErrorResponse(400, "missing filename");
@@ -103,21 +311,23 @@ HTTPParser::parseMultipart(size_t size, const std::string& boundary, HandlerCB r
             nextLineIsBoundary = false;
 
             // Set the filename
-            _uploadFilename = removeQuotes(parsedValue[4]);
+            _uploadFilename = _arena.copy(removeQuotes(parsedValue[4]));
                 
             // We're at the content. But first the next line should be "Content-Type"
-            line = getLine(readCB);
-            parsedValue = parseKeyValue(line);
+            if (!reader.getLine(line)) {
+                setErrorResponse(400, "read error");
+                return false;
+            }
+            parsedValue = parseKeyValue(std::string(line));
             if (parsedValue.size() < 2 || parsedValue[0] != "Content-Type") {
                 setErrorResponse(400, "missing Content-Type");
                 return false;
             }
 
-            _uploadMimetype = parsedValue[1];
+            _uploadMimetype = _arena.copy(parsedValue[1]);
             
            // Now let's get to the content, the next line should be blank
-            line = getLine(readCB);
-            if (line[0] != '\0') {
+            if (!reader.getLine(line) || !line.empty()) {
                 setErrorResponse(400, "line should be blank");
                 return false;
             }
@@ -127,116 +337,57 @@ HTTPParser::parseMultipart(size_t size, const std::string& boundary, HandlerCB r
 
             // Start upload
             _uploadStatus = WiFiPortal::HTTPUploadStatus::Start;
+            _uploadStartTime = System::millis();
             if (requestCB) {
                 requestCB();
             }
             
-            int bufferOverflow = 0;
-            int index = 0;
             _uploadTotalSize = 0;
 
             bool aborted = false;
             
+            // The file data ends at a CRLF followed by "--" and the boundary.
+            // Fill the reader's buffer, then send everything up to the
+            // delimiter if it's there. If not, send everything except a tail
+            // that could be the start of a delimiter split across reads.
+            BoundaryMatcher matcher("\r\n--" + boundary);
+            
+            _uploadStatus = WiFiPortal::HTTPUploadStatus::Write;
+
             while (true) {
-                // We need to read one byte at a time.
-                // As we go we need to check for the boundary string while
-                // we keep accumulating data in the buffer. If we do hit
-                // the boundary string we need to return the buffer data
-                // up to the start of the string and this is the last buffer.
-                // If it fails we need to send UploadBufferReturnSize bytes
-                // then put the remaining data at the head of the buffer
-                // and continue reading. The actual size of the buffer
-                // (UploadBufferActualSize) is big enough to hold the extra
-                // bytes while we're checking for the boundary string.
-                //
-                _uploadStatus = WiFiPortal::HTTPUploadStatus::Write;
-
-                ssize_t size = readCB(_uploadBuffer + index, 1);
-                if (size != 1) {
+                reader.fill(reader.capacity());
+                std::string_view data = reader.peek();
+                
+                size_t sendSize;
+                size_t pos = matcher.find(data, sendSize);
+                if (pos == std::string_view::npos && sendSize == 0) {
+                    // Nothing but a partial delimiter and no more data
                     setErrorResponse(400, "read error");
                     aborted = true;
                     break;
                 }
-
-                bool haveBoundary = false;
-                if (_uploadBuffer[index] == '\r') {
-                    // We need to add "\n--" to the start of the boundary
-                    std::string testBoundary = "\n--" + boundary;
-
-                    haveBoundary = true;
-                    ++index;
-                    // This might be the boundary
-                     // We start at -3 because we need to check the \n-- at the start of the boundary
-                    for (int i = 0; i < testBoundary.size(); ++i, ++index) {
-                        size = readCB(_uploadBuffer +index, 1);
-                        if (size != 1) {
-                            setErrorResponse(400, "read error");
-                            aborted = true;
-                            break;
-                        }
-                    
-                        if (_uploadBuffer[index] != testBoundary[i]) {
-                            // This is not the boundary
-                            haveBoundary = false;
-                            ++index;
-                            if (index > UploadBufferReturnSize) {
-                                // We are in the overflow area. Set the buffer
-                                // size to UploadBufferReturnSize. After sending
-                                // the data move the overflow to the start of the
-                                // buffer and continue
-                                bufferOverflow = index - UploadBufferReturnSize;;
-                                index = UploadBufferReturnSize;
-                            }
-                            break;
-                        }
-                    }
-                    
-                    if (haveBoundary) {
-                        // After the boundary there should be a --\r\n if
-                        // we're at the last file or \r\n if not
-                        uint8_t endBuf[2];
-                        size = readCB(endBuf, 2);
-                        if (size != 2) {
-                            setErrorResponse(400, "read error");
-                            aborted = true;
-                            break;
-                        }
-                        if (endBuf[0] == '-' && endBuf[1] == '-') {
-                            // We're done
-                            done = true;
-                            size = readCB(endBuf, 2);
-                        }
-                        if (endBuf[0] != '\r' || endBuf[1] != '\n') {
-                            setErrorResponse(400, "missing end of line");
-                            aborted = true;
-                            break;
-                        }
-                    }
-                } else {
-                    ++index;
-                }
                 
-                if (index == UploadBufferReturnSize || haveBoundary) {
-                    // Send the buffer
-                    _uploadCurrentSize = haveBoundary ? (index - boundary.size() - 4) : UploadBufferReturnSize;
+                if (sendSize > 0) {
+                    _uploadBuffer = reinterpret_cast<const uint8_t*>(data.data());
+                    _uploadCurrentSize = sendSize;
                     _uploadTotalSize += _uploadCurrentSize;
                     if (requestCB) {
                         requestCB();
-                        System::delay(10);
-                    }
-                    index = 0;
-                    
-                    // Deal with any overflow
-                    if (bufferOverflow > 0) {
-                        memcpy(_uploadBuffer, _uploadBuffer + UploadBufferReturnSize, bufferOverflow);
-                        index = bufferOverflow;
-                        bufferOverflow = 0;
                     }
+                    reader.consume(sendSize);
+                    _uploadBuffer = nullptr;
+                }
                 
-                    // Break when we've sent all the data
-                    if (haveBoundary) {
-                        break;
+                if (pos != std::string_view::npos) {
+                    // After the boundary there should be a --\r\n if
+                    // we're at the last file or \r\n if not
+                    reader.consume(matcher.delimiter().size());
+                    if (!reader.getLine(line) || (line != "--" && !line.empty())) {
+                        setErrorResponse(400, "missing end of line");
+                        aborted = true;
                     }
+                    done = line == "--";
+                    break;
                 }
             }
 
@@ -244,82 +395,86 @@ HTTPParser::parseMultipart(size_t size, const std::string& boundary, HandlerCB r
             if (requestCB) {
                 requestCB();
             }
+            
+            if (aborted) {
+                return false;
+            }
         }
     }
     return true;
 }
 
-std::string
-HTTPParser::getLine(ReadCB cb)
+uint32_t
+HTTPParser::httpUploadRate() const
 {
-    std::string s;
-    int32_t waitCount = 100;
-    
-    // Get a line
-    bool needNewLine = false;
-    
-    while (true) {
-        uint8_t c;
-        ssize_t size = cb(&c, 1);
-        if (size != 1) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("error from read during getLine");
-                return "";
-            }
-            if (waitCount-- <= 0) {
-                return "";
-            }
-            System::delay(1);
-            continue;
-        }
+    uint32_t elapsed = System::millis() - _uploadStartTime;
+    return elapsed ? uint32_t(uint64_t(_uploadTotalSize) * 1000 / elapsed) : 0;
+}
 
-        if (needNewLine) {
-            if (c == '\n') {
-                break;
-            } else {
-                printf("Expected newline in parseRequest\n");
-                return "";
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? (c - 'a' + 10) : -1;
+}
+
+// Decode '+' and % hex codes from in to out, which can be the same buffer.
+// Returns the decoded size or npos if there's a bad hex code
+static size_t decodeURL(std::string_view in, char* out)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        char c = in[i];
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%') {
+            if (i + 2 >= in.size()) {
+                return std::string_view::npos;
             }
+            int hi = hexValue(in[i + 1]);
+            int lo = hexValue(in[i + 2]);
+            if (hi < 0 || lo < 0) {
+                return std::string_view::npos;
+            }
+            c = char(hi << 4 | lo);
+            i += 2;
         }
-        
-        if (c == '\r') {
-            needNewLine = true;
-        } else if (c) {
-            s += c;
-        } else {
-            break;
-        }
+        out[size++] = c;
     }
-    return s;
+    return size;
 }
 
 std::string
 HTTPParser::urlDecode(const std::string& s)
 {
-    // Convert '+' to space
     std::string result = s;
-    std::replace( result.begin(), result.end(), '+', ' ');
-    
-    // Convert % hex codes
-    std::vector<std::string> parts = split(result, '%');
-    result = parts[0];
-    parts.erase(parts.begin());
+    size_t size = decodeURL(result, result.data());
+    if (size == std::string_view::npos) {
+        printf("**** Error: invalid hex code\n");
+        return "";
+    }
+    result.resize(size);
+    return result;
+}
+
+std::string
+HTTPParser::urlEncode(std::string_view s)
+{
+    static const char* hex = "0123456789ABCDEF";
     
-    for (const auto& it : parts) {
-        // First 2 chars are the hex code
-        if (it.size() < 2) {
-            printf("**** Error: invalid hex code\n");
-            return "";
+    std::string result;
+    result.reserve(s.size());
+    for (char c : s) {
+        if (isalnum(uint8_t(c)) || c == '-' || c == '_' || c == '.' || c == '~') {
+            result += c;
+        } else {
+            result += '%';
+            result += hex[uint8_t(c) >> 4];
+            result += hex[uint8_t(c) & 0xf];
         }
-        
-        char buf[3] = "XX";
-        buf[0] = it[0];
-        buf[1] = it[1];
-        uint8_t hex = strtol(buf, nullptr, 16);
-        result += char(hex);
-        result += it.substr(2);
     }
-    
     return result;
 }
 
@@ -363,56 +518,362 @@ HTTPParser::removeQuotes(const std::string& s)
     return s;
 }
 
-struct SuffixToTypeEntry
+static bool parseRangeValue(std::string_view s, size_t& value)
+{
+    if (s.empty() || s.size() > 19) {
+        return false;
+    }
+    
+    value = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+HTTPParser::RangeStatus
+HTTPParser::parseRange(const std::string& range, size_t size, size_t& start, size_t& length)
+{
+    std::string value = trimWhitespace(range);
+    if (strncasecmp(value.c_str(), "bytes=", 6) != 0) {
+        return RangeStatus::None;
+    }
+    
+    std::string_view spec = std::string_view(value).substr(6);
+    if (spec.find(',') != std::string_view::npos) {
+        return RangeStatus::None;
+    }
+    
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+        return RangeStatus::None;
+    }
+    
+    std::string_view first = spec.substr(0, dash);
+    std::string_view last = spec.substr(dash + 1);
+    
+    if (first.empty()) {
+        // Suffix range, the last n bytes
+        size_t suffixLength;
+        if (!parseRangeValue(last, suffixLength)) {
+            return RangeStatus::None;
+        }
+        if (suffixLength == 0 || size == 0) {
+            return RangeStatus::Unsatisfiable;
+        }
+        start = (suffixLength < size) ? (size - suffixLength) : 0;
+        length = size - start;
+        return RangeStatus::Partial;
+    }
+    
+    size_t end = SIZE_MAX;
+    if (!parseRangeValue(first, start) || (!last.empty() && !parseRangeValue(last, end)) || end < start) {
+        return RangeStatus::None;
+    }
+    
+    if (start >= size) {
+        return RangeStatus::Unsatisfiable;
+    }
+    
+    length = std::min(end, size - 1) - start + 1;
+    return RangeStatus::Partial;
+}
+
+bool
+HTTPParser::ifRangeMatches(const std::string& ifRange, const std::string& validator)
+{
+    if (ifRange.empty()) {
+        return true;
+    }
+    
+    // Weak entity tags never match
+    std::string value = trimWhitespace(ifRange);
+    return !validator.empty() && value == validator && value.compare(0, 2, "W/") != 0;
+}
+
+std::string
+HTTPParser::contentRange(size_t start, size_t length, size_t size)
 {
-    const char* suffix;
+    if (length == 0) {
+        return "bytes */" + std::to_string(size);
+    }
+    return "bytes " + std::to_string(start) + "-" + std::to_string(start + length - 1) + "/" + std::to_string(size);
+}
+
+std::string
+HTTPParser::makeETag(const void* data, size_t length)
+{
+    // 64 bit FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ p[i]) * 0x100000001b3;
+    }
+    
+    char buf[24];
+    snprintf(buf, sizeof(buf), "\"%016llx\"", static_cast<unsigned long long>(hash));
+    return buf;
+}
+
+std::string
+HTTPParser::makeETag(size_t size, time_t lastModified)
+{
+    char buf[40];
+    snprintf(buf, sizeof(buf), "\"%llx-%llx\"", static_cast<unsigned long long>(lastModified), static_cast<unsigned long long>(size));
+    return buf;
+}
+
+std::string
+HTTPParser::httpDate(time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+bool
+HTTPParser::notModified(const std::string& ifNoneMatch, const std::string& ifModifiedSince,
+                        const std::string& etag, const std::string& lastModified)
+{
+    if (!ifNoneMatch.empty()) {
+        if (etag.empty()) {
+            return false;
+        }
+        
+        // Comma separated list of entity tags, compared weakly
+        std::string_view tag = etag;
+        if (tag.substr(0, 2) == "W/") {
+            tag.remove_prefix(2);
+        }
+        
+        for (const auto& it : split(ifNoneMatch, ',')) {
+            std::string value = trimWhitespace(it);
+            if (value == "*") {
+                return true;
+            }
+            std::string_view v = value;
+            if (v.substr(0, 2) == "W/") {
+                v.remove_prefix(2);
+            }
+            if (v == tag) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    return !ifModifiedSince.empty() && !lastModified.empty() && trimWhitespace(ifModifiedSince) == lastModified;
+}
+
+const std::string&
+HTTPParser::cacheControl(const ArgMap& table, std::string_view path)
+{
+    static const std::string none;
+    
+    // The map is sorted, so the longest prefix is the last match before path
+    auto it = table.upper_bound(path);
+    while (it != table.begin()) {
+        --it;
+        if (path.substr(0, it->first.length()) == it->first) {
+            return it->second;
+        }
+    }
+    return none;
+}
+
+bool
+HTTPParser::acceptsGzip(const std::string& acceptEncoding)
+{
+    int gzip = -1;
+    int wildcard = -1;
+    
+    for (const auto& entry : split(acceptEncoding, ',')) {
+        std::vector<std::string> params = split(entry, ';');
+        std::string coding = trimWhitespace(params[0]);
+        
+        bool accepted = true;
+        for (size_t i = 1; i < params.size(); ++i) {
+            std::string param = trimWhitespace(params[i]);
+            if (param.length() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                accepted = strtod(param.c_str() + 2, nullptr) > 0;
+            }
+        }
+        
+        if (strcasecmp(coding.c_str(), "gzip") == 0 || strcasecmp(coding.c_str(), "x-gzip") == 0) {
+            gzip = accepted;
+        } else if (coding == "*") {
+            wildcard = accepted;
+        }
+    }
+    
+    return (gzip >= 0) ? gzip : (wildcard > 0);
+}
+
+// Mime types are looked up with a perfect hash built at compile time. The
+// hash seed is searched for until every suffix lands in its own slot, so a
+// lookup is one hash of the lowercased suffix and one compare. Suffixes
+// have to be lowercase and unique.
+
+struct MimeType
+{
+    std::string_view suffix;
     const char* type;
 };
 
-SuffixToTypeEntry suffixToTypeArray[ ] = {
-    { "htm",  "text/html" },
-    { "html", "text/html" },
-    { "css",  "text/css" },
-    { "js",   "text/javascript" },
-    { "png",  "image/png" },
-    { "gif",  "text/gif" },
-    { "jpg",  "image/jpeg" },
-    { "jpeg", "image/jpeg" },
-    { "jpeg", "image/jpeg" },
-    { "pdf",  "application/pdf" },
-    { "txt",  "text/plain" },
-    { "c",    "text/plain" },
-    { "h",    "text/plain" },
-    { "cpp",  "text/plain" },
-    { "hpp",  "text/plain" },
+static constexpr MimeType mimeTypes[] = {
+    { "htm",            "text/html" },
+    { "html",           "text/html" },
+    { "css",            "text/css" },
+    { "js",             "text/javascript" },
+    { "mjs",            "text/javascript" },
+    { "json",           "application/json" },
+    { "map",            "application/json" },
+    { "webmanifest",    "application/manifest+json" },
+    { "xml",            "application/xml" },
+    { "wasm",           "application/wasm" },
+    { "pdf",            "application/pdf" },
+    { "zip",            "application/zip" },
+    { "gz",             "application/gzip" },
+    { "bin",            "application/octet-stream" },
+    { "txt",            "text/plain" },
+    { "log",            "text/plain" },
+    { "c",              "text/plain" },
+    { "h",              "text/plain" },
+    { "cpp",            "text/plain" },
+    { "hpp",            "text/plain" },
+    { "md",             "text/markdown" },
+    { "csv",            "text/csv" },
+    { "lua",            "text/x-lua" },
+    { "png",            "image/png" },
+    { "gif",            "image/gif" },
+    { "jpg",            "image/jpeg" },
+    { "jpeg",           "image/jpeg" },
+    { "svg",            "image/svg+xml" },
+    { "ico",            "image/x-icon" },
+    { "webp",           "image/webp" },
+    { "bmp",            "image/bmp" },
+    { "woff",           "font/woff" },
+    { "woff2",          "font/woff2" },
+    { "ttf",            "font/ttf" },
+    { "otf",            "font/otf" },
+    { "mp3",            "audio/mpeg" },
+    { "wav",            "audio/wav" },
+    { "ogg",            "audio/ogg" },
+    { "mp4",            "video/mp4" },
+    { "webm",           "video/webm" },
 };
 
-// Returns empty string if file is not a source file (cannot be displayed in web browser)
-std::string
-HTTPParser::suffixToMimeType(const std::string& filename)
+static constexpr size_t MimeTableSize = 256;
+static constexpr size_t MaxSuffixLength = 11;
+
+static constexpr uint8_t mimeHash(std::string_view suffix, uint32_t seed)
 {
-    std::string suffix = WebFileSystem::extension(filename);
-    for_each(suffix.begin(), suffix.end(), [](char& c) {
-        c = std::tolower(c);
-    });
-    
-    for (const auto& it : suffixToTypeArray) {
-        if (strcmp(it.suffix, suffix.c_str()) == 0) {
-            return it.type;
+    // FNV-1a, using the top bits which are the best mixed
+    uint32_t hash = seed;
+    for (char c : suffix) {
+        hash = (hash ^ uint8_t(c)) * 16777619;
+    }
+    return uint8_t(hash >> 24);
+}
+
+static constexpr bool validMimeTypes()
+{
+    for (size_t i = 0; i < std::size(mimeTypes); ++i) {
+        if (mimeTypes[i].suffix.size() > MaxSuffixLength) {
+            return false;
+        }
+        for (char c : mimeTypes[i].suffix) {
+            if (c >= 'A' && c <= 'Z') {
+                return false;
+            }
+        }
+        for (size_t j = 0; j < i; ++j) {
+            if (mimeTypes[i].suffix == mimeTypes[j].suffix) {
+                return false;
+            }
         }
     }
-    return "";
+    return std::size(mimeTypes) < MimeTableSize;
+}
+
+static_assert(validMimeTypes(), "mime suffixes must be unique, lowercase and at most MaxSuffixLength long");
+
+static constexpr uint32_t findMimeSeed()
+{
+    for (uint32_t seed = 2166136261; ; ++seed) {
+        bool used[MimeTableSize] = { };
+        bool collision = false;
+        for (const auto& it : mimeTypes) {
+            uint8_t slot = mimeHash(it.suffix, seed);
+            collision = used[slot];
+            if (collision) {
+                break;
+            }
+            used[slot] = true;
+        }
+        if (!collision) {
+            return seed;
+        }
+    }
+}
+
+static constexpr uint32_t MimeSeed = findMimeSeed();
+
+// Slots hold an index into mimeTypes plus one, 0 is empty
+static constexpr std::array<uint8_t, MimeTableSize> makeMimeTable()
+{
+    std::array<uint8_t, MimeTableSize> table { };
+    for (size_t i = 0; i < std::size(mimeTypes); ++i) {
+        table[mimeHash(mimeTypes[i].suffix, MimeSeed)] = uint8_t(i + 1);
+    }
+    return table;
+}
+
+static constexpr std::array<uint8_t, MimeTableSize> mimeTable = makeMimeTable();
+
+const char*
+HTTPParser::suffixToMimeType(std::string_view filename)
+{
+    size_t dot = filename.rfind('.');
+    if (dot == std::string_view::npos || filename.find('/', dot) != std::string_view::npos) {
+        return "";
+    }
+    
+    std::string_view suffix = filename.substr(dot + 1);
+    if (suffix.empty() || suffix.size() > MaxSuffixLength) {
+        return "";
+    }
+    
+    char lower[MaxSuffixLength];
+    for (size_t i = 0; i < suffix.size(); ++i) {
+        char c = suffix[i];
+        lower[i] = (c >= 'A' && c <= 'Z') ? (c + ('a' - 'A')) : c;
+    }
+    suffix = std::string_view(lower, suffix.size());
+    
+    uint8_t index = mimeTable[mimeHash(suffix, MimeSeed)];
+    if (index == 0 || mimeTypes[index - 1].suffix != suffix) {
+        return "";
+    }
+    return mimeTypes[index - 1].type;
 }
 
 // Key/value pairs is separated by ':'
 std::vector<std::string>
 HTTPParser::parseKeyValue(const std::string& s)
 {
-    // Handle key:value pairs
-    std::vector<std::string> line = split(s, ':');
-    line[0] = trimWhitespace(line[0]);
-    line[1] = trimWhitespace(line[1]);
-    return line;
+    // Handle key:value pairs. Only split at the first colon, values
+    // like dates and host:port have more. Without a colon there's no value
+    size_t colon = s.find(':');
+    if (colon == std::string::npos) {
+        return { trimWhitespace(s) };
+    }
+    return { trimWhitespace(s.substr(0, colon)), trimWhitespace(s.substr(colon + 1)) };
 }
 
 // FormData has this form:
@@ -446,67 +907,219 @@ HTTPParser::parseFormData(const std::string& value)
     return retVal;
 }
 
+static std::string_view trim(std::string_view s)
+{
+    size_t start = s.find_first_not_of(" \t");
+    if (start == std::string_view::npos) {
+        return std::string_view();
+    }
+    return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
 void
-HTTPParser::parseQuery(const std::string& query)
+HTTPParser::addArg(std::string_view name, std::string_view value)
+{
+    _args.push_back({ _arena.copy(name), _arena.copy(value) });
+}
+
+void
+HTTPParser::parseArgs(std::string_view query)
 {
     // Query string is key/value pairs separated by '&'.
     // Each key value pair is <key>=<value>
-    std::vector<std::string> keyValue = split(query, '&');
-    
-    for (const auto& it : keyValue) {
-        if (it.empty()) {
+    while (!query.empty()) {
+        size_t end = query.find('&');
+        std::string_view pair = query.substr(0, end);
+        query = (end == std::string_view::npos) ? std::string_view() : query.substr(end + 1);
+        
+        if (pair.empty()) {
             continue;
         }
-        std::vector<std::string> kvPairs = split(it, '=');
-        if (kvPairs.size() != 2) {
+        size_t equals = pair.find('=');
+        if (equals == std::string_view::npos || pair.find('=', equals + 1) != std::string_view::npos) {
             printf("**** Invalid query key/value pair\n");
         } else {
-            _args[kvPairs[0]] = kvPairs[1];
+            _args.push_back({ pair.substr(0, equals), pair.substr(equals + 1) });
+        }
+    }
+}
+
+void
+HTTPParser::parseQuery(std::string_view query)
+{
+    parseArgs(_arena.copy(query));
+}
+
+std::string_view
+HTTPParser::getHTTPArg(std::string_view name) const
+{
+    // A repeated arg replaces the earlier one
+    for (auto it = _args.rbegin(); it != _args.rend(); ++it) {
+        if (it->name == name) {
+            return it->value;
         }
     }
+    return std::string_view();
+}
+
+std::string_view
+HTTPParser::getHTTPHeader(std::string_view name) const
+{
+    for (auto it = _headers.rbegin(); it != _headers.rend(); ++it) {
+        if (it->name.size() == name.size() && strncasecmp(it->name.data(), name.data(), name.size()) == 0) {
+            return it->value;
+        }
+    }
+    return std::string_view();
 }
 
 bool
-HTTPParser::parseRequest(ReadCB cb)
+HTTPParser::parseRequestLine(std::string_view line)
 {
-    bool isFirstLine = true;
+    // <method> SP <target> [SP <version>]
+    size_t methodEnd = line.find(' ');
+    if (methodEnd == 0 || methodEnd == std::string_view::npos) {
+        setErrorResponse(400, "bad request line");
+        return false;
+    }
+    size_t targetEnd = line.find(' ', methodEnd + 1);
+    size_t targetSize = (targetEnd == std::string_view::npos) ? (line.size() - methodEnd - 1) : (targetEnd - methodEnd - 1);
     
-    while (true) {
-        // Get a line
-        std::string line = getLine(cb);
+    // The target is decoded in place in the arena's copy of the line
+    char* buf = static_cast<char*>(_arena.allocate(line.size(), 1));
+    memcpy(buf, line.data(), line.size());
+    
+    char* target = buf + methodEnd + 1;
+    size_t pathSize = decodeURL(std::string_view(target, targetSize), target);
+    if (pathSize == std::string_view::npos) {
+        setErrorResponse(400, "bad request target");
+        return false;
+    }
+    
+    _method = std::string_view(buf, methodEnd);
+    _path = std::string_view(target, pathSize);
+    _version = (targetEnd == std::string_view::npos) ? "HTTP/1.0" : std::string_view(buf + targetEnd + 1, line.size() - targetEnd - 1);
+    
+    // Pick out args
+    size_t firstArg = _path.find('?');
+    if (firstArg != std::string_view::npos) {
+        parseArgs(_path.substr(firstArg + 1));
+        _path = _path.substr(0, firstArg);
+    }
+    return true;
+}
+
+bool
+HTTPParser::parseLine(std::string_view line)
+{
+    if (_method.empty()) {
+        // Blank lines before the request line are ignored (RFC 9112 section 2.2)
+        return line.empty() || parseRequestLine(line);
+    }
+    
+    if (line.empty()) {
+        // Blank line, we're done
+        _status = ParseStatus::Complete;
+        return true;
+    }
+    
+    // Only split at the first colon, values like dates and host:port have more
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+        setErrorResponse(400, "bad header line");
+        return false;
+    }
+    
+    line = _arena.copy(line);
+    _headers.push_back({ trim(line.substr(0, colon)), trim(line.substr(colon + 1)) });
+    return true;
+}
+
+HTTPParser::ParseStatus
+HTTPParser::parse(std::string_view data, size_t& used)
+{
+    used = 0;
+    
+    while (_status == ParseStatus::Incomplete) {
+        const char* start = data.data() + used;
+        size_t remaining = data.size() - used;
+        const char* end = static_cast<const char*>(memchr(start, '\n', remaining));
         
-        // We have a line in the buffer
-        // TODO: Do a bunch of error checking here
-        if (line.empty()) {
-            // Blank line, we're done
+        if (!end) {
+            // Partial line, leave it for next time unless it can't fit
+            if (_headerSize + remaining >= MaxHeaderSize) {
+                setErrorResponse(431, "request header too large");
+                _status = ParseStatus::Error;
+            }
             break;
         }
         
-        if (isFirstLine) {
-            isFirstLine = false;
-            
-            // Handle first line
-            std::vector<std::string> parsedLine = split(line, ' ');
-            _method = parsedLine[0];
-            _path = urlDecode(parsedLine[1]);
-        } else {
-            std::vector<std::string> keyValue = parseKeyValue(line);
-            _headers[keyValue[0]] = keyValue[1];
+        size_t lineSize = end - start + 1;
+        _headerSize += lineSize;
+        used += lineSize;
+        
+        if (_headerSize > MaxHeaderSize) {
+            setErrorResponse(431, "request header too large");
+            _status = ParseStatus::Error;
+            break;
+        }
+        
+        // Lines end in CRLF, but a bare LF is accepted
+        std::string_view line(start, lineSize - 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        
+        if (!parseLine(line)) {
+            _status = ParseStatus::Error;
         }
     }
+    return _status;
+}
 
-    // Pick out args
-    size_t firstArg = _path.find('?');
-    if (firstArg == std::string::npos) {
-        return true;
+bool
+HTTPParser::parseRequest(HTTPReader& reader)
+{
+    while (true) {
+        size_t used;
+        ParseStatus status = parse(reader.peek(), used);
+        reader.consume(used);
+        if (status != ParseStatus::Incomplete) {
+            return status == ParseStatus::Complete;
+        }
+        
+        // What's left is a partial line. Wait for the rest of it
+        if (!reader.fill(reader.peek().size() + 1)) {
+            setErrorResponse(431, "request header too large or incomplete");
+            return false;
+        }
     }
-    
-    std::string argList = _path.substr(firstArg + 1);
-    _path = _path.substr(0, firstArg);
+}
 
-    parseQuery(argList);
+void
+HTTPParser::reset()
+{
+    if (&_arena == &_ownArena) {
+        _arena.reset();
+    }
+    _args.clear();
+    _headers.clear();
+    _method = std::string_view();
+    _path = std::string_view();
+    _version = std::string_view();
+    _status = ParseStatus::Incomplete;
+    _headerSize = 0;
+    _errorCode = 0;
+    _errorReason.clear();
     
-    return true;
+    _uploadStatus = WiFiPortal::HTTPUploadStatus::None;
+    _uploadContentLength = 0;
+    _uploadFilename = std::string_view();
+    _uploadMimetype = std::string_view();
+    _uploadTotalSize = 0;
+    _uploadCurrentSize = 0;
+    _uploadBuffer = nullptr;
+    _uploadStartTime = 0;
 }
 
 #endif
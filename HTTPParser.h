@@ -27,59 +27,275 @@ All rights reserved.
 #pragma once
 
 #include <sys/types.h>
+#include <algorithm>
+#include <ctime>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <array>
 #include <functional>
 #include <map>
+#include <memory>
+#include <vector>
 
 #include "WiFiPortal.h"
 
 namespace mil {
 
-class HTTPParser
+// Arena
+//
+// Bump allocator for data that lives as long as one request. Allocations
+// are carved out of blocks in order and are all freed at once by reset().
+// Blocks are kept across resets, so once an arena has grown to fit the
+// requests it sees it stops allocating and the heap doesn't fragment. An
+// allocation larger than the block size gets a block of its own.
+//
+// highWater() is the most any one request has used. Use it to pick a block
+// size that fits a typical request in one block.
+
+class Arena
 {
   public:
-    static constexpr int UploadBufferReturnSize = 8192;
-    
-    // While reading upload data we need to check for the boundary string.
-    // If we hit the UploadBufferReturnSize and we're in the middle of 
-    // checking for the boundary string, we need to keep reading until
-    // we get it or we fail to get it. In the former case we return the
-    // data up to where the boundary starts and make that the last buffer.
-    // In the latter case we need to send UploadBufferReturnSize then
-    // put the rest of the data at the head of the buffer and continue
-    // reading. 80 bytes is enough for the max boundary string size plus
-    // a couple of \r\n and a couple of '-'. 
-    static constexpr int UploadBufferActualSize = UploadBufferReturnSize + 80;
+    static constexpr size_t DefaultBlockSize = 1024;
+    
+    Arena(size_t blockSize = DefaultBlockSize) : _blockSize(blockSize) { }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+    
+    // Copy s into the arena and return a view of the copy
+    std::string_view copy(std::string_view s);
+    
+    // Same, with a terminating null for C APIs
+    const char* copyString(std::string_view s);
+    
+    // Views and pointers into the arena are invalid after this
+    void reset()
+    {
+        _highWater = std::max(_highWater, _used);
+        _used = 0;
+        _current = 0;
+        _offset = 0;
+    }
+    
+    size_t used() const { return _used; }
+    size_t highWater() const { return std::max(_highWater, _used); }
+    size_t capacity() const { return _capacity; }
+    
+  private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    
+    std::vector<Block> _blocks;
+    size_t _current = 0;        // Block being allocated from
+    size_t _offset = 0;         // First free byte in it
+    size_t _blockSize;
+    
+    size_t _used = 0;
+    size_t _highWater = 0;
+    size_t _capacity = 0;
+};
 
+// HTTPReader
+//
+// Buffered reader that sits under HTTPParser. It pulls data from a ReadCB
+// in large chunks and hands out lines and spans as views into its buffer,
+// so there's one read per chunk rather than per byte and nothing is copied.
+// Views are valid until the next call that reads or consumes. The unread
+// tail is slid to the front of the buffer when more space is needed, so
+// buffered data is always contiguous.
+//
+// A limit can be set to keep the reader from handing out data past the end
+// of a request body. Anything read beyond it (e.g., a pipelined request)
+// stays buffered for the next request.
+
+class HTTPReader
+{
+  public:
     using ReadCB = std::function<ssize_t(uint8_t* buf, size_t size)>;
-    using HandlerCB = std::function<void()>;
     
-    using ArgMap = std::map<std::string, std::string>;
-
-	HTTPParser()
+    static constexpr size_t DefaultCapacity = 8192;
+    static constexpr size_t NoLimit = SIZE_MAX;
+    
+    HTTPReader(size_t capacity = DefaultCapacity) : _buffer(capacity) { }
+    
+    void setReadCB(ReadCB cb) { _readCB = cb; }
+    
+    void setLimit(size_t limit) { _limit = limit; }
+    size_t limit() const { return _limit; }
+    
+    size_t capacity() const { return _buffer.size(); }
+    
+    // Buffered data, up to the limit
+    std::string_view peek() const
     {
-        _uploadBuffer = new uint8_t[UploadBufferActualSize];
+        return std::string_view(reinterpret_cast<const char*>(_buffer.data()) + _start, std::min(_end - _start, _limit));
     }
     
-	~HTTPParser()
+    void consume(size_t size);
+
+    // Read until at least size bytes (clamped to the capacity) are
+    // buffered. Returns false if the ReadCB fails or hits EOF first, or if
+    // size is past the limit. In that case it reads up to the limit.
+    bool fill(size_t size);
+    
+    // Return up to maxSize bytes, reading if nothing is buffered. Returns
+    // an empty view at the limit, on EOF or on error.
+    std::string_view read(size_t maxSize);
+    
+    // Lines end in CRLF. The returned line doesn't include it. Returns false
+    // on read error, at the limit or if the line is longer than the buffer.
+    bool getLine(std::string_view& line);
+
+    // For callers that do their own reads (e.g., an event loop). Returns
+    // where to put new data and sets space to how much will fit. Call
+    // commit() with the amount actually added.
+    uint8_t* prepare(size_t& space);
+    void commit(size_t size) { _end += size; }
+    
+  private:
+    void compact();
+    
+    std::vector<uint8_t> _buffer;
+    size_t _start = 0;
+    size_t _end = 0;
+    size_t _limit = NoLimit;
+    ReadCB _readCB;
+};
+
+// Finds a multipart delimiter in a buffer of upload data using
+// Boyer-Moore-Horspool. The skip table is built once per delimiter, so most
+// of the buffer is stepped over rather than examined byte by byte. Binary
+// data full of CRs (which every delimiter starts with) doesn't slow it down.
+//
+// When there's no match, find() also reports how much of the buffer is safe
+// to hand out. Only a tail that could be the start of a delimiter split
+// across reads is held back.
+
+class BoundaryMatcher
+{
+  public:
+    BoundaryMatcher(const std::string& delimiter);
+    
+    const std::string& delimiter() const { return _delimiter; }
+    
+    // Returns the position of the delimiter in data or npos. If not found,
+    // safeSize is set to the number of bytes which can't be part of a
+    // delimiter.
+    size_t find(std::string_view data, size_t& safeSize) const;
+    
+  private:
+    std::string _delimiter;
+    uint8_t _skip[256];
+};
+
+class HTTPParser
+{
+  public:
+    using ReadCB = HTTPReader::ReadCB;
+    using HandlerCB = std::function<void()>;
+    
+    // Transparent so it can be searched with a string_view
+    using ArgMap = std::map<std::string, std::string, std::less<>>;
+
+    // Largest request line plus headers accepted. It has to fit in an
+    // HTTPReader so a partial line can wait there for the rest of it
+    static constexpr size_t MaxHeaderSize = HTTPReader::DefaultCapacity;
+    
+    enum class ParseStatus { Incomplete, Complete, Error };
+    
+    // Headers and args are few, so they're kept in the order received and
+    // searched linearly. Names and values point into the arena.
+    struct Field
     {
-        delete [ ] _uploadBuffer;
-    }
+        std::string_view name;
+        std::string_view value;
+    };
+    
+    // The parser can have its own arena, or share one that has everything
+    // else for the request
+	HTTPParser() : _arena(_ownArena) { }
+	HTTPParser(Arena& arena) : _arena(arena) { }
+	~HTTPParser() { }
+    
+    Arena& arena() { return _arena; }
 
-    bool parseMultipart(size_t size, const std::string& boundary, HandlerCB, ReadCB);
+    // Upload data is handed to the HandlerCB in place in the reader's buffer.
+    // httpUploadBuffer() is only valid during the callback.
+    bool parseMultipart(size_t size, const std::string& boundary, HandlerCB, HTTPReader&);
+    
+    // Parse the request line and headers from data as it arrives. used is
+    // set to the number of bytes taken. Those are whole lines, so anything
+    // left over is a partial line which has to be passed again with more data
+    // after it. Parsing stops after the blank line that ends the headers, so
+    // the rest of data is the body. On Error, errorCode() has the response.
+    ParseStatus parse(std::string_view data, size_t& used);
+    ParseStatus status() const { return _status; }
+    
+    // Blocking version which reads from the reader until the headers are done
+    bool parseRequest(HTTPReader&);
     
-    bool parseRequest(ReadCB cb);
-    void parseQuery(const std::string& query);
+    void parseQuery(std::string_view query);
+    
+    // Ready the parser for the next request on a connection. Its own arena
+    // is reset too. A shared arena is reset by its owner
+    void reset();
     
-    static std::string getLine(ReadCB cb);
     static std::string urlDecode(const std::string&);
-    static std::string suffixToMimeType(const std::string& filename);
+    
+    // Everything but letters, digits and "-_.~" is % encoded
+    static std::string urlEncode(std::string_view);
+    
+    // Mime type for the filename's suffix, which is case-insensitive, or an
+    // empty string if it's not a known type
+    static const char* suffixToMimeType(std::string_view filename);
     static std::vector<std::string> split(const std::string& str, char sep);
     static std::string trimWhitespace(const std::string& s);
     static std::string removeQuotes(const std::string& s);
     static std::vector<std::string> parseFormData(const std::string& value);
     
+    // Byte ranges (RFC 9110 section 14). Only a single range is supported. A
+    // Range header with more than one range (or one that can't be parsed) gets
+    // None, and the whole resource is sent with a 200. That's allowed and it
+    // avoids multipart/byteranges responses and overlapping range abuse.
+    enum class RangeStatus { None, Partial, Unsatisfiable };
+    
+    // On Partial, start and length select the bytes of a resource of the passed size
+    static RangeStatus parseRange(const std::string& range, size_t size, size_t& start, size_t& length);
+    
+    // A Range only applies if If-Range is missing or matches the resource's
+    // current validator exactly. Pass an empty validator if there isn't one
+    static bool ifRangeMatches(const std::string& ifRange, const std::string& validator);
+    
+    // Value for the Content-Range header of a 206. Pass a length of 0 for a 416
+    static std::string contentRange(size_t start, size_t length, size_t size);
+    
+    // Validators for conditional requests (RFC 9110 section 13). The first
+    // ETag is a hash of the content, for pages compiled into the image. The
+    // second comes from a file's size and modification time so the file
+    // doesn't have to be read.
+    static std::string makeETag(const void* data, size_t length);
+    static std::string makeETag(size_t size, time_t lastModified);
+    static std::string httpDate(time_t);
+    
+    // Returns true if the client's cached copy is current and a 304 should be
+    // sent. If-None-Match takes precedence over If-Modified-Since, which has
+    // to match Last-Modified exactly
+    static bool notModified(const std::string& ifNoneMatch, const std::string& ifModifiedSince,
+                            const std::string& etag, const std::string& lastModified);
+    
+    // Value in the table for the longest uri prefix matching path, or an empty string
+    static const std::string& cacheControl(const ArgMap& table, std::string_view path);
+    
+    // Returns true if an Accept-Encoding header value allows a gzip response.
+    // An explicit gzip entry overrides "*" and a q of 0 refuses it
+    static bool acceptsGzip(const std::string& acceptEncoding);
+    
     void setErrorResponse(int code, const char* error)
     {
         _errorCode = code;
@@ -89,25 +305,40 @@ class HTTPParser
     int errorCode() const { return _errorCode; }
     const std::string& errorReason() const { return _errorReason; }
     
-    const std::string& method() const { return _method; }
-    const std::string& path() const { return _path; }
-    const std::string getHTTPArg(const char* name) { return _args.count(name) ? _args[name] : ""; }
-    const std::string getHTTPHeader(const char* name) { return _headers.count(name) ? _headers[name] : ""; }
+    // These are views into the parser's arena and are valid until reset().
+    // Header names are case-insensitive. Missing values are empty.
+    std::string_view method() const { return _method; }
+    std::string_view path() const { return _path; }
+    std::string_view version() const { return _version; }
+    std::string_view getHTTPArg(std::string_view name) const;
+    std::string_view getHTTPHeader(std::string_view name) const;
     
     WiFiPortal::HTTPUploadStatus httpUploadStatus() const { return _uploadStatus; }
-    std::string httpUploadFilename() const { return _uploadFilename; }
+    std::string_view httpUploadFilename() const { return _uploadFilename; }
     size_t httpUploadContentLength() const { return _uploadContentLength; }
     size_t httpUploadTotalSize() const { return _uploadTotalSize; }
     size_t httpUploadCurrentSize() const { return _uploadCurrentSize; }
     const uint8_t* httpUploadBuffer() const { return _uploadBuffer; }
+    uint32_t httpUploadRate() const;
 
 private:
     static std::vector<std::string> parseKeyValue(const std::string& s);
-
-    HTTPParser::ArgMap _args;
-    HTTPParser::ArgMap _headers;
-    std::string _method;
-    std::string _path;
+    
+    bool parseLine(std::string_view line);
+    bool parseRequestLine(std::string_view line);
+    void parseArgs(std::string_view query);
+    void addArg(std::string_view name, std::string_view value);
+    
+    Arena _ownArena;
+    Arena& _arena;
+    std::vector<Field> _args;
+    std::vector<Field> _headers;
+    std::string_view _method;
+    std::string_view _path;
+    std::string_view _version;
+    
+    ParseStatus _status = ParseStatus::Incomplete;
+    size_t _headerSize = 0;
     
     int _errorCode = 0;
     std::string _errorReason;
@@ -115,11 +346,12 @@ private:
     // For upload
     WiFiPortal::HTTPUploadStatus _uploadStatus = WiFiPortal::HTTPUploadStatus::None;
     size_t _uploadContentLength = 0;
-    std::string _uploadFilename;
-    std::string _uploadMimetype;
+    std::string_view _uploadFilename;
+    std::string_view _uploadMimetype;
     size_t _uploadTotalSize = 0;
     size_t _uploadCurrentSize = 0;
-    uint8_t* _uploadBuffer = nullptr;
+    const uint8_t* _uploadBuffer = nullptr;
+    uint32_t _uploadStartTime = 0;
 };
 
 }
@@ -11,6 +11,7 @@ All rights reserved.
 
 #include "IDFWiFiPortal.h"
 
+#include "EventLog.h"
 #include "HTTPParser.h"
 #include "WebFileSystem.h"
 
@@ -29,6 +30,28 @@ static const char* PROV_AP_SSID = "ESP32-Provisioning";
 static const char* PROV_AP_PASS = "password123";
 static constexpr uint32_t PROV_AP_MAX_CONN = 4;
 
+// Files are streamed in chunks this size. It's big enough to fill a few TCP
+// segments per send and is allocated on the heap so it doesn't need room on
+// the httpd task's stack
+static constexpr size_t STREAM_CHUNK_SIZE = 4096;
+
+static const char* statusString(int code)
+{
+    switch (code) {
+        case 200: return HTTPD_200;
+        case 204: return HTTPD_204;
+        case 206: return "206 Partial Content";
+        case 304: return "304 Not Modified";
+        case 400: return HTTPD_400;
+        case 404: return HTTPD_404;
+        case 416: return "416 Range Not Satisfiable";
+        case 500: return HTTPD_500;
+        case 501: return "501 Not Implemented";
+        case 503: return "503 Service Unavailable";
+        default: return (code >= 500) ? HTTPD_500 : ((code >= 400) ? HTTPD_400 : HTTPD_200);
+    }
+}
+
 // HTTP Error (404) Handler when connected - show a 404 page
 static esp_err_t connectedHTTP404ErrorHandler(httpd_req_t *req, httpd_err_code_t err)
 {
@@ -85,11 +108,9 @@ IDFWiFiPortal::thunkHandler(httpd_req_t* req)
 {
     HandlerThunk* thunk = reinterpret_cast<HandlerThunk*>(req->user_ctx);
     IDFWiFiPortal* self = reinterpret_cast<IDFWiFiPortal*>(thunk->_portal);
-    self->_activeRequest = req;
-    
-    std::string uri = std::string(req->uri);
     
-    self->_parser = std::make_unique<HTTPParser>();
+    RequestContext context(self, req);
+    self->_context = &context;
 
     // Get the arg string
     size_t queryURLLen = httpd_req_get_url_query_len(req) + 1;
@@ -100,52 +121,63 @@ IDFWiFiPortal::thunkHandler(httpd_req_t* req)
         if (httpd_req_get_url_query_str(req, buf.data(), queryURLLen) != ESP_OK) {
             ESP_LOGE(TAG, "Failed to extract query URL");
         } else {
-            std::string args(buf.data(), queryURLLen);
-            self->_parser->parseQuery(HTTPParser::urlDecode(args));
+            std::string args(buf.data(), queryURLLen - 1);
+            context.parser.parseQuery(HTTPParser::urlDecode(args));
         }
     }
     
     if (req->method == HTTP_POST) {
-        std::string contentType = self->getHTTPHeader("Content-Type");
+        std::string contentType = context.header("Content-Type");
         if (contentType.empty()) {
-            self->_parser->setErrorResponse(501, "no Content-Type");
+            context.parser.setErrorResponse(501, "no Content-Type");
         } else {
             std::vector<std::string> multipart = HTTPParser::parseFormData(contentType);
             if (multipart[0] != "multipart/form-data" || multipart[1] != "boundary") {
                 // This is not a multipart, Handle it normally
-                thunk->_handler(thunk->_portal);
+                thunk->_handler(context, context);
             } else {
-                std::string lengthString = self->getHTTPHeader("Content-Length");
+                std::string lengthString = context.header("Content-Length");
                 size_t contentLength = std::stoi(lengthString);
-                self->_parser->parseMultipart(contentLength, multipart[2],
-                    [thunk]()
+                
+                // httpd_req_recv stops at the end of the body, so the reader needs no limit
+                HTTPReader reader;
+                reader.setReadCB([req](uint8_t* buf, size_t size) -> ssize_t
+                {
+                    return httpd_req_recv(req, reinterpret_cast<char*>(buf), size);
+                });
+                
+                context.parser.parseMultipart(contentLength, multipart[2],
+                    [thunk, &context]()
                     {
-                        thunk->_handler(thunk->_portal);
+                        thunk->_handler(context, context);
                     },
-                    [req](uint8_t* buf, size_t size) -> ssize_t
-                    {
-                        return httpd_req_recv(req, reinterpret_cast<char*>(buf), size);
-                    }
+                    reader
                 );
             }
         }
     } else {
-        thunk->_handler(thunk->_portal);
+        thunk->_handler(context, context);
     }
 
-    if (self->_parser->errorCode()) {
-        self->sendHTTPResponse(self->_parser->errorCode(), "text/plain", self->_parser->errorReason().c_str());
-        System::logE(TAG, "HTTP parser error (%d):%s\n", self->_parser->errorCode(), self->_parser->errorReason().c_str());
+    if (context.parser.errorCode()) {
+        context.send(context.parser.errorCode(), "text/plain", context.parser.errorReason().c_str());
+        System::logE(TAG, "HTTP parser error (%d):%s\n", context.parser.errorCode(), context.parser.errorReason().c_str());
     }
     
-    self->_parser.reset();
-    self->_activeRequest = nullptr;
+    self->_context = nullptr;
+    
+    // Log when the arena grows so its block size can be tuned
+    if (self->_arena.capacity() > self->_arenaCapacity) {
+        self->_arenaCapacity = self->_arena.capacity();
+        System::logI(TAG, "Request arena grew to %u bytes, high water %u", unsigned(self->_arenaCapacity), unsigned(self->_arena.highWater()));
+    }
+    self->_arena.reset();
     
     return ESP_OK;
 }
 
 int32_t
-IDFWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB requestCB)
+IDFWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, RequestHandlerCB requestCB)
 {
     if (!_server) {
         System::logE(TAG, "can't add HTTP handler for '%s', server not initialized", endpoint);
@@ -165,30 +197,283 @@ IDFWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB
 void
 IDFWiFiPortal::addStaticHTTPHandler(const char *uri, const char *path)
 {
-    addHTTPHandler((std::string(uri) + "/*").c_str(), HTTPMethod::Get, [uri, path](WiFiPortal* p) {
-        IDFWiFiPortal* self = reinterpret_cast<IDFWiFiPortal*>(p);
-        
+    addHTTPHandler((std::string(uri) + "/*").c_str(), HTTPMethod::Get, [this, uri, path](Request& request, Response& response) {
         std::string endpoint(uri);
-        std::string filePath(self->_activeRequest->uri);
-        filePath = filePath.substr(endpoint.length());
-        if (filePath.back() == '?') {
-            filePath.pop_back();
-        }
+        std::string filePath = request.path().substr(endpoint.length());
 
         std::string f(path);
         f += filePath;
+        
+        // Send a precompressed sibling if there is one and the client takes
+        // gzip. The mime type still comes from the uncompressed name
+        std::string gz = f + ".gz";
+        const char* mimetype = HTTPParser::suffixToMimeType(f);
+        if (_wfs && _wfs->exists(gz.c_str())) {
+            response.addHeader("Vary", "Accept-Encoding");
+            if (HTTPParser::acceptsGzip(request.header("Accept-Encoding"))) {
+                response.addHeader("Content-Encoding", "gzip");
+                f = gz;
+            }
+        }
     
-        if (!self->_wfs || !self->_wfs->exists(f.c_str())) {
-            httpd_resp_send(self->_activeRequest, "<h1><b>Page not found</b></h1>", HTTPD_RESP_USE_STRLEN);
-            ESP_LOGI(TAG, "%s page not found", self->_activeRequest->uri);
-        } else {
-            fs::File file = self->_wfs->open(f.c_str(), "r");
-            self->streamHTTPResponse(file, HTTPParser::suffixToMimeType(f).c_str(), false);
+        if (!_wfs || !_wfs->exists(f.c_str())) {
+            response.send(404, "text/html", "<h1><b>Page not found</b></h1>");
+            ESP_LOGI(TAG, "%s page not found", request.path().c_str());
+        } else if (!_wfs->sendCachedFile(request, response, f.c_str(), mimetype)) {
+            fs::File file = _wfs->open(f.c_str(), "r");
+            response.stream(file, mimetype, false);
             file.close();
         }
     });
 }
 
+// Messages longer than this are dropped rather than allocated
+static constexpr size_t MaxWebSocketMessage = 4096;
+
+void
+IDFWiFiPortal::addWebSocketHandler(const char* endpoint, WebSocketCB cb)
+{
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    if (!_server) {
+        System::logE(TAG, "can't add WebSocket handler for '%s', server not initialized", endpoint);
+        return;
+    }
+    
+    WebSocketThunk* thunk = new WebSocketThunk(cb, this);
+    _webSocketHandlers[endpoint] = thunk;
+    
+    httpd_uri_t uri = { };
+    uri.uri = endpoint;
+    uri.method = HTTP_GET;
+    uri.handler = webSocketHandler;
+    uri.user_ctx = thunk;
+    uri.is_websocket = true;
+    ESP_ERROR_CHECK(httpd_register_uri_handler(_server, &uri));
+#else
+    System::logE(TAG, "can't add WebSocket handler for '%s', CONFIG_HTTPD_WS_SUPPORT is off", endpoint);
+#endif
+}
+
+esp_err_t
+IDFWiFiPortal::webSocketHandler(httpd_req_t* req)
+{
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    WebSocketThunk* thunk = reinterpret_cast<WebSocketThunk*>(req->user_ctx);
+    IDFWiFiPortal* self = thunk->_portal;
+    int fd = httpd_req_to_sockfd(req);
+    
+    if (req->method == HTTP_GET) {
+        // The handshake is done. The session's context is freed when the client goes away
+        req->sess_ctx = new WebSocketSession { thunk, fd };
+        req->free_ctx = freeWebSocketSession;
+        {
+            std::lock_guard<std::mutex> lock(thunk->_mutex);
+            thunk->_clients.insert(fd);
+        }
+        thunk->_handler(uint32_t(fd), WebSocketEvent::Connect, std::string_view());
+        return ESP_OK;
+    }
+    
+    // Get the length, then the payload. httpd doesn't put fragmented
+    // messages back together, but browsers don't fragment small ones
+    httpd_ws_frame_t frame = { };
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (frame.len > MaxWebSocketMessage) {
+        System::logE(TAG, "WebSocket message of %u bytes is too big", unsigned(frame.len));
+        return ESP_FAIL;
+    }
+    
+    if (frame.len) {
+        frame.payload = static_cast<uint8_t*>(self->_arena.allocate(frame.len, 1));
+        err = httpd_ws_recv_frame(req, &frame, frame.len);
+    }
+    if (err == ESP_OK && (frame.type == HTTPD_WS_TYPE_TEXT || frame.type == HTTPD_WS_TYPE_BINARY)) {
+        thunk->_handler(uint32_t(fd), WebSocketEvent::Message, std::string_view(reinterpret_cast<const char*>(frame.payload), frame.len));
+    }
+    self->_arena.reset();
+    return err;
+#else
+    return ESP_FAIL;
+#endif
+}
+
+void
+IDFWiFiPortal::freeWebSocketSession(void* ctx)
+{
+    WebSocketSession* session = static_cast<WebSocketSession*>(ctx);
+    {
+        std::lock_guard<std::mutex> lock(session->thunk->_mutex);
+        session->thunk->_clients.erase(session->fd);
+    }
+    session->thunk->_handler(uint32_t(session->fd), WebSocketEvent::Disconnect, std::string_view());
+    delete session;
+}
+
+void
+IDFWiFiPortal::sendWebSocketMessage(uint32_t client, std::string_view message)
+{
+    if (client) {
+        queueWebSocketMessage({ int(client) }, message);
+    }
+}
+
+void
+IDFWiFiPortal::broadcastWebSocketMessage(const char* endpoint, std::string_view message, uint32_t except)
+{
+    auto it = _webSocketHandlers.find(endpoint);
+    if (it == _webSocketHandlers.end()) {
+        return;
+    }
+    
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(it->second->_mutex);
+        for (int fd : it->second->_clients) {
+            if (uint32_t(fd) != except) {
+                fds.push_back(fd);
+            }
+        }
+    }
+    if (!fds.empty()) {
+        queueWebSocketMessage(std::move(fds), message);
+    }
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+struct WebSocketWork
+{
+    httpd_handle_t server;
+    std::vector<int> fds;
+    std::string message;
+};
+
+static void sendWebSocketWork(void* arg)
+{
+    std::unique_ptr<WebSocketWork> work(static_cast<WebSocketWork*>(arg));
+    
+    httpd_ws_frame_t frame = { };
+    frame.final = true;
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = reinterpret_cast<uint8_t*>(work->message.data());
+    frame.len = work->message.size();
+    
+    for (int fd : work->fds) {
+        // The client might have gone away since the message was queued
+        if (httpd_ws_get_fd_info(work->server, fd) == HTTPD_WS_CLIENT_WEBSOCKET) {
+            httpd_ws_send_frame_async(work->server, fd, &frame);
+        }
+    }
+}
+#endif
+
+void
+IDFWiFiPortal::queueWebSocketMessage(std::vector<int>&& fds, std::string_view message)
+{
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    WebSocketWork* work = new WebSocketWork { _server, std::move(fds), std::string(message) };
+    if (httpd_queue_work(_server, sendWebSocketWork, work) != ESP_OK) {
+        System::logE(TAG, "failed to queue WebSocket message");
+        delete work;
+    }
+#endif
+}
+
+// Streams look for new events this often and send a comment when they have
+// been idle for EventStreamKeepAlive
+static constexpr uint32_t EventStreamInterval = 100; // ms
+static constexpr uint32_t EventStreamKeepAlive = 15000; // ms
+static constexpr uint32_t EventStreamStackSize = 4096;
+static constexpr size_t EventStreamChunkSize = 1024;
+static constexpr uint32_t MaxEventStreams = 2;
+
+void
+IDFWiFiPortal::addEventStreamHandler(const char* endpoint)
+{
+    if (!_server) {
+        System::logE(TAG, "can't add event stream handler for '%s', server not initialized", endpoint);
+        return;
+    }
+    
+    httpd_uri_t uri = { };
+    uri.uri = endpoint;
+    uri.method = HTTP_GET;
+    uri.handler = eventStreamHandler;
+    ESP_ERROR_CHECK(httpd_register_uri_handler(_server, &uri));
+}
+
+esp_err_t
+IDFWiFiPortal::eventStreamHandler(httpd_req_t* req)
+{
+    if (_eventStreams.fetch_add(1, std::memory_order_relaxed) >= MaxEventStreams) {
+        _eventStreams.fetch_sub(1, std::memory_order_relaxed);
+        System::logW(TAG, "too many event streams, rejecting");
+        httpd_resp_set_status(req, statusString(503));
+        httpd_resp_send(req, "Too many event streams", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    
+    httpd_req_t* stream;
+    esp_err_t err = httpd_req_async_handler_begin(req, &stream);
+    if (err != ESP_OK) {
+        _eventStreams.fetch_sub(1, std::memory_order_relaxed);
+        return err;
+    }
+    
+    if (xTaskCreate(eventStreamTask, "EventStream", EventStreamStackSize, stream, tskIDLE_PRIORITY + 1, nullptr) != pdPASS) {
+        System::logE(TAG, "failed to start event stream task");
+        _eventStreams.fetch_sub(1, std::memory_order_relaxed);
+        httpd_req_async_handler_complete(stream);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void
+IDFWiFiPortal::eventStreamTask(void* arg)
+{
+    httpd_req_t* req = static_cast<httpd_req_t*>(arg);
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    
+    {
+        EventLog::Reader reader;
+        EventLog::Event event;
+        std::string s;
+        uint32_t idleTime = 0;
+        
+        while (true) {
+            // A slow client only holds up this task. The log moves on
+            // without it and it's told how many events it missed
+            s.clear();
+            while (s.size() < EventStreamChunkSize && reader.next(event)) {
+                if (uint64_t dropped = reader.takeDropped()) {
+                    EventLog::appendDropped(s, dropped);
+                }
+                EventLog::appendServerSentEvent(s, event);
+            }
+            
+            // Sending a comment now and then is how we find out the client is gone
+            if (s.empty() && (idleTime += EventStreamInterval) >= EventStreamKeepAlive) {
+                s = ":\n\n";
+            }
+            if (!s.empty()) {
+                idleTime = 0;
+                if (httpd_resp_send_chunk(req, s.data(), s.size()) != ESP_OK) {
+                    break;
+                }
+            }
+            vTaskDelay(pdMS_TO_TICKS(EventStreamInterval));
+        }
+    }
+    
+    _eventStreams.fetch_sub(1, std::memory_order_relaxed);
+    httpd_req_async_handler_complete(req);
+    vTaskDelete(nullptr);
+}
+
 bool
 IDFWiFiPortal::autoConnect(char const *apName, char const *apPassword)
 {
@@ -270,29 +555,20 @@ static esp_err_t portalHTTP404ErrorHandler(httpd_req_t *req, httpd_err_code_t er
 }
 
 void
-IDFWiFiPortal::sendHTTPResponse(int code, const char* mimetype, const char* data)
+IDFWiFiPortal::RequestContext::send(int code, const char* mimetype, const char* data, size_t length, bool gzip)
 {
-    sendHTTPResponse(code, mimetype, data, strlen(data), false);
-}
-
-void
-IDFWiFiPortal::sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip)
-{
-    if (!_activeRequest) {
-        ESP_LOGE(TAG, "Can't send HTTP response. No active request.");
-        return;
-    }
-    
-    ESP_ERROR_CHECK(httpd_resp_set_type(_activeRequest, mimetype ?: "text/plain"));
-    ESP_ERROR_CHECK(httpd_resp_set_hdr(_activeRequest, "Content-Length", std::to_string(length).c_str()));
+    ESP_ERROR_CHECK(httpd_resp_set_status(req, statusString(code)));
+    ESP_ERROR_CHECK(httpd_resp_set_type(req, mimetype ?: "text/plain"));
+    addCacheControlHeader(code);
+    ESP_ERROR_CHECK(httpd_resp_set_hdr(req, "Content-Length", std::to_string(length).c_str()));
     if (gzip) {
-        ESP_ERROR_CHECK(httpd_resp_set_hdr(_activeRequest, "Content-Encoding", "gzip"));
+        ESP_ERROR_CHECK(httpd_resp_set_hdr(req, "Content-Encoding", "gzip"));
     }
-    httpd_resp_send(_activeRequest, data, length);
+    httpd_resp_send(req, data, length);
 }    
 
 void
-IDFWiFiPortal::streamHTTPResponse(fs::File& file, const char* mimetype, bool attach)
+IDFWiFiPortal::RequestContext::stream(fs::File& file, const char* mimetype, bool attach)
 {
     // For now assume this is a file download. So set Content-Disposition
     std::string disp = attach ? "attachment" : "inline";
@@ -300,102 +576,143 @@ IDFWiFiPortal::streamHTTPResponse(fs::File& file, const char* mimetype, bool att
     disp += file.name();
     disp += "\"";
     
-    ESP_ERROR_CHECK(httpd_resp_set_hdr(_activeRequest, "Content-Disposition", disp.c_str()));
-    ESP_ERROR_CHECK(httpd_resp_set_type(_activeRequest, mimetype ?: "text/plain"));
+    ESP_ERROR_CHECK(httpd_resp_set_hdr(req, "Content-Disposition", disp.c_str()));
+    ESP_ERROR_CHECK(httpd_resp_set_type(req, mimetype ?: "text/plain"));
+    ESP_ERROR_CHECK(httpd_resp_set_hdr(req, "Accept-Ranges", "bytes"));
+    
+    // httpd keeps pointers to header values, so the strings below have to
+    // live until the response is sent
+    size_t fileSize = file.size();
+    
+    // Validators come from the file's size and modification time
+    std::string etag;
+    std::string lastModified;
+    time_t lastWrite = file.getLastWrite();
+    if (lastWrite) {
+        etag = HTTPParser::makeETag(fileSize, lastWrite);
+        lastModified = HTTPParser::httpDate(lastWrite);
+        httpd_resp_set_hdr(req, "ETag", etag.c_str());
+        httpd_resp_set_hdr(req, "Last-Modified", lastModified.c_str());
+        
+        if (HTTPParser::notModified(header("If-None-Match"), header("If-Modified-Since"), etag, lastModified)) {
+            send(304, mimetype, "", 0, false);
+            return;
+        }
+    }
+    
+    // Send the whole file unless a single satisfiable range was asked for
+    int code = 200;
+    size_t start = 0;
+    size_t remaining = fileSize;
+    std::string contentRange;
     
-    uint8_t buf[256];
+    std::string range = header("Range");
+    if (!range.empty() && HTTPParser::ifRangeMatches(header("If-Range"), etag)) {
+        switch (HTTPParser::parseRange(range, fileSize, start, remaining)) {
+            case HTTPParser::RangeStatus::None:
+                break;
+            case HTTPParser::RangeStatus::Partial:
+                code = 206;
+                contentRange = HTTPParser::contentRange(start, remaining, fileSize);
+                httpd_resp_set_status(req, statusString(code));
+                httpd_resp_set_hdr(req, "Content-Range", contentRange.c_str());
+                file.seek(start);
+                break;
+            case HTTPParser::RangeStatus::Unsatisfiable:
+                contentRange = HTTPParser::contentRange(0, 0, fileSize);
+                httpd_resp_set_status(req, statusString(416));
+                httpd_resp_set_hdr(req, "Content-Range", contentRange.c_str());
+                httpd_resp_send(req, nullptr, 0);
+                return;
+        }
+    }
+    
+    addCacheControlHeader(code);
+    
+    std::unique_ptr<uint8_t[]> buf(new (std::nothrow) uint8_t[STREAM_CHUNK_SIZE]);
+    if (!buf) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return;
+    }
 
-    while (true) {
-        int size = file.read(buf, 256);
-        if (size < 0) {
-            printf("**** Error reading file\n");
-            if (_parser) {
-                _parser->setErrorResponse(404, "Error reading file");
+    // Keep going until everything has been sent. A short read doesn't mean we're done
+    bool headersSent = false;
+    while (remaining > 0) {
+        int size = file.read(buf.get(), std::min(remaining, STREAM_CHUNK_SIZE));
+        if (size <= 0) {
+            ESP_LOGE(TAG, "Error reading file, %u bytes short", unsigned(remaining));
+            
+            // Until the first chunk goes out we can still send an error.
+            // After that the body has no length, so the only way to tell
+            // the client it's incomplete is to close without the last chunk
+            if (!headersSent) {
+                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error reading file");
+            } else {
+                httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
             }
-            break;
-        } else if (size == 0) {
-            break;
+            return;
         }
         
-        if (httpd_resp_send_chunk(_activeRequest, reinterpret_cast<char*>(buf), size) != ESP_OK) {
+        headersSent = true;
+        if (httpd_resp_send_chunk(req, reinterpret_cast<char*>(buf.get()), size) != ESP_OK) {
             ESP_LOGE(TAG, "File sending failed!");
-            
-            httpd_resp_sendstr_chunk(_activeRequest, NULL);
-            httpd_resp_send_err(_activeRequest, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
+            httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
             return;
         }
-
-        if (size < 256) {
-            break;
-        }
+        remaining -= size;
     }
     
-    httpd_resp_set_hdr(_activeRequest, "Connection", "close");
-    httpd_resp_send_chunk(_activeRequest, NULL, 0);
-}
-
-WiFiPortal::HTTPUploadStatus
-IDFWiFiPortal::httpUploadStatus() const
-{
-    return _parser ? _parser->httpUploadStatus() : HTTPUploadStatus::None;
-}
-
-std::string
-IDFWiFiPortal::httpUploadFilename() const
-{
-    return _parser ? _parser->httpUploadFilename() : "";
-}
-
-size_t
-IDFWiFiPortal::httpUploadTotalSize() const
-{
-    return _parser ? _parser->httpUploadTotalSize() : 0;
+    httpd_resp_send_chunk(req, NULL, 0);
 }
 
-size_t
-IDFWiFiPortal::httpUploadCurrentSize() const
+void
+IDFWiFiPortal::RequestContext::beginChunked(int code, const char* mimetype)
 {
-    return _parser ? _parser->httpUploadCurrentSize() : 0;
+    ESP_ERROR_CHECK(httpd_resp_set_status(req, statusString(code)));
+    ESP_ERROR_CHECK(httpd_resp_set_type(req, mimetype ?: "text/plain"));
+    addCacheControlHeader(code);
 }
 
-const uint8_t*
-IDFWiFiPortal::httpUploadBuffer() const
+void
+IDFWiFiPortal::RequestContext::sendChunk(const char* data, size_t length)
 {
-    return _parser ? _parser->httpUploadBuffer() : nullptr;
+    // httpd does the chunked encoding and sends the headers with the first chunk
+    if (httpd_resp_send_chunk(req, data, length) != ESP_OK) {
+        ESP_LOGE(TAG, "Chunk sending failed!");
+    }
 }
 
-int
-IDFWiFiPortal::receiveHTTPResponse(char* buf, size_t size)
+void
+IDFWiFiPortal::RequestContext::addHeader(const char* name, const char* value)
 {
-    return httpd_req_recv(_activeRequest, buf, size);
+    httpd_resp_set_hdr(req, portal->_arena.copyString(name), portal->_arena.copyString(value));
 }
 
-std::string
-IDFWiFiPortal::getHTTPArg(const char* name)
+void
+IDFWiFiPortal::RequestContext::addCacheControlHeader(int code)
 {
-    if (!_activeRequest || !_parser) {
-        return "";
+    if (code != 200 && code != 206 && code != 304) {
+        return;
+    }
+    
+    // The value lives in _cacheControl, so it outlives the response
+    const std::string& cacheControl = HTTPParser::cacheControl(portal->_cacheControl, path());
+    if (!cacheControl.empty()) {
+        httpd_resp_set_hdr(req, "Cache-Control", cacheControl.c_str());
     }
-
-    return _parser->getHTTPArg(name);
 }
 
-void
-IDFWiFiPortal::parseQuery(const char* queryString)
+std::string
+IDFWiFiPortal::RequestContext::path() const
 {
-    if (_activeRequest && _parser) {
-        _parser->parseQuery(queryString);
-    }
+    std::string path(req->uri);
+    return path.substr(0, path.find('?'));
 }
 
 std::string
-IDFWiFiPortal::getHTTPHeader(const char* name)
+IDFWiFiPortal::RequestContext::header(const char* name) const
 {
-    if (!_activeRequest) {
-        return "";
-    }
-    
-    size_t size = httpd_req_get_hdr_value_len(_activeRequest, name) + 1;
+    size_t size = httpd_req_get_hdr_value_len(req, name) + 1;
 
     if(size < 2) {
         return "";
@@ -403,7 +720,7 @@ IDFWiFiPortal::getHTTPHeader(const char* name)
 
     // Allocate temporary buffer to store the parameter
     std::vector<char> buf(size);
-    if (httpd_req_get_hdr_value_str(_activeRequest, name, buf.data(), size) != ESP_OK) {
+    if (httpd_req_get_hdr_value_str(req, name, buf.data(), size) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to extract get header");
         return "";
     }
@@ -741,7 +1058,7 @@ IDFWiFiPortal::otaUpdate()
         case HTTPUploadStatus::Start: {
             std::string f = HTTPParser::urlDecode(getHTTPArg("path")) + "/" + httpUploadFilename();
             _otaUpdateAborted = false;
-            size_t length = _parser->httpUploadContentLength();
+            size_t length = _context->parser.httpUploadContentLength();
 
             _updatePartition = esp_ota_get_next_update_partition(nullptr);
             if (!_updatePartition) {
@@ -41,7 +41,10 @@ All rights reserved.
 
 #include <nvs_flash.h>
 
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <set>
 
 namespace mil {
 
@@ -51,24 +54,20 @@ public:
     virtual void begin(WebFileSystem*) override;
 
     virtual void setConfigHandler(HandlerCB) override;
-    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod, HandlerCB requestCB) override;
+    using WiFiPortal::addHTTPHandler;
+    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod, RequestHandlerCB requestCB) override;
     virtual void addStaticHTTPHandler(const char *uri, const char *path) override;
     virtual bool autoConnect(char const *apName, char const *apPassword = NULL) override;
     virtual void process() override;
     virtual std::string getIP() override { return _currentIP; }
     virtual const char* getSSID() override { return _ssid.c_str(); }
-    virtual void sendHTTPResponse(int code, const char* mimetype = nullptr, const char* data = "") override;
-    virtual void sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip) override;
-    virtual void streamHTTPResponse(fs::File& file, const char* mimetype, bool attach) override;
-    virtual HTTPUploadStatus httpUploadStatus() const override;
-    virtual std::string httpUploadFilename() const override;
-    virtual size_t httpUploadTotalSize() const override;
-    virtual size_t httpUploadCurrentSize() const override;
-    virtual const uint8_t* httpUploadBuffer() const override;
-    virtual int receiveHTTPResponse(char* buf, size_t size) override;
-    virtual std::string getHTTPArg(const char* name) override;
-    virtual void parseQuery(const char* queryString);
-    virtual std::string getHTTPHeader(const char* name) override;
+    virtual Request* currentRequest() const override { return _context; }
+    virtual Response* currentResponse() const override { return _context; }
+    virtual void setCacheControl(const char* uri, const char* value) override { _cacheControl[uri] = value; }
+    virtual void addWebSocketHandler(const char* endpoint, WebSocketCB cb) override;
+    virtual void sendWebSocketMessage(uint32_t client, std::string_view message) override;
+    virtual void broadcastWebSocketMessage(const char* endpoint, std::string_view message, uint32_t except) override;
+    virtual void addEventStreamHandler(const char* endpoint) override;
     virtual void otaUpdate() override;
     virtual std::string getCPUModel() const override;
     virtual uint32_t getCPUFrequency() const override;
@@ -83,6 +82,38 @@ public:
     static constexpr EventBits_t WIFI_CONNECTED_BIT = BIT0;
     static constexpr EventBits_t WIFI_FAIL_BIT = BIT1;
 
+    // Handlers run on the httpd task one at a time. The context lives on
+    // the stack of thunkHandler for the duration of the request
+    struct RequestContext : public Request, public Response
+    {
+        RequestContext(IDFWiFiPortal* p, httpd_req_t* r) : portal(p), req(r), parser(p->_arena) { }
+        
+        virtual std::string path() const override;
+        virtual std::string arg(const char* name) const override { return std::string(parser.getHTTPArg(name)); }
+        virtual std::string header(const char* name) const override;
+        virtual void parseQuery(const char* queryString) override { parser.parseQuery(queryString); }
+        virtual HTTPUploadStatus uploadStatus() const override { return parser.httpUploadStatus(); }
+        virtual std::string uploadFilename() const override { return std::string(parser.httpUploadFilename()); }
+        virtual size_t uploadTotalSize() const override { return parser.httpUploadTotalSize(); }
+        virtual size_t uploadCurrentSize() const override { return parser.httpUploadCurrentSize(); }
+        virtual const uint8_t* uploadBuffer() const override { return parser.httpUploadBuffer(); }
+        virtual uint32_t uploadRate() const override { return parser.httpUploadRate(); }
+        virtual int read(char* buf, size_t size) override { return httpd_req_recv(req, buf, size); }
+        
+        using Response::send;
+        virtual void addHeader(const char* name, const char* value) override;
+        virtual void send(int code, const char* mimetype, const char* data, size_t length, bool gzip) override;
+        virtual void stream(fs::File& file, const char* mimetype, bool attach) override;
+        virtual void beginChunked(int code, const char* mimetype) override;
+        virtual void sendChunk(const char* data, size_t length) override;
+        
+        void addCacheControlHeader(int code);
+        
+        IDFWiFiPortal* portal;
+        httpd_req_t* req;
+        HTTPParser parser;
+    };
+    
     bool isConnected() const { return _isConnected; }
     void startWebServer();
     void startProvisioning();
@@ -110,14 +141,22 @@ public:
     static constexpr uint8_t MAX_RETRY = 5;
     
     // During an active request this has a valid pointer. Otherwise it is null
-    httpd_req_t* _activeRequest = nullptr;
+    RequestContext* _context = nullptr;
+    
+    // Everything for a request is allocated here and freed at once when it's
+    // done, rather than churning the heap. Handlers run one at a time, so
+    // one arena serves them all. httpd_resp_set_hdr keeps pointers to the
+    // name and value until the response is sent, so headers added by
+    // handlers are copied here too
+    Arena _arena;
+    size_t _arenaCapacity = 0;
     
     // httpd_register_uri_handler is a c function which takes a function pointer
     // to a handler function. Since addHTTPHandler is a c++ call it takes a 
-    // HandlerCB std::function. So we need a container to hold it that can be 
+    // RequestHandlerCB std::function. So we need a container to hold it that can be 
     // passed to httpd_register_uri_handler as the user_ctx pointer. Then we need 
     // a c function that we can pass to httpd_register_uri_handler that will use
-    // user_ctx to call the HandlerCB. The problem is we need to allocate this
+    // user_ctx to call the RequestHandlerCB. The problem is we need to allocate this
     // container, so ownership is the issue. We will say that 
     // httpd_register_uri_handler owns it and it will live until 
     // httpd_unregister_uri_handler is called. But since WiFiPortal doesn' support
@@ -126,7 +165,7 @@ public:
     
     struct HandlerThunk
     {
-        HandlerThunk(HandlerCB handler, WiFiPortal* portal, const char* endpoint)
+        HandlerThunk(RequestHandlerCB handler, WiFiPortal* portal, const char* endpoint)
             : _handler(handler)
             , _portal(portal)
             , _endpoint(endpoint)
@@ -141,14 +180,54 @@ public:
             _endpoint = std::string(endpoint, len);
         }
         
-        HandlerCB _handler;
+        RequestHandlerCB _handler;
         WiFiPortal* _portal;
         std::string _endpoint;
     };
     
     static esp_err_t thunkHandler(httpd_req_t*);
     
-    std::unique_ptr<HTTPParser> _parser;
+    // WebSocket endpoints are registered with is_websocket, so httpd does the
+    // handshake, control frames and framing. A client is identified by its
+    // socket. httpd doesn't say when a client goes away, but it frees the
+    // context of a closed session, so each client gets one
+    struct WebSocketThunk
+    {
+        WebSocketThunk(WebSocketCB handler, IDFWiFiPortal* portal) : _handler(handler), _portal(portal) { }
+        
+        WebSocketCB _handler;
+        IDFWiFiPortal* _portal;
+        
+        // Added and removed on the httpd task, read by broadcasts from any task
+        std::mutex _mutex;
+        std::set<int> _clients;
+    };
+    
+    struct WebSocketSession
+    {
+        WebSocketThunk* thunk;
+        int fd;
+    };
+    
+    static esp_err_t webSocketHandler(httpd_req_t*);
+    static void freeWebSocketSession(void* ctx);
+    
+    // Frames can only be sent from the httpd task, so the message is
+    // copied and sent to each of fds from there
+    void queueWebSocketMessage(std::vector<int>&& fds, std::string_view message);
+    
+    std::map<std::string, WebSocketThunk*, std::less<>> _webSocketHandlers;
+    
+    // An event stream request is handed off to a task of its own, which
+    // follows the EventLog and sends its events as they come until the
+    // client goes away. Each stream keeps one of httpd's sockets and a
+    // task stack, so only a few are allowed at once
+    static esp_err_t eventStreamHandler(httpd_req_t*);
+    static void eventStreamTask(void* arg);
+    
+    static inline std::atomic<uint32_t> _eventStreams { 0 };
+    
+    HTTPParser::ArgMap _cacheControl;
 };
 
 }
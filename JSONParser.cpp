@@ -25,548 +25,416 @@ See more at http://blog.squix.ch and https://github.com/squix78/json-streaming-p
 
 #include "JSONParser.h"
 
-#include <cstring>
+#include "System.h"
+
+#include <algorithm>
+#include <charconv>
+#include <limits>
+#include <type_traits>
+#include <utility>
 
 using namespace mil;
 
-JSONParser::JSONParser() {
+static const char* TAG = "JSONParser";
+
+// The parser used by JSONParser subclasses is only compiled here
+template class mil::BasicJSONParser<JSONParser>;
+template class mil::BasicJSONParser<JSONPathFilter>;
+template class mil::BasicJSONParser<JSONDocument>;
+
+JSONPathFilter::JSONPathFilter(std::initializer_list<Subscription> subscriptions)
+{
+    _nodes.emplace_back();
+    for (const Subscription& subscription : subscriptions) {
+        uint16_t target = uint16_t(_targets.size());
+        _targets.push_back(subscription.target);
+        if (!addPath(subscription.path, target)) {
+            System::logE(TAG, "Invalid JSON path '%s'", subscription.path);
+        }
+    }
     reset();
 }
 
 void
-JSONParser::reset()
+JSONPathFilter::reset()
 {
-    _state = State::StartDocument;
-    _bufferPos = 0;
-    _unicodeEscapeBufferPos = 0;
-    _unicodeBufferPos = 0;
-    _currentLine = 1;
-    _currentChar = 1;
-    _errorString.clear();
+    BasicJSONParser::reset();
+    _found.assign(_targets.size(), false);
+    _foundCount = 0;
+    _frames.clear();
+    _next = 0;
 }
 
 bool
-JSONParser::parseNextChar(char c)
+JSONPathFilter::addPath(const char* path, uint16_t target)
 {
-    // Handle current line and char
-    if (c == '\n') {
-        _currentLine++;
-        _currentChar = 1;
-    } else {
-        _currentChar++;
-    }
-    
-    // valid whitespace characters in JSON (from RFC4627 for JSON) include:
-    // space, horizontal tab, line feed or new line, and carriage return.
-    // thanks:
-    // http://stackoverflow.com/questions/16042274/definition-of-whitespace-in-json
-    if ((c == ' ' || c == '\t' || c == '\n' || c == '\r')
-        && !(_state == State::InString || _state == State::Unicode || _state == State::StartEscape
-            || _state == State::InNumber || _state == State::StartDocument)) {
-        return true;
+    if (*path++ != '$') {
+        return false;
     }
-    
-    switch (_state) {
-        case State::InString:
-            if (c == '"') {
-                return endString();
-            }
-            if (c == '\\') {
-                _state = State::StartEscape;
-            } else if ((c < 0x1f) || (c == 0x7f)) {
-                _errorString = "Unescaped control character encountered";
-                return false;
-            }
-            _buffer[_bufferPos] = c;
-            increaseBufferPointer();
-            break;
-        case State::InArray:
-            if (c == ']') {
-                return endArray();
+
+    uint16_t node = 0;
+    while (*path) {
+        if (*path == '.') {
+            const char* key = ++path;
+            while (*path && *path != '.' && *path != '[') {
+                path++;
             }
-            return startValue(c);
-        case State::InObject:
-            if (c == '}') {
-                if (!endObject()) {
-                    return false;
-                }
-            } else if (c == '"') {
-                startKey();
-            } else {
-                _errorString = "Start of string expected for object key";
+            if (path == key) {
                 return false;
             }
-            break;
-        case State::EndKey:
-            if (c != ':') {
-                _errorString = "Expected ':' after key";
+            node = addChild(node, std::string_view(key, path - key), -1);
+        } else if (*path == '[') {
+            int32_t index;
+            const char* end = strchr(++path, ']');
+            if (!end) {
                 return false;
             }
-            _state = State::AfterKey;
-            break;
-        case State::AfterKey:
-            return startValue(c);
-        case State::StartEscape:
-            return processEscapeCharacters(c);
-        case State::Unicode:
-            return processUnicodeCharacter(c);
-        case State::UnicodeSurrogate:
-            _unicodeEscapeBuffer[_unicodeEscapeBufferPos] = c;
-            _unicodeEscapeBufferPos++;
-            if (_unicodeEscapeBufferPos == 2) {
-                return endUnicodeSurrogateInterstitial();
-            }
-            break;
-        case State::AfterValue: {
-            // not safe for size == 0!!!
-            Stack within = _stack.back();
-            if (within == Stack::Object) {
-                if (c == '}') {
-                    if (!endObject()) {
-                        return false;
-                    }
-                } else if (c == ',') {
-                    _state = State::InObject;
-                } else {
-                    _errorString = "Expected ',' or '}' while parsing object";
-                    return false;
-                }
-            } else if (within == Stack::Array) {
-                if (c == ']') {
-                    if (!endArray()) {
-                        return false;
-                    }
-                } else if (c == ',') {
-                    _state = State::InArray;
-                } else {
-                    _errorString = "Expected ',' or ']' while parsing array";
-                    return false;
-                }
-            } else {
-                _errorString = "Finished a literal, but unclear what state to move to";
+            auto [ptr, ec] = std::from_chars(path, end, index);
+            if (ec != std::errc() || ptr != end || index < 0) {
                 return false;
             }
-            break;
-        }
-        case State::InNumber:
-            if (c >= '0' && c <= '9') {
-                _buffer[_bufferPos] = c;
-                increaseBufferPointer();
-            } else if (c == '.') {
-                if (doesCharArrayContain(_buffer, _bufferPos, '.')) {
-                    _errorString = "Cannot have multiple decimal points in a number";
-                    return false;
-                } else if (doesCharArrayContain(_buffer, _bufferPos, 'e')) {
-                    _errorString = "Cannot have a decimal point in an exponent";
-                    return false;
-                }
-                _buffer[_bufferPos] = c;
-                increaseBufferPointer();
-            } else if (c == 'e' || c == 'E') {
-                if (doesCharArrayContain(_buffer, _bufferPos, 'e')) {
-                    _errorString = "Cannot have multiple exponents in a number";
-                    return false;
-                }
-                _buffer[_bufferPos] = c;
-                increaseBufferPointer();
-            } else if (c == '+' || c == '-') {
-                char last = _buffer[_bufferPos - 1];
-                if (!(last == 'e' || last == 'E')) {
-                    _errorString = "Can only have '+' or '-' after the 'e' or 'E' in a number";
-                    return false;
-                }
-                _buffer[_bufferPos] = c;
-                increaseBufferPointer();
-            } else {
-                endNumber();
-                // we have consumed one beyond the end of the number
-                parseNextChar(c);
-            }
-            break;
-        case State::InTrue:
-            _buffer[_bufferPos] = c;
-            increaseBufferPointer();
-            if (_bufferPos == 4) {
-                return endTrue();
-            }
-            break;
-        case State::InFalse:
-            _buffer[_bufferPos] = c;
-            increaseBufferPointer();
-            if (_bufferPos == 5) {
-                return endFalse();
-            }
-            break;
-        case State::InNull:
-            _buffer[_bufferPos] = c;
-            increaseBufferPointer();
-            if (_bufferPos == 4) {
-                return endNull();
-            }
-            break;
-        case State::StartDocument:
-            handleStartDocument();
-            if (c == '[') {
-                startArray();
-            } else if (c == '{') {
-                startObject();
-            } else {
-                _errorString = "Document must start with object or array.";
-                return false;
-            }
-            break;
-        case State::Done:
-            _errorString = "Expected end of document.";
+            path = end + 1;
+            node = addChild(node, std::string_view(), index);
+        } else {
             return false;
-        default:
-            _errorString = "Internal error. Reached an unknown state";
+        }
+        if (node == NoNode) {
             return false;
+        }
     }
 
+    if (_nodes[node].target != NoTarget) {
+        return false;
+    }
+    _nodes[node].target = target;
     return true;
 }
 
-void
-JSONParser::increaseBufferPointer()
+uint16_t
+JSONPathFilter::addChild(uint16_t node, std::string_view key, int32_t index)
 {
-    if (_bufferPos + 1 < BufferSize - 1) {
-        _bufferPos = _bufferPos + 1;
-    } else {
-        _bufferPos = BufferSize - 1;
+    uint16_t child = findChild(node, key, index);
+    if (child != NoNode) {
+        return child;
+    }
+    if (_nodes.size() >= NoNode) {
+        return NoNode;
     }
+
+    child = uint16_t(_nodes.size());
+    _nodes.emplace_back();
+    _nodes.back().key = key;
+    _nodes.back().index = index;
+    _nodes[node].children.push_back(child);
+    return child;
 }
 
-bool
-JSONParser::endString()
+uint16_t
+JSONPathFilter::findChild(uint16_t node, std::string_view key, int32_t index) const
 {
-    Stack popped = _stack.back();
-    _stack.pop_back();
-    if (popped == Stack::Key) {
-        _buffer[_bufferPos] = '\0';
-        handleKey(_buffer);
-        _state = State::EndKey;
-    } else if (popped == Stack::String) {
-        _buffer[_bufferPos] = '\0';
-        handleValue(_buffer);
-        _state = State::AfterValue;
-    } else {
-        _errorString = "Unexpected end of string";
-        return false;
+    for (uint16_t child : _nodes[node].children) {
+        const Node& n = _nodes[child];
+        if (n.index == index && (index >= 0 || n.key == key)) {
+            return child;
+        }
     }
-    _bufferPos = 0;
-    return true;
+    return NoNode;
 }
-  
+
 bool
-JSONParser::startValue(char c)
+JSONPathFilter::handleKey(std::string_view key)
 {
-    if (c == '[') {
-        startArray();
-    } else if (c == '{') {
-        startObject();
-    } else if (c == '"') {
-        startString();
-    } else if (isDigit(c)) {
-        startNumber(c);
-    } else if (c == 't') {
-        _state = State::InTrue;
-        _buffer[_bufferPos] = c;
-        increaseBufferPointer();
-    } else if (c == 'f') {
-        _state = State::InFalse;
-        _buffer[_bufferPos] = c;
-        increaseBufferPointer();
-    } else if (c == 'n') {
-        _state = State::InNull;
-        _buffer[_bufferPos] = c;
-        increaseBufferPointer();
-    } else {
-        _errorString = "Unexpected character for value";
-        return false;
+    _next = foundAll() ? NoNode : findChild(_frames.back().node, key, -1);
+    if (_next == NoNode) {
+        skipValue();
     }
     return true;
 }
 
 bool
-JSONParser::isDigit(char c)
+JSONPathFilter::handleElement()
 {
-    // Only concerned with the first character in a number.
-    return (c >= '0' && c <= '9') || c == '-';
-}
-
-bool
-JSONParser::endArray()
-{
-    Stack popped = _stack.back();
-    _stack.pop_back();
-    if (popped != Stack::Array) {
-        _errorString = "Unexpected end of array encountered";
-        return false;
-    }
-    handleEndArray();
-    _state = State::AfterValue;
-    if (_stack.empty()) {
-        endDocument();
+    Frame& frame = _frames.back();
+    _next = foundAll() ? NoNode : findChild(frame.node, std::string_view(), int32_t(frame.count));
+    frame.count++;
+    if (_next == NoNode) {
+        skipValue();
     }
     return true;
 }
 
-void
-JSONParser::startKey()
-{
-    _stack.push_back(Stack::Key);
-    _state = State::InString;
-}
-
+// A value is stored if its subscription hasn't been found yet and it
+// converts to the type of the target
+template <typename F>
 bool
-JSONParser::endObject()
+JSONPathFilter::deliver(F store)
 {
-    Stack popped = _stack.back();
-    _stack.pop_back();
-    if (popped != Stack::Object) {
-        _errorString = "Unexpected end of object encountered";
-        return false;
-    }
-    handleEndObject();
-    _state = State::AfterValue;
-    if (_stack.empty()) {
-        endDocument();
+    uint16_t target = _nodes[_next].target;
+    if (target != NoTarget && !_found[target] && std::visit(store, _targets[target])) {
+        _found[target] = true;
+        _foundCount++;
     }
     return true;
 }
 
+// A number stored to an integer is truncated, if it's in range
+template <typename T>
 bool
-JSONParser::processEscapeCharacters(char c)
+JSONPathFilter::storeNumber(T value)
 {
-    if (c == '"') {
-        _buffer[_bufferPos] = '"';
-        increaseBufferPointer();
-    } else if (c == '\\') {
-        _buffer[_bufferPos] = '\\';
-        increaseBufferPointer();
-    } else if (c == '/') {
-        _buffer[_bufferPos] = '/';
-        increaseBufferPointer();
-    } else if (c == 'b') {
-        _buffer[_bufferPos] = 0x08;
-        increaseBufferPointer();
-    } else if (c == 'f') {
-        _buffer[_bufferPos] = '\f';
-        increaseBufferPointer();
-    } else if (c == 'n') {
-        _buffer[_bufferPos] = '\n';
-        increaseBufferPointer();
-    } else if (c == 'r') {
-        _buffer[_bufferPos] = '\r';
-        increaseBufferPointer();
-    } else if (c == 't') {
-        _buffer[_bufferPos] = '\t';
-        increaseBufferPointer();
-    } else if (c == 'u') {
-        _state = State::Unicode;
-    } else {
-        _errorString = "Expected escaped character after backslash";
-        return false;
-    }
-    if (_state != State::Unicode) {
-        _state = State::InString;
-    }
-    return true;
+    return deliver([this, value](auto* v)
+    {
+        using V = std::remove_pointer_t<decltype(v)>;
+        if constexpr (std::is_same_v<V, std::string>) {
+            v->assign(valueText());
+            return true;
+        } else if constexpr (std::is_same_v<V, bool>) {
+            return false;
+        } else if constexpr (std::is_floating_point_v<V>) {
+            *v = V(value);
+            return true;
+        } else if constexpr (std::is_floating_point_v<T>) {
+            if (!(value >= T(std::numeric_limits<V>::min()) && value < T(std::numeric_limits<V>::max()) + 1)) {
+                return false;
+            }
+            *v = V(value);
+            return true;
+        } else {
+            if (!std::in_range<V>(value)) {
+                return false;
+            }
+            *v = V(value);
+            return true;
+        }
+    });
 }
 
 bool
-JSONParser::processUnicodeCharacter(char c)
+JSONPathFilter::handleString(std::string_view value)
 {
-    if (!isHexCharacter(c)) {
-        _errorString = "Expected hex character for escaped Unicode character";
-        return false;
+    // Some APIs quote their numbers
+    const char* first = value.data();
+    const char* last = first + value.size();
+    int64_t i;
+    auto [iptr, iec] = std::from_chars(first, last, i);
+    if (iec == std::errc() && iptr == last) {
+        return storeNumber(i);
     }
-
-    _unicodeBuffer[_unicodeBufferPos] = c;
-    _unicodeBufferPos++;
-
-    if (_unicodeBufferPos == 4) {
-        int codepoint = getHexArrayAsDecimal(_unicodeBuffer, _unicodeBufferPos);
-        endUnicodeCharacter(codepoint);
+    double d;
+    auto [dptr, dec] = std::from_chars(first, last, d);
+    if (dec == std::errc() && dptr == last) {
+        return storeNumber(d);
     }
-    return true;
+
+    return deliver([value](auto* v)
+    {
+        if constexpr (std::is_same_v<std::remove_pointer_t<decltype(v)>, std::string>) {
+            v->assign(value);
+            return true;
+        } else {
+            return false;
+        }
+    });
 }
 
 bool
-JSONParser::isHexCharacter(char c)
+JSONPathFilter::handleBool(bool value)
 {
-    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    return deliver([this, value](auto* v)
+    {
+        using V = std::remove_pointer_t<decltype(v)>;
+        if constexpr (std::is_same_v<V, std::string>) {
+            v->assign(valueText());
+            return true;
+        } else if constexpr (std::is_same_v<V, bool>) {
+            *v = value;
+            return true;
+        } else {
+            return false;
+        }
+    });
 }
 
-int
-JSONParser::getHexArrayAsDecimal(char hexArray[], int length)
+int64_t
+JSONValue::asInt(int64_t def) const
 {
-    int result = 0;
-    for (int i = 0; i < length; i++) {
-      char current = hexArray[length - i - 1];
-      int value = 0;
-      if (current >= 'a' && current <= 'f') {
-        value = current - 'a' + 10;
-      } else if (current >= 'A' && current <= 'F') {
-        value = current - 'A' + 10;
-      } else if (current >= '0' && current <= '9') {
-        value = current - '0';
-      }
-      result += value * 16^i;
+    switch (type()) {
+        case Type::Int: return _node->i;
+        case Type::Double:
+            if (_node->d >= -9.2e18 && _node->d <= 9.2e18) {
+                return int64_t(_node->d);
+            }
+            return def;
+        default: return def;
     }
-    return result;
 }
 
-bool
-JSONParser::doesCharArrayContain(char myArray[], int length, char c)
+double
+JSONValue::asDouble(double def) const
 {
-    for (int i = 0; i < length; i++) {
-      if (myArray[i] == c) {
-        return true;
-      }
+    switch (type()) {
+        case Type::Int: return double(_node->i);
+        case Type::Double: return _node->d;
+        default: return def;
     }
-    return false;
 }
 
-bool
-JSONParser::endUnicodeSurrogateInterstitial()
+JSONValue
+JSONValue::operator[](size_t i) const
 {
-    char unicodeEscape = _unicodeEscapeBuffer[_unicodeBufferPos - 1];
-    if (unicodeEscape != 'u') {
-        _errorString = "Expected '\\u' following a Unicode high surrogate";
-        return false;
+    if (!isArray() || i >= _node->size) {
+        return JSONValue();
     }
-    _unicodeBufferPos = 0;
-    _unicodeBufferPos = 0;
-    _state = State::Unicode;
-    return true;
+    return JSONValue(_base, _base + _node->offset + i);
 }
 
-void
-JSONParser::endNumber()
+JSONValue
+JSONValue::operator[](std::string_view key) const
 {
-    _buffer[_bufferPos] = '\0';
-    handleValue(_buffer);
-    _bufferPos = 0;
-    _state = State::AfterValue;
-}
-
-int
-JSONParser::convertDecimalBufferToInt(char myArray[], int length)
-{
-    int result = 0;
-    for (int i = 0; i < length; i++) {
-      char current = myArray[length - i - 1];
-      result += (current - '0') * 10;
+    if (!isObject()) {
+        return JSONValue();
     }
-    return result;
-}
 
-void
-JSONParser::endDocument()
-{
-    handleEndDocument();
-    _state = State::Done;
+    const Node* members = _base + _node->offset;
+    size_t lo = 0;
+    size_t hi = _node->size;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = string(members[2 * mid]).compare(key);
+        if (cmp == 0) {
+            return JSONValue(_base, members + 2 * mid + 1);
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return JSONValue();
 }
 
-bool
-JSONParser::endTrue()
+std::string_view
+JSONValue::key(size_t i) const
 {
-    _buffer[_bufferPos] = '\0';
-    if (strcmp(_buffer, "true") == 0) {
-        handleValue("true");
-    } else {
-        _errorString = "Expected 'true'";
-        return false;
+    if (!isObject() || i >= _node->size) {
+        return std::string_view();
     }
-    _bufferPos = 0;
-    _state = State::AfterValue;
-    return true;
+    return string(_base[_node->offset + 2 * i]);
 }
 
-bool
-JSONParser::endFalse()
+JSONValue
+JSONValue::value(size_t i) const
 {
-    _buffer[_bufferPos] = '\0';
-    if (strcmp(_buffer, "false") == 0) {
-        handleValue("false");
-    } else {
-        _errorString = "Expected 'false'";
-        return false;
+    if (!isObject() || i >= _node->size) {
+        return JSONValue();
     }
-    _bufferPos = 0;
-    _state = State::AfterValue;
-    return true;
+    return JSONValue(_base, _base + _node->offset + 2 * i + 1);
 }
 
-bool
-JSONParser::endNull()
+std::map<std::string_view, JSONValue>
+JSONValue::asMap() const
 {
-    _buffer[_bufferPos] = '\0';
-    if (strcmp(_buffer, "null") == 0) {
-        handleValue("null");
-    } else {
-        _errorString = "Expected 'null'";
-        return false;
+    std::map<std::string_view, JSONValue> map;
+    for (size_t i = 0; i < size(); ++i) {
+        // Already sorted, so each goes at the end
+        map.emplace_hint(map.end(), key(i), value(i));
     }
-    _bufferPos = 0;
-    _state = State::AfterValue;
-    return true;
+    return map;
 }
 
 void
-JSONParser::startArray()
+JSONDocument::reset()
 {
-    handleStartArray();
-    _state = State::InArray;
-    _stack.push_back(Stack::Array);
+    BasicJSONParser::reset();
+    _arena.clear();
+    _root = NoRoot;
+    _stack.clear();
+    _frames.clear();
 }
 
-void
-JSONParser::startObject()
+JSONValue
+JSONDocument::root() const
 {
-    handleStartObject();
-    _state = State::InObject;
-    _stack.push_back(Stack::Object);
+    if (_root == NoRoot) {
+        return JSONValue();
+    }
+    return JSONValue(_arena.data(), _arena.data() + _root);
 }
 
-void
-JSONParser::startString()
+uint32_t
+JSONDocument::addString(std::string_view s)
 {
-    _stack.push_back(Stack::String);
-    _state = State::InString;
+    size_t offset = _arena.size();
+    _arena.resize(offset + (s.size() + sizeof(Node) - 1) / sizeof(Node));
+    memcpy(reinterpret_cast<char*>(_arena.data() + offset), s.data(), s.size());
+    return uint32_t(offset);
 }
 
-void
-JSONParser::startNumber(char c)
+JSONValue::Node&
+JSONDocument::push(Type type, uint32_t size, uint32_t offset)
 {
-    _state = State::InNumber;
-    _buffer[_bufferPos] = c;
-    increaseBufferPointer();
+    Node& node = _stack.emplace_back();
+    node.type = type;
+    node.size = size;
+    node.offset = offset;
+    return node;
 }
 
-void
-JSONParser::endUnicodeCharacter(int codepoint)
+std::string_view
+JSONDocument::string(const Node& node) const
 {
-    _buffer[_bufferPos] = convertCodepointToCharacter(codepoint);
-    increaseBufferPointer();
-    _unicodeBufferPos = 0;
-    _unicodeHighSurrogate = -1;
-    _state = State::InString;
+    return std::string_view(reinterpret_cast<const char*>(_arena.data() + node.offset), node.size);
 }
 
-char
-JSONParser::convertCodepointToCharacter(int num)
+bool
+JSONDocument::endContainer()
 {
-    if (num <= 0x7F) {
-        return (char) (num);
+    Frame frame = _frames.back();
+    _frames.pop_back();
+
+    uint32_t offset = uint32_t(_arena.size());
+    if (frame.type == Type::Array) {
+        _arena.insert(_arena.end(), _stack.begin() + frame.start, _stack.end());
+    } else {
+        // Sort the keys and copy each one with its value. Of keys that are
+        // the same, the sort leaves the last one last and it's the one kept
+        _order.clear();
+        for (size_t i = frame.start; i < _stack.size(); i += 2) {
+            _order.push_back(uint32_t(i));
+        }
+        std::stable_sort(_order.begin(), _order.end(), [this](uint32_t a, uint32_t b)
+        {
+            return string(_stack[a]) < string(_stack[b]);
+        });
+
+        for (size_t i = 0; i < _order.size(); ++i) {
+            if (i + 1 < _order.size() && string(_stack[_order[i]]) == string(_stack[_order[i + 1]])) {
+                continue;
+            }
+            _arena.push_back(_stack[_order[i]]);
+            _arena.push_back(_stack[_order[i] + 1]);
+        }
+    }
+
+    uint32_t size = uint32_t(_arena.size() - offset);
+    if (frame.type == Type::Object) {
+        size /= 2;
     }
-    
-    // if(num<=0x7FF) return (char)((num>>6)+192) + (char)((num&63)+128);
-    // if(num<=0xFFFF) return
-    // chr((num>>12)+224).chr(((num>>6)&63)+128).chr((num&63)+128);
-    // if(num<=0x1FFFFF) return
-    // chr((num>>18)+240).chr(((num>>12)&63)+128).chr(((num>>6)&63)+128).chr((num&63)+128);
-
-    return ' ';
+    _stack.resize(frame.start);
+    push(frame.type, size, offset);
+    return true;
+}
+
+bool
+JSONDocument::handleEndDocument()
+{
+    _root = uint32_t(_arena.size());
+    _arena.push_back(_stack.back());
+
+    // The document is done growing. Give back what it doesn't use and the
+    // memory used to build it
+    _arena.shrink_to_fit();
+    std::vector<Node>().swap(_stack);
+    std::vector<uint32_t>().swap(_order);
+    return true;
 }
@@ -5,115 +5,1145 @@
     All rights reserved.
     Use of this source code is governed by the MIT license that can be
     found in the LICENSE file.
-    
+
     Original code is Copyright (c) 2015 by Daniel Eichhorn. See:
 
         http://blog.squix.ch
         https://github.com/squix78/json-streaming-parser
 
     The code has been significantly altered to follow the ESPlib
-    style guide and to have more C++ style functionality. I've 
-    also added the ability to parse from a file into a nested 
-    std::map or std::vector, or a std::string if that's all there 
-    is in the JSON. The parsed file is returned as a JSONParser::Value
-    which is a tagged union of these 3 types
+    style guide and to have more C++ style functionality. I've
+    also added the ability to parse a whole document into a tree
+    with JSONDocument. Each value in it is a JSONValue, a tagged
+    union of null, bool, number, string, array and object
 -------------------------------------------------------------------------*/
 
 #pragma once
 
 #include "mil.h"
 
+#include <bit>
+#include <charconv>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <map>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
 namespace mil {
 
-class JSONParser
+// BasicJSONParser is a streaming (SAX style) parser. The document is
+// passed to parse() in as many pieces as it comes in, split anywhere, and
+// the handlers are called as each token is finished.
+//
+// Rather than look at each char on its own, parse() scans a run of string
+// or number chars at a time. Strings are scanned 8 bytes at a time for the
+// quote, backslash or control char that ends the run. A token that is all
+// in one buffer and has no escapes is passed to its handler as a view of
+// the buffer. Otherwise it is put together in the parser's token buffer.
+// Either way the view is only good during the call. Tokens can be any
+// size. The token buffer is small and a token that outgrows it spills to
+// the heap.
+//
+// The handlers are those of Derived, which hides the defaults here with
+// its own (CRTP). They aren't virtual, so they can be inlined into the
+// parse loop. Derived has to make BasicJSONParser a friend if they aren't
+// public. A handler returns false to stop the parse.
+//
+// Each number is converted once, with std::from_chars, so it's exact and
+// doesn't depend on the locale. It goes to handleInt if it has no
+// fraction or exponent and fits in an int64_t, and to handleDouble if
+// not. true, false and null go to handleBool and handleNull and string
+// values to handleString. By default each of these passes the value's
+// text on to handleValue, so a Derived that only wants text can just hide
+// handleValue. valueText() is the text during any of them.
+//
+// handleElement is called before each array element. From it or from
+// handleKey, Derived can call skipValue() to skip the value that comes
+// next. Its handlers aren't called and its strings aren't put together,
+// so an unwanted subtree costs little more than scanning it. Only its
+// structure is checked.
+
+template <typename Derived>
+class BasicJSONParser
 {
   public:
-    JSONParser();
-    bool parseNextChar(char c);
+    BasicJSONParser() { reset(); }
+
+    // Returns false on a syntax error or if a handler stopped the parse.
+    // After that everything is ignored until reset()
+    bool parse(const char* buf, size_t size);
+    bool parse(std::string_view s) { return parse(s.data(), s.size()); }
+    bool parseNextChar(char c)
+    {
+        // Most chars fed one at a time are in the middle of a string
+        if (_state == State::InString && c != '"' && c != '\\' && uint8_t(c) >= 0x20) {
+            appendChar(c);
+            _offset++;
+            return true;
+        }
+        return parse(&c, 1);
+    }
+
     void reset();
-    std::string errorString()
+
+    bool failed() const { return _state == State::Failed; }
+
+    std::string errorString() const
     {
         return _errorString + " at line " + std::to_string(_currentLine) + ", char " + std::to_string(_currentChar);
     }
 
   protected:
-    virtual bool handleWhitespace(char c) { return true; }
-    virtual bool handleStartDocument() { return true; }
-    virtual bool handleKey(const std::string& key) { return true; }
-    virtual bool handleValue(const std::string& value) { return true; }
-    virtual bool handleEndArray() { return true; }
-    virtual bool handleEndObject() { return true; }
-    virtual bool handleEndDocument() { return true; }
-    virtual bool handleStartArray() { return true; }
-    virtual bool handleStartObject() { return true; }
+    bool handleStartDocument() { return true; }
+    bool handleKey(std::string_view key) { return true; }
+    bool handleValue(std::string_view value) { return true; }
+    bool handleString(std::string_view value) { return derived().handleValue(value); }
+    bool handleInt(int64_t value) { return derived().handleValue(_valueText); }
+    bool handleDouble(double value) { return derived().handleValue(_valueText); }
+    bool handleBool(bool value) { return derived().handleValue(_valueText); }
+    bool handleNull() { return derived().handleValue(_valueText); }
+    bool handleEndArray() { return true; }
+    bool handleEndObject() { return true; }
+    bool handleEndDocument() { return true; }
+    bool handleStartArray() { return true; }
+    bool handleStartObject() { return true; }
+    bool handleElement() { return true; }
+
+    void skipValue() { _skipNext = true; }
+
+    std::string_view valueText() const { return _valueText; }
 
   private:
-    static constexpr int BufferSize = 512;
-    
-    enum class State {
+    // Room for most keys and numbers
+    static constexpr size_t InlineTokenSize = 64;
+
+    // States before InString are between tokens, where whitespace is skipped
+    enum class State : uint8_t {
         StartDocument,
         Done,
         InArray,
         InObject,
+        NextElement,    // After a ',', where the container can't end
+        NextKey,
         EndKey,
         AfterKey,
+        AfterValue,
         InString,
         StartEscape,
         Unicode,
-        InNumber,
-        InTrue,
-        InFalse,
-        InNull,
-        AfterValue,
         UnicodeSurrogate,
+        InNumber,
+        InLiteral,
+        Failed,
     };
-    
-    enum class Stack { Object, Array, Key, String };
-
-    void increaseBufferPointer();
-    bool endString();
-    bool endArray();
-    bool startValue(char c);
-    void startKey();
-    bool processEscapeCharacters(char c);
-    bool isDigit(char c);
-    bool isHexCharacter(char c);
-    char convertCodepointToCharacter(int num);
-    void endUnicodeCharacter(int codepoint);
-    void startNumber(char c);
-    void startString();
-    void startObject();
-    void startArray();
-    bool endNull();
-    bool endFalse();
-    bool endTrue();
-    void endDocument();
-    int convertDecimalBufferToInt(char myArray[], int length);
-    void endNumber();
-    bool endUnicodeSurrogateInterstitial();
-    bool doesCharArrayContain(char myArray[], int length, char c);
-    int getHexArrayAsDecimal(char hexArray[], int length);
-    bool processUnicodeCharacter(char c);
-    bool endObject();
-    
+
+    enum class Stack : uint8_t { Object, Array };
+
+    Derived& derived() { return static_cast<Derived&>(*this); }
+
+    const char* skipWhitespace(const char* p, const char* end);
+    static const char* findStringEnd(const char* p, const char* end);
+    static const char* findNumberEnd(const char* p, const char* end);
+    static bool isValidNumber(std::string_view);
+
+    bool startValue(const char*& p);
+    bool endString(const char* p);
+    bool endNumber(const char* p);
+    bool handleNumber(std::string_view);
+    static int64_t decimalMagnitude(std::string_view);
+    bool endContainer(Stack, const char* p);
+    bool processEscape(const char* p);
+    bool processUnicode(const char* p);
+
+    // The token so far is in the buffer if it started in an earlier
+    // buffer or had an escape. If not, it's all between _tokenStart and end
+    std::string_view token(const char* end);
+    void appendToken(const char* start, const char* end);
+    void appendChar(char c) { appendToken(&c, &c + 1); }
+    void clearToken() { _tokenSize = 0; _spilled = false; }
+    void appendCodepoint(uint32_t codepoint);
+
+    bool fail(const char* error, const char* p);
+
+    bool handleLiteral()
+    {
+        _valueText = _literal;
+        switch (_literal[0]) {
+            case 't': return derived().handleBool(true);
+            case 'f': return derived().handleBool(false);
+            default: return derived().handleNull();
+        }
+    }
+
+    // Called at the end of each value
+    void endSkip()
+    {
+        if (_skipping && _stack.size() == _skipLevel) {
+            _skipping = false;
+        }
+    }
+
     State _state;
     std::vector<Stack> _stack;
+    bool _inKey = false;
+
+    // Skipping goes on until the stack is back to _skipLevel
+    bool _skipNext = false;
+    bool _skipping = false;
+    size_t _skipLevel = 0;
+
+    // Only good during parse()
+    const char* _chunk = nullptr;
+    const char* _tokenStart = nullptr;
 
-    bool _doEmitWhitespace = false;
-    
-    char _buffer[BufferSize];
-    int _bufferPos = 0;
+    char _token[InlineTokenSize];
+    size_t _tokenSize = 0;
 
-    char _unicodeEscapeBuffer[10];
-    int _unicodeEscapeBufferPos = 0;
+    // Holds the token instead, once it's too big for _token. It keeps its
+    // memory for the next big one
+    std::string _spill;
+    bool _spilled = false;
 
-    char _unicodeBuffer[10];
-    int _unicodeBufferPos = 0;
-    int _unicodeHighSurrogate = 0;
-    
+    const char* _literal = nullptr;
+    uint8_t _literalPos = 0;
+
+    // The token being handled
+    std::string_view _valueText;
+
+    uint32_t _unicode = 0;
+    uint8_t _unicodePos = 0;
+    uint32_t _highSurrogate = 0;
+
+    // For error positions. Newlines are only ever between tokens, so
+    // they're counted while skipping whitespace
+    size_t _offset = 0;
+    size_t _lineStart = 0;
     int _currentLine = 1;
     int _currentChar = 1;
     std::string _errorString;
 };
 
+// JSONParser calls virtual handlers with std::strings, for subclasses
+// that would rather override than be templates
+
+class JSONParser : public BasicJSONParser<JSONParser>
+{
+  public:
+    virtual ~JSONParser() { }
+
+  protected:
+    virtual bool handleStartDocument() { return true; }
+    virtual bool handleKey(const std::string& key) { return true; }
+    virtual bool handleValue(const std::string& value) { return true; }
+    virtual bool handleInt(int64_t value) { return BasicJSONParser::handleInt(value); }
+    virtual bool handleDouble(double value) { return BasicJSONParser::handleDouble(value); }
+    virtual bool handleBool(bool value) { return BasicJSONParser::handleBool(value); }
+    virtual bool handleNull() { return BasicJSONParser::handleNull(); }
+    virtual bool handleEndArray() { return true; }
+    virtual bool handleEndObject() { return true; }
+    virtual bool handleEndDocument() { return true; }
+    virtual bool handleStartArray() { return true; }
+    virtual bool handleStartObject() { return true; }
+
+  private:
+    friend class BasicJSONParser<JSONParser>;
+
+    bool handleKey(std::string_view key) { _string.assign(key); return handleKey(_string); }
+    bool handleValue(std::string_view value) { _string.assign(value); return handleValue(_string); }
+
+    // Reused for each token, so it only allocates when a token is longer than any before
+    std::string _string;
+};
+
+extern template class BasicJSONParser<JSONParser>;
+
+// JSONPathFilter picks a few values out of a document by path and skips
+// everything else. Each subscription is a path and a pointer to where
+// its value goes:
+//
+//      float hi;
+//      std::string text;
+//      JSONPathFilter filter {
+//          { "$.forecast.forecastday[0].day.maxtemp_f", &hi },
+//          { "$.current.condition.text", &text },
+//      };
+//
+// A path is $ followed by .key and [index] steps. The paths are compiled
+// into a trie when the filter is made. Keys and array elements that
+// aren't in the trie are skipped without being put together, so only the
+// subscribed values are ever copied. A value is converted to the type of
+// its target. Any value can go to a string, as its text, and a number in
+// a string can go to a number. A value that can't be converted, or a null,
+// isn't stored and its subscription isn't found. Once everything has been found the rest of
+// the document is skipped.
+
+class JSONPathFilter : public BasicJSONParser<JSONPathFilter>
+{
+  public:
+    using Target = std::variant<std::string*, int32_t*, uint32_t*, int64_t*, float*, double*, bool*>;
+
+    struct Subscription
+    {
+        const char* path;
+        Target target;
+    };
+
+    JSONPathFilter(std::initializer_list<Subscription>);
+
+    // Also forgets what was found
+    void reset();
+
+    // Subscriptions are numbered in the order given
+    bool found(size_t i) const { return _found[i]; }
+    bool foundAll() const { return _foundCount == _targets.size(); }
+
+  private:
+    friend class BasicJSONParser<JSONPathFilter>;
+
+    static constexpr uint16_t NoNode = 0xffff;
+    static constexpr uint16_t NoTarget = 0xffff;
+
+    // A step is a key or, if index isn't -1, an array index
+    struct Node
+    {
+        std::string key;
+        int32_t index = -1;
+        uint16_t target = NoTarget;
+        std::vector<uint16_t> children;
+    };
+
+    struct Frame
+    {
+        uint16_t node;
+        uint32_t count;
+    };
+
+    bool addPath(const char* path, uint16_t target);
+    uint16_t addChild(uint16_t node, std::string_view key, int32_t index);
+    uint16_t findChild(uint16_t node, std::string_view key, int32_t index) const;
+    template <typename F> bool deliver(F store);
+    template <typename T> bool storeNumber(T value);
+
+    bool handleKey(std::string_view key);
+    bool handleElement();
+    bool handleString(std::string_view value);
+    bool handleInt(int64_t value) { return storeNumber(value); }
+    bool handleDouble(double value) { return storeNumber(value); }
+    bool handleBool(bool value);
+    bool handleNull() { return true; }
+    bool handleStartArray() { _frames.push_back({ _next, 0 }); return true; }
+    bool handleStartObject() { _frames.push_back({ _next, 0 }); return true; }
+    bool handleEndArray() { _frames.pop_back(); return true; }
+    bool handleEndObject() { _frames.pop_back(); return true; }
+
+    // Node 0 is $
+    std::vector<Node> _nodes;
+    std::vector<Target> _targets;
+    std::vector<bool> _found;
+    size_t _foundCount = 0;
+
+    // The containers being parsed that are in the trie, and the node of
+    // the value that comes next
+    std::vector<Frame> _frames;
+    uint16_t _next = 0;
+};
+
+extern template class BasicJSONParser<JSONPathFilter>;
+
+// JSONValue is a value in a JSONDocument. It's a small handle, passed by
+// value, to a node in the document. Objects, arrays and strings are views
+// into the document, so nothing is copied when walking it. A value is good
+// as long as its document is and until the document is reset.
+//
+// Asking for something a value doesn't have gives a default: a missing key
+// or index gives a Null value, asInt() of a string gives 0 and so on.
+// exists() tells a missing value from a null one.
+
+class JSONValue
+{
+  public:
+    enum class Type : uint8_t { Null, Bool, Int, Double, String, Array, Object };
+
+    JSONValue() { }
+
+    Type type() const { return _node ? _node->type : Type::Null; }
+    bool exists() const { return _node != nullptr; }
+    bool isNull() const { return type() == Type::Null; }
+    bool isBool() const { return type() == Type::Bool; }
+    bool isNumber() const { return type() == Type::Int || type() == Type::Double; }
+    bool isString() const { return type() == Type::String; }
+    bool isArray() const { return type() == Type::Array; }
+    bool isObject() const { return type() == Type::Object; }
+
+    // Numbers are kept as they were parsed, an int64_t if they fit and a
+    // double otherwise. Each converts to the other
+    bool asBool(bool def = false) const { return isBool() ? _node->b : def; }
+    int64_t asInt(int64_t def = 0) const;
+    double asDouble(double def = 0) const;
+    std::string_view asString(std::string_view def = { }) const { return isString() ? string(*_node) : def; }
+
+    // Elements of an array or members of an object
+    size_t size() const { return (isArray() || isObject()) ? _node->size : 0; }
+
+    JSONValue operator[](size_t i) const;
+
+    // Members are sorted by key, so this is a binary search. key(i) and
+    // value(i) are member i in that order
+    JSONValue operator[](std::string_view key) const;
+    std::string_view key(size_t i) const;
+    JSONValue value(size_t i) const;
+
+    // For code that wants a map. The keys are views into the document
+    std::map<std::string_view, JSONValue> asMap() const;
+
+  private:
+    friend class JSONDocument;
+
+    // Every node is 16 bytes. An array's elements are size nodes in a row
+    // at offset. An object's members are size key and value pairs, sorted
+    // by key. A string's chars are at offset, packed into as many nodes as
+    // they need
+    struct Node
+    {
+        Type type;
+        uint32_t size;
+        union {
+            bool b;
+            int64_t i;
+            double d;
+            uint32_t offset;
+        };
+    };
+
+    JSONValue(const Node* base, const Node* node) : _base(base), _node(node) { }
+
+    std::string_view string(const Node& node) const
+    {
+        return std::string_view(reinterpret_cast<const char*>(_base + node.offset), node.size);
+    }
+
+    const Node* _base = nullptr;
+    const Node* _node = nullptr;
+};
+
+// JSONDocument parses a whole document into JSONValues. It's meant for
+// small documents like config files and UI panels, where it's easier to
+// look things up than to follow the parse with a state machine.
+//
+// Everything goes into one contiguous array of nodes, strings included, so
+// a document is one allocation once it's parsed. Containers are built from
+// the bottom up. Each one's children are gathered on a stack and copied to
+// the arena in one piece when it ends, with object members sorted. A key
+// that appears twice in an object keeps its last value.
+//
+//      JSONDocument doc;
+//      if (doc.parse(json) && doc.root().isObject()) {
+//          std::string_view effect = doc.root()["currentEffect"].asString();
+//      }
+
+class JSONDocument : public BasicJSONParser<JSONDocument>
+{
+  public:
+    // Also frees the document
+    void reset();
+
+    // Doesn't exist until a whole document has been parsed
+    JSONValue root() const;
+
+    // Bytes used by the document
+    size_t size() const { return _arena.size() * sizeof(Node); }
+
+  private:
+    friend class BasicJSONParser<JSONDocument>;
+
+    using Node = JSONValue::Node;
+    using Type = JSONValue::Type;
+
+    static constexpr uint32_t NoRoot = UINT32_MAX;
+
+    struct Frame
+    {
+        Type type;
+        size_t start;
+    };
+
+    uint32_t addString(std::string_view s);
+    Node& push(Type type, uint32_t size = 0, uint32_t offset = 0);
+    std::string_view string(const Node& node) const;
+
+    bool handleKey(std::string_view key) { push(Type::String, uint32_t(key.size()), addString(key)); return true; }
+    bool handleString(std::string_view value) { push(Type::String, uint32_t(value.size()), addString(value)); return true; }
+    bool handleInt(int64_t value) { push(Type::Int).i = value; return true; }
+    bool handleDouble(double value) { push(Type::Double).d = value; return true; }
+    bool handleBool(bool value) { push(Type::Bool).b = value; return true; }
+    bool handleNull() { push(Type::Null); return true; }
+    bool handleStartArray() { _frames.push_back({ Type::Array, _stack.size() }); return true; }
+    bool handleStartObject() { _frames.push_back({ Type::Object, _stack.size() }); return true; }
+    bool handleEndArray() { return endContainer(); }
+    bool handleEndObject() { return endContainer(); }
+    bool handleEndDocument();
+
+    bool endContainer();
+
+    std::vector<Node> _arena;
+    uint32_t _root = NoRoot;
+
+    // Values of the containers being parsed and, for objects, their keys
+    std::vector<Node> _stack;
+    std::vector<Frame> _frames;
+    std::vector<uint32_t> _order;
+};
+
+extern template class BasicJSONParser<JSONDocument>;
+
+template <typename Derived>
+void
+BasicJSONParser<Derived>::reset()
+{
+    _state = State::StartDocument;
+    _stack.clear();
+    _skipNext = false;
+    _skipping = false;
+    clearToken();
+    _unicodePos = 0;
+    _highSurrogate = 0;
+    _offset = 0;
+    _lineStart = 0;
+    _currentLine = 1;
+    _currentChar = 1;
+    _errorString.clear();
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::parse(const char* buf, size_t size)
+{
+    if (_state == State::Failed) {
+        return false;
+    }
+
+    const char* p = buf;
+    const char* end = buf + size;
+    _chunk = buf;
+
+    // A string or number from the last buffer continues here
+    _tokenStart = p;
+
+    while (p < end) {
+        if (_state < State::InString) {
+            p = skipWhitespace(p, end);
+            if (p == end) {
+                break;
+            }
+        }
+
+        char c = *p;
+
+        switch (_state) {
+            case State::StartDocument:
+                if (!derived().handleStartDocument()) {
+                    return fail("Stopped by handler", p);
+                }
+                if (c != '[' && c != '{') {
+                    return fail("Document must start with object or array.", p);
+                }
+                if (!startValue(p)) {
+                    return false;
+                }
+                break;
+            case State::Done:
+                return fail("Expected end of document.", p);
+            case State::InArray:
+            case State::NextElement:
+                if (c == ']') {
+                    if (_state == State::NextElement) {
+                        return fail("Expected value after ','", p);
+                    }
+                    if (!endContainer(Stack::Array, p++)) {
+                        return false;
+                    }
+                } else {
+                    if (!_skipping && !derived().handleElement()) {
+                        return fail("Stopped by handler", p);
+                    }
+                    if (!startValue(p)) {
+                        return false;
+                    }
+                }
+                break;
+            case State::InObject:
+            case State::NextKey:
+                if (c == '}') {
+                    if (_state == State::NextKey) {
+                        return fail("Expected key after ','", p);
+                    }
+                    if (!endContainer(Stack::Object, p++)) {
+                        return false;
+                    }
+                } else if (c == '"') {
+                    _inKey = true;
+                    _state = State::InString;
+                    _tokenStart = ++p;
+                } else {
+                    return fail("Start of string expected for object key", p);
+                }
+                break;
+            case State::EndKey:
+                if (c != ':') {
+                    return fail("Expected ':' after key", p);
+                }
+                _state = State::AfterKey;
+                ++p;
+                break;
+            case State::AfterKey:
+                if (!startValue(p)) {
+                    return false;
+                }
+                break;
+            case State::AfterValue:
+                if (_stack.back() == Stack::Object) {
+                    if (c == '}') {
+                        if (!endContainer(Stack::Object, p)) {
+                            return false;
+                        }
+                    } else if (c == ',') {
+                        _state = State::NextKey;
+                    } else {
+                        return fail("Expected ',' or '}' while parsing object", p);
+                    }
+                } else {
+                    if (c == ']') {
+                        if (!endContainer(Stack::Array, p)) {
+                            return false;
+                        }
+                    } else if (c == ',') {
+                        _state = State::NextElement;
+                    } else {
+                        return fail("Expected ',' or ']' while parsing array", p);
+                    }
+                }
+                ++p;
+                break;
+            case State::InString:
+                p = findStringEnd(p, end);
+                if (p == end) {
+                    break;
+                }
+                if (*p == '"') {
+                    if (!endString(p++)) {
+                        return false;
+                    }
+                } else if (*p == '\\') {
+                    appendToken(_tokenStart, p++);
+                    _state = State::StartEscape;
+                } else {
+                    return fail("Unescaped control character encountered", p);
+                }
+                break;
+            case State::StartEscape:
+                if (!processEscape(p++)) {
+                    return false;
+                }
+                break;
+            case State::Unicode:
+            case State::UnicodeSurrogate:
+                if (!processUnicode(p++)) {
+                    return false;
+                }
+                break;
+            case State::InNumber:
+                p = findNumberEnd(p, end);
+                if (p != end && !endNumber(p)) {
+                    return false;
+                }
+                break;
+            case State::InLiteral:
+                if (c != _literal[_literalPos]) {
+                    return fail("Unexpected character in literal", p);
+                }
+                ++p;
+                if (_literal[++_literalPos] == '\0') {
+                    if (!_skipping && !handleLiteral()) {
+                        return fail("Stopped by handler", p);
+                    }
+                    _state = State::AfterValue;
+                    endSkip();
+                }
+                break;
+            case State::Failed:
+                return false;
+        }
+    }
+
+    // Keep the part of a string or number that's in this buffer
+    if (_state == State::InString || _state == State::InNumber) {
+        appendToken(_tokenStart, end);
+    }
+
+    _offset += size;
+    return true;
+}
+
+template <typename Derived>
+const char*
+BasicJSONParser<Derived>::skipWhitespace(const char* p, const char* end)
+{
+    // valid whitespace characters in JSON (from RFC4627 for JSON) include:
+    // space, horizontal tab, line feed or new line, and carriage return.
+    for ( ; p < end; ++p) {
+        char c = *p;
+        if (c == '\n') {
+            _currentLine++;
+            _lineStart = _offset + (p - _chunk) + 1;
+        } else if (c != ' ' && c != '\t' && c != '\r') {
+            break;
+        }
+    }
+    return p;
+}
+
+template <typename Derived>
+const char*
+BasicJSONParser<Derived>::findStringEnd(const char* p, const char* end)
+{
+    // A byte is flagged if it's a quote, backslash or less than 0x20. The
+    // subtraction can also flag bytes after one of those, but never before,
+    // so the lowest flagged byte is the first one
+    if constexpr (std::endian::native == std::endian::little) {
+        constexpr uint64_t Ones = 0x0101010101010101ULL;
+        constexpr uint64_t Highs = 0x8080808080808080ULL;
+
+        while (end - p >= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            uint64_t quote = v ^ (Ones * '"');
+            uint64_t backslash = v ^ (Ones * '\\');
+            uint64_t found = (((quote - Ones) & ~quote) | ((backslash - Ones) & ~backslash) | ((v - Ones * 0x20) & ~v)) & Highs;
+            if (found) {
+                return p + (std::countr_zero(found) >> 3);
+            }
+            p += 8;
+        }
+    }
+
+    while (p < end && *p != '"' && *p != '\\' && uint8_t(*p) >= 0x20) {
+        ++p;
+    }
+    return p;
+}
+
+template <typename Derived>
+const char*
+BasicJSONParser<Derived>::findNumberEnd(const char* p, const char* end)
+{
+    while (p < end) {
+        char c = *p;
+        if ((c < '0' || c > '9') && c != '.' && c != 'e' && c != 'E' && c != '+' && c != '-') {
+            break;
+        }
+        ++p;
+    }
+    return p;
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::isValidNumber(std::string_view s)
+{
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+    size_t i = 0;
+    size_t n = s.size();
+    auto digits = [&]()
+    {
+        size_t start = i;
+        while (i < n && s[i] >= '0' && s[i] <= '9') {
+            ++i;
+        }
+        return i - start;
+    };
+
+    if (i < n && s[i] == '-') {
+        ++i;
+    }
+    if (i < n && s[i] == '0') {
+        ++i;
+    } else if (digits() == 0) {
+        return false;
+    }
+    if (i < n && s[i] == '.') {
+        ++i;
+        if (digits() == 0) {
+            return false;
+        }
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        ++i;
+        if (i < n && (s[i] == '+' || s[i] == '-')) {
+            ++i;
+        }
+        if (digits() == 0) {
+            return false;
+        }
+    }
+    return i == n;
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::startValue(const char*& p)
+{
+    char c = *p++;
+
+    if (_skipNext) {
+        _skipNext = false;
+        _skipping = true;
+        _skipLevel = _stack.size();
+    }
+
+    switch (c) {
+        case '[':
+            _stack.push_back(Stack::Array);
+            _state = State::InArray;
+            if (!_skipping && !derived().handleStartArray()) {
+                return fail("Stopped by handler", p);
+            }
+            break;
+        case '{':
+            _stack.push_back(Stack::Object);
+            _state = State::InObject;
+            if (!_skipping && !derived().handleStartObject()) {
+                return fail("Stopped by handler", p);
+            }
+            break;
+        case '"':
+            _inKey = false;
+            _state = State::InString;
+            _tokenStart = p;
+            break;
+        case 't':
+            _literal = "true";
+            _literalPos = 1;
+            _state = State::InLiteral;
+            break;
+        case 'f':
+            _literal = "false";
+            _literalPos = 1;
+            _state = State::InLiteral;
+            break;
+        case 'n':
+            _literal = "null";
+            _literalPos = 1;
+            _state = State::InLiteral;
+            break;
+        default:
+            if (c != '-' && (c < '0' || c > '9')) {
+                return fail("Unexpected character for value", p - 1);
+            }
+            _state = State::InNumber;
+            _tokenStart = p - 1;
+            break;
+    }
+    return true;
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::endString(const char* p)
+{
+    bool handled = true;
+    if (!_skipping) {
+        std::string_view s = token(p);
+        _valueText = s;
+        handled = _inKey ? derived().handleKey(s) : derived().handleString(s);
+        clearToken();
+    }
+    if (_inKey) {
+        _state = State::EndKey;
+    } else {
+        _state = State::AfterValue;
+        endSkip();
+    }
+    return handled || fail("Stopped by handler", p);
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::endNumber(const char* p)
+{
+    bool handled = true;
+    if (!_skipping) {
+        std::string_view s = token(p);
+        if (!isValidNumber(s)) {
+            return fail("Invalid number", p);
+        }
+        _valueText = s;
+        handled = handleNumber(s);
+        clearToken();
+    }
+    _state = State::AfterValue;
+    endSkip();
+    return handled || fail("Stopped by handler", p);
+}
+
+// Where the first nonzero digit of a checked number is, as a power of ten
+// plus one. So it's positive if the number's magnitude is at least 1
+template <typename Derived>
+int64_t
+BasicJSONParser<Derived>::decimalMagnitude(std::string_view s)
+{
+    size_t i = (s[0] == '-') ? 1 : 0;
+    int64_t magnitude = 0;
+
+    // JSON integer parts have no leading zeros, so one that starts with a
+    // digit other than 0 counts all its digits
+    if (s[i] != '0') {
+        for ( ; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+            magnitude++;
+        }
+    } else {
+        ++i;
+        if (i < s.size() && s[i] == '.') {
+            for (++i; i < s.size() && s[i] == '0'; ++i) {
+                magnitude--;
+            }
+        }
+    }
+
+    size_t e = s.find_first_of("eE", i);
+    if (e != std::string_view::npos) {
+        const char* first = s.data() + e + 1;
+        const char* last = s.data() + s.size();
+        bool negative = *first == '-';
+        if (*first == '+' || *first == '-') {
+            ++first;
+        }
+
+        // An exponent too big for an int64_t is still only big or small
+        int64_t exponent;
+        if (std::from_chars(first, last, exponent).ec != std::errc()) {
+            exponent = INT64_MAX / 2;
+        }
+        magnitude += negative ? -exponent : exponent;
+    }
+    return magnitude;
+}
+
+// The number has been checked, so from_chars can't fail except by being
+// out of range
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::handleNumber(std::string_view s)
+{
+    // A Derived that only wants the text doesn't pay for the conversion
+    if constexpr (std::is_same_v<decltype(&Derived::handleInt), decltype(&BasicJSONParser::handleInt)> &&
+                  std::is_same_v<decltype(&Derived::handleDouble), decltype(&BasicJSONParser::handleDouble)>) {
+        return derived().handleValue(s);
+    }
+
+    const char* first = s.data();
+    const char* last = first + s.size();
+
+    if (s.find_first_of(".eE") == std::string_view::npos) {
+        int64_t i;
+        if (std::from_chars(first, last, i).ec == std::errc()) {
+            return derived().handleInt(i);
+        }
+    }
+
+    double d;
+    if (std::from_chars(first, last, d).ec == std::errc::result_out_of_range) {
+        // Too big is infinity and too small is zero
+        d = (decimalMagnitude(s) > 0) ? std::numeric_limits<double>::infinity() : 0.0;
+        if (s[0] == '-') {
+            d = -d;
+        }
+    }
+    return derived().handleDouble(d);
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::endContainer(Stack type, const char* p)
+{
+    if (_stack.empty() || _stack.back() != type) {
+        return fail((type == Stack::Array) ? "Unexpected end of array encountered" : "Unexpected end of object encountered", p);
+    }
+    _stack.pop_back();
+
+    _state = State::AfterValue;
+    if (_skipping) {
+        endSkip();
+        return true;
+    }
+
+    bool handled = (type == Stack::Array) ? derived().handleEndArray() : derived().handleEndObject();
+    if (_stack.empty()) {
+        handled = derived().handleEndDocument() && handled;
+        _state = State::Done;
+    }
+    return handled || fail("Stopped by handler", p);
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::processEscape(const char* p)
+{
+    char c;
+    switch (*p) {
+        case '"': c = '"'; break;
+        case '\\': c = '\\'; break;
+        case '/': c = '/'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u':
+            _state = State::Unicode;
+            _unicode = 0;
+            _unicodePos = 0;
+            return true;
+        default:
+            return fail("Expected escaped character after backslash", p);
+    }
+    appendChar(c);
+    _state = State::InString;
+    _tokenStart = p + 1;
+    return true;
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::processUnicode(const char* p)
+{
+    char c = *p;
+
+    // After a high surrogate comes the "\u" of the low one
+    if (_state == State::UnicodeSurrogate) {
+        if (c != ((_unicodePos == 0) ? '\\' : 'u')) {
+            return fail("Expected '\\u' following a Unicode high surrogate", p);
+        }
+        if (++_unicodePos == 2) {
+            _state = State::Unicode;
+            _unicode = 0;
+            _unicodePos = 0;
+        }
+        return true;
+    }
+
+    uint32_t digit;
+    if (c >= '0' && c <= '9') {
+        digit = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        digit = c - 'A' + 10;
+    } else {
+        return fail("Expected hex character for escaped Unicode character", p);
+    }
+
+    _unicode = (_unicode << 4) | digit;
+    if (++_unicodePos < 4) {
+        return true;
+    }
+
+    if (_highSurrogate) {
+        if (_unicode < 0xdc00 || _unicode > 0xdfff) {
+            return fail("Expected a Unicode low surrogate", p);
+        }
+        appendCodepoint(0x10000 + ((_highSurrogate - 0xd800) << 10) + (_unicode - 0xdc00));
+        _highSurrogate = 0;
+    } else if (_unicode >= 0xd800 && _unicode <= 0xdbff) {
+        _highSurrogate = _unicode;
+        _state = State::UnicodeSurrogate;
+        _unicodePos = 0;
+        return true;
+    } else if (_unicode >= 0xdc00 && _unicode <= 0xdfff) {
+        return fail("Unexpected Unicode low surrogate", p);
+    } else {
+        appendCodepoint(_unicode);
+    }
+
+    _state = State::InString;
+    _tokenStart = p + 1;
+    return true;
+}
+
+template <typename Derived>
+std::string_view
+BasicJSONParser<Derived>::token(const char* end)
+{
+    if (_tokenSize == 0) {
+        return std::string_view(_tokenStart, end - _tokenStart);
+    }
+    appendToken(_tokenStart, end);
+    return _spilled ? std::string_view(_spill) : std::string_view(_token, _tokenSize);
+}
+
+template <typename Derived>
+void
+BasicJSONParser<Derived>::appendToken(const char* start, const char* end)
+{
+    // A skipped string is scanned but not kept
+    if (_skipping) {
+        return;
+    }
+    size_t size = end - start;
+    if (!_spilled) {
+        if (_tokenSize + size <= InlineTokenSize) {
+            memcpy(_token + _tokenSize, start, size);
+            _tokenSize += size;
+            return;
+        }
+        _spill.assign(_token, _tokenSize);
+        _spilled = true;
+    }
+    _spill.append(start, size);
+    _tokenSize += size;
+}
+
+template <typename Derived>
+void
+BasicJSONParser<Derived>::appendCodepoint(uint32_t codepoint)
+{
+    // UTF-8
+    char s[4];
+    size_t size;
+    if (codepoint < 0x80) {
+        s[0] = char(codepoint);
+        size = 1;
+    } else if (codepoint < 0x800) {
+        s[0] = char(0xc0 | (codepoint >> 6));
+        s[1] = char(0x80 | (codepoint & 0x3f));
+        size = 2;
+    } else if (codepoint < 0x10000) {
+        s[0] = char(0xe0 | (codepoint >> 12));
+        s[1] = char(0x80 | ((codepoint >> 6) & 0x3f));
+        s[2] = char(0x80 | (codepoint & 0x3f));
+        size = 3;
+    } else {
+        s[0] = char(0xf0 | (codepoint >> 18));
+        s[1] = char(0x80 | ((codepoint >> 12) & 0x3f));
+        s[2] = char(0x80 | ((codepoint >> 6) & 0x3f));
+        s[3] = char(0x80 | (codepoint & 0x3f));
+        size = 4;
+    }
+    appendToken(s, s + size);
+}
+
+template <typename Derived>
+bool
+BasicJSONParser<Derived>::fail(const char* error, const char* p)
+{
+    _errorString = error;
+    _currentChar = int(_offset + (p - _chunk) - _lineStart + 1);
+    _state = State::Failed;
+    return false;
+}
+
 }
@@ -28,6 +28,7 @@ All rights reserved.
 #include "esp_littlefs.h"
 #else
 #include <ftw.h>
+#include <sys/stat.h>
 #endif
 
 using namespace fs;
@@ -201,6 +202,16 @@ File::size() const
     return std::filesystem::file_size(_path);
 }
 
+time_t
+File::getLastWrite() const
+{
+    struct stat st;
+    if (!_file || fstat(fileno(_file), &st) != 0) {
+        return 0;
+    }
+    return st.st_mtime;
+}
+
 void
 File::close()
 {
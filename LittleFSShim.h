@@ -62,6 +62,7 @@ class File
     bool seek(uint32_t pos, SeekMode mode = SeekSet);
     size_t position();
     size_t size() const;
+    time_t getLastWrite() const;
     const char* name() const { return _name.c_str(); }
     
     void close();
@@ -22,6 +22,7 @@ static const char* TAG = "LuaManager";
 std::map<uint8_t, std::shared_ptr<LuaManager>> LuaManager::_managers;
 std::bitset<LuaManager::MaxIds> LuaManager::_usedIds;
 std::mutex LuaManager::_mutex;
+LuaManager::WidgetHandlerCB LuaManager::_widgetHandler;
 
 void
 LuaManager::printHandler(lua_State *L)
@@ -29,14 +30,19 @@ LuaManager::printHandler(lua_State *L)
     std::unique_lock<std::mutex> lk(_mutex);
 
     int nargs = lua_gettop(L);
+    std::string line;
     
     for (int i = 1; i <= nargs; i++) {
         const char* s = lua_tostring(L, i);
         if (s) {
             size_t size = strlen(s);
             print(_printCB, s, size);
+            line.append(s, size);
         }
     }
+    
+    // One print is one event, however many args it has
+    EventLog::add(EventLog::Type::Print, line);
 }
 
 LuaManager::LuaManager(PrintCB printCB)
@@ -191,6 +197,16 @@ static int luaGetEvent(lua_State* L)
     return 1;
 }
 
+static int luaSetWidget(lua_State* L)
+{
+    // Lua passes the widget name and its value, which can be a string, number or boolean
+    const char* widget = luaL_checkstring(L, 1);
+    const char* value = luaL_tolstring(L, 2, nullptr);
+    
+    LuaManager::setWidget({ widget, value });
+    return 0;
+}
+
 int8_t
 LuaManager::execute(const std::string& filename, std::vector<std::string> args,
                     int cpl, std::function<void(const char*, size_t)> printCB)
@@ -234,6 +250,8 @@ LuaManager::execute(const std::string& filename, std::vector<std::string> args,
     lua_setglobal(mgr->_luaState, "millis");
     lua_pushcfunction(mgr->_luaState, luaGetEvent);
     lua_setglobal(mgr->_luaState, "getEvent");
+    lua_pushcfunction(mgr->_luaState, luaSetWidget);
+    lua_setglobal(mgr->_luaState, "setWidget");
 
     // Set an 'arg' global with the args
     lua_createtable(mgr->_luaState, int(args.size()), 0);
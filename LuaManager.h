@@ -42,6 +42,12 @@ public:
     static void sendEvent(int8_t id, const Event&);
     static bool getEvent(int8_t id, Event&); // Returns false if no event
     
+    // Lua programs set UI panel widgets with setWidget(widget, value). The
+    // handler passes the change on to the browsers showing the panel
+    using WidgetHandlerCB = std::function<void(const Event&)>;
+    static void setWidgetHandler(WidgetHandlerCB cb) { _widgetHandler = cb; }
+    static void setWidget(const Event& ev) { if (_widgetHandler) _widgetHandler(ev); }
+    
     const char* toString(int idx) const { return lua_tostring(_luaState, idx); }
     
     void printHandler(lua_State *);
@@ -94,6 +100,7 @@ private:
     static std::map<uint8_t, std::shared_ptr<LuaManager>> _managers;
     static std::bitset<MaxIds> _usedIds;
     static std::mutex _mutex;
+    static WidgetHandlerCB _widgetHandler;
     
     int8_t _id;
     Status _status = Status::NotStarted;
@@ -9,26 +9,458 @@ All rights reserved.
 
 #include "MacWebServer.h"
 
+#include<algorithm>
 #include<cassert>
+#include<charconv>
 #include<fstream>
 #include<iostream>
-#include<sstream>
 #include<arpa/inet.h>
+#include<netinet/tcp.h>
 #include<unistd.h>
 #include <thread>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/uio.h>
 
+#if defined __APPLE__
+#include <sys/event.h>
+#include <sys/socket.h>
+#else
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "EventLog.h"
 #include "WebFileSystem.h"
 
 using namespace mil;
 
 static const char *TAG = "MacWebServer";
 
+thread_local WebServer::RequestContext* WebServer::_context = nullptr;
+
+// Server whose event loop is running on this thread, or null
+static thread_local WebServer* serverThreadOwner = nullptr;
+
+static constexpr int MaxEvents = 64;
+static constexpr size_t FileChunkSize = 65536;
+static constexpr size_t MaxSendFileSize = 1024 * 1024;
+static constexpr int ReceiveTimeout = 5000; // ms
+static constexpr int IdleCheckInterval = 500; // ms
+static constexpr size_t MaxDiscardSize = 65536;
+static constexpr size_t MaxChunkedOutput = 65536;
+static constexpr size_t MaxWebSocketMessage = 65536;
+static constexpr size_t MaxWebSocketOutput = 256 * 1024;
+static constexpr int EventStreamInterval = 100; // ms
+static constexpr size_t MaxEventStreamOutput = 65536;
+
+// WebSocket opcodes and close status codes (RFC 6455)
+static constexpr uint8_t OpContinuation = 0x0;
+static constexpr uint8_t OpText = 0x1;
+static constexpr uint8_t OpBinary = 0x2;
+static constexpr uint8_t OpClose = 0x8;
+static constexpr uint8_t OpPing = 0x9;
+static constexpr uint8_t OpPong = 0xa;
+
+static constexpr uint16_t CloseProtocolError = 1002;
+static constexpr uint16_t CloseNoStatus = 1005;
+static constexpr uint16_t CloseTooBig = 1009;
+
+struct WebServer::Connection
+{
+    enum class State { Reading, Processing, Writing, WebSocket, EventStream };
+    
+    Connection(WebServer* server) : context(server, this) { }
+    
+    int fd = -1;
+    State state = State::Reading;
+    bool watched = false;
+    bool failed = false;
+    
+    // Keep-alive and per request state
+    bool keepAlive = false;
+    bool responded = false;
+    uint32_t requestCount = 0;
+    std::chrono::steady_clock::time_point lastActivity = std::chrono::steady_clock::now();
+    
+    HTTPReader input;           // Received but not yet consumed. Limited to the body while handling a request
+    Arena arena;                // For everything in the request, reset when it's done
+    size_t arenaCapacity = 0;   // Amount counted in the server's ArenaStats
+    HTTPParser parser { arena };// Fed by the server thread until the header is complete
+    RequestContext context;
+    std::string header;         // Response header being built, kept to reuse its memory
+    std::string output;         // Queued but not yet written
+    size_t outputOffset = 0;
+    fs::File file;              // Streamed once output is written
+    off_t fileOffset = 0;
+    size_t fileRemaining = 0;
+    bool useSendFile = true;
+    bool corked = false;
+    
+    // Once the connection is upgraded to a WebSocket
+    int32_t webSocket = -1;     // Handler, set by the handshake
+    uint32_t webSocketClient = 0;
+    bool closing = false;       // Close frame is queued, close the connection when it's written
+    bool writeWatched = false;
+    std::string message;        // Payload received so far, kept to reuse its memory
+    uint8_t messageOpcode = 0;  // Text or binary, 0 between messages
+    
+    // Data frame whose payload is being received
+    bool inFrame = false;
+    bool frameFin = false;
+    uint64_t frameRemaining = 0;
+    uint8_t frameMask[4] = { };
+    uint8_t maskIndex = 0;
+    
+    // Once the connection is serving an event stream
+    bool eventStream = false;   // Set when the response header is sent
+    std::unique_ptr<EventLog::Reader> events;
+};
+
+WebServer::RequestContext::RequestContext(WebServer* s, Connection* c)
+    : server(s)
+    , conn(c)
+    , parser(c->parser)
+{
+}
+
+void
+WebServer::RequestContext::reset()
+{
+    responseHeaders.clear();
+    match = RouteTable::Match();
+    requestPath = std::string_view();
+    limit = nullptr;
+    chunked = false;
+}
+
+void
+WebServer::RequestContext::setHeader(std::string_view name, std::string_view value)
+{
+    value = conn->arena.copy(value);
+    for (auto& it : responseHeaders) {
+        if (it.name.size() == name.size() && strncasecmp(it.name.data(), name.data(), name.size()) == 0) {
+            it.value = value;
+            return;
+        }
+    }
+    responseHeaders.push_back({ conn->arena.copy(name), value });
+}
+
+// Send size bytes of fileFD starting at offset to the socket without copying
+// them through user space. Returns the number of bytes sent or -1 with errno set
+static ssize_t sendFile(int fd, int fileFD, off_t offset, size_t size)
+{
+#if defined __APPLE__
+    off_t length = size;
+    if (sendfile(fileFD, fd, offset, &length, nullptr, 0) < 0) {
+        // On EAGAIN length is the amount that was sent before the socket filled
+        if (errno != EAGAIN || length == 0) {
+            return -1;
+        }
+    }
+    return length;
+#else
+    return sendfile(fd, fileFD, &offset, size);
+#endif
+}
+
+// Sockets have TCP_NODELAY set, so every write goes out right away. A
+// response is written with as few writes as possible to keep from sending
+// lots of small packets. When a file is streamed after the header the
+// socket is corked until the file is done, so the header shares a packet
+// with the start of the file.
+static void setCork(int fd, bool cork)
+{
+    int value = cork ? 1 : 0;
+#if defined __APPLE__
+    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value));
+#else
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#endif
+}
+
+static bool equalsIgnoreCase(std::string_view a, const char* b)
+{
+    return a.size() == strlen(b) && strncasecmp(a.data(), b, a.size()) == 0;
+}
+
+// True if the comma separated list of tokens has token in it
+static bool hasToken(std::string_view list, const char* token)
+{
+    while (!list.empty()) {
+        size_t end = list.find(',');
+        std::string_view item = list.substr(0, end);
+        list = (end == std::string_view::npos) ? std::string_view() : list.substr(end + 1);
+        
+        while (!item.empty() && item.front() == ' ') {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && item.back() == ' ') {
+            item.remove_suffix(1);
+        }
+        if (equalsIgnoreCase(item, token)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// SHA-1 (RFC 3174), only used to answer the WebSocket handshake
+static void sha1(std::string_view data, uint8_t digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    
+    auto rotate = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    
+    // The message is padded with 0x80, zeros and its length in bits to a multiple of 64 bytes
+    uint64_t bits = uint64_t(data.size()) * 8;
+    size_t total = ((data.size() + 8) / 64 + 1) * 64;
+    
+    for (size_t offset = 0; offset < total; offset += 64) {
+        uint8_t block[64];
+        for (size_t i = 0; i < 64; ++i) {
+            size_t pos = offset + i;
+            if (pos < data.size()) {
+                block[i] = uint8_t(data[pos]);
+            } else if (pos == data.size()) {
+                block[i] = 0x80;
+            } else if (pos >= total - 8) {
+                block[i] = uint8_t(bits >> ((total - 1 - pos) * 8));
+            } else {
+                block[i] = 0;
+            }
+        }
+        
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = uint32_t(block[i * 4]) << 24 | uint32_t(block[i * 4 + 1]) << 16 | uint32_t(block[i * 4 + 2]) << 8 | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t temp = rotate(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotate(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    
+    for (int i = 0; i < 20; ++i) {
+        digest[i] = uint8_t(h[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+static void appendBase64(std::string& s, const uint8_t* data, size_t size)
+{
+    static const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t n = uint32_t(data[i]) << 16;
+        if (i + 1 < size) {
+            n |= uint32_t(data[i + 1]) << 8;
+        }
+        if (i + 2 < size) {
+            n |= data[i + 2];
+        }
+        s += chars[(n >> 18) & 0x3f];
+        s += chars[(n >> 12) & 0x3f];
+        s += (i + 1 < size) ? chars[(n >> 6) & 0x3f] : '=';
+        s += (i + 2 < size) ? chars[n & 0x3f] : '=';
+    }
+}
+
+// Server frames are never masked
+static void appendWebSocketFrame(std::string& s, uint8_t opcode, std::string_view payload)
+{
+    s += char(0x80 | opcode);
+    if (payload.size() < 126) {
+        s += char(payload.size());
+    } else if (payload.size() <= 0xffff) {
+        s += char(126);
+        s += char(payload.size() >> 8);
+        s += char(payload.size());
+    } else {
+        s += char(127);
+        for (int i = 7; i >= 0; --i) {
+            s += char(uint64_t(payload.size()) >> (i * 8));
+        }
+    }
+    s += payload;
+}
+
+struct WebSocketFrameHeader
+{
+    bool fin;
+    bool reserved;  // Any of the RSV bits, we don't support extensions
+    bool masked;
+    uint8_t opcode;
+    uint8_t mask[4];
+    uint64_t length;
+};
+
+static constexpr size_t InvalidFrameHeader = SIZE_MAX;
+
+// Returns the size of the frame header at the start of data, or 0 if it
+// isn't all there yet. Returns InvalidFrameHeader if a 64 bit length has
+// its top bit set, which RFC 6455 doesn't allow
+static size_t parseWebSocketFrameHeader(std::string_view data, WebSocketFrameHeader& header)
+{
+    if (data.size() < 2) {
+        return 0;
+    }
+    
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    header.fin = p[0] & 0x80;
+    header.reserved = p[0] & 0x70;
+    header.opcode = p[0] & 0x0f;
+    header.masked = p[1] & 0x80;
+    header.length = p[1] & 0x7f;
+    
+    size_t size = 2;
+    size_t lengthBytes = (header.length == 126) ? 2 : (header.length == 127) ? 8 : 0;
+    if (data.size() < size + lengthBytes + (header.masked ? 4 : 0)) {
+        return 0;
+    }
+    
+    if (lengthBytes) {
+        header.length = 0;
+        for (size_t i = 0; i < lengthBytes; ++i) {
+            header.length = (header.length << 8) | p[size++];
+        }
+        if (header.length >> 63) {
+            return InvalidFrameHeader;
+        }
+    }
+    if (header.masked) {
+        memcpy(header.mask, p + size, 4);
+        size += 4;
+    }
+    return size;
+}
+
+// Client payloads are XORed with the frame's mask. index is where in the
+// mask the next byte is, since a payload can arrive in pieces
+static void unmask(char* data, size_t size, const uint8_t mask[4], uint8_t& index)
+{
+    for (size_t i = 0; i < size; ++i) {
+        data[i] ^= mask[index];
+        index = (index + 1) & 3;
+    }
+}
+
+static void appendNumber(std::string& s, size_t value)
+{
+    char buf[24];
+    auto result = std::to_chars(buf, buf + sizeof(buf), value);
+    s.append(buf, result.ptr - buf);
+}
+
+static void appendHeader(std::string& s, std::string_view name, std::string_view value)
+{
+    s += name;
+    s += ": ";
+    s += value;
+    s += "\r\n";
+}
+
+static bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+// Set the readiness events to watch for on fd. Passing neither read nor write stops
+// watching it, which keeps epoll from reporting hangups while a request is in process()
+static bool watchFD(int pollFD, int fd, bool read, bool write, bool add)
+{
+#if defined __APPLE__
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD | (read ? EV_ENABLE : EV_DISABLE), 0, 0, nullptr);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | (write ? EV_ENABLE : EV_DISABLE), 0, 0, nullptr);
+    return kevent(pollFD, changes, 2, nullptr, 0, nullptr) == 0;
+#else
+    if (!read && !write) {
+        return epoll_ctl(pollFD, EPOLL_CTL_DEL, fd, nullptr) == 0;
+    }
+    struct epoll_event event = { };
+    event.events = (read ? uint32_t(EPOLLIN) : 0) | (write ? uint32_t(EPOLLOUT) : 0);
+    event.data.fd = fd;
+    return epoll_ctl(pollFD, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) == 0;
+#endif
+}
+
+struct ReadyEvent
+{
+    int fd;
+    bool readable;
+    bool writable;
+};
+
+static int waitForEvents(int pollFD, ReadyEvent* ready, int maxEvents, int timeoutMs)
+{
+#if defined __APPLE__
+    struct kevent events[MaxEvents];
+    struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000 };
+    int n = kevent(pollFD, nullptr, 0, events, std::min(maxEvents, MaxEvents), (timeoutMs < 0) ? nullptr : &timeout);
+    for (int i = 0; i < n; ++i) {
+        ready[i].fd = int(events[i].ident);
+        
+        // EOF and errors come back on the filter itself, so the next read or write reports them
+        ready[i].readable = events[i].filter == EVFILT_READ;
+        ready[i].writable = events[i].filter == EVFILT_WRITE;
+    }
+#else
+    struct epoll_event events[MaxEvents];
+    int n = epoll_wait(pollFD, events, std::min(maxEvents, MaxEvents), timeoutMs);
+    for (int i = 0; i < n; ++i) {
+        ready[i].fd = events[i].data.fd;
+        
+        // Treat hangups and errors as readable or writable so the next read or write reports them
+        bool hangup = events[i].events & (EPOLLHUP | EPOLLERR);
+        ready[i].readable = (events[i].events & EPOLLIN) || hangup;
+        ready[i].writable = (events[i].events & EPOLLOUT) || hangup;
+    }
+#endif
+    return n;
+}
+
 int
 WebServer::start(WebFileSystem* wfs, int port)
 {
     _wfs = wfs;
     
+    // A client closing an event stream or WebSocket while we write to it
+    // would otherwise kill the process. With SIGPIPE ignored the write
+    // fails with EPIPE and the connection is closed like any other error
+    signal(SIGPIPE, SIG_IGN);
+    
     int fdServer = socket(AF_INET, SOCK_STREAM, 0);
     if (fdServer < 0) {
         printf("Failed to create server socket.\n");
@@ -53,18 +485,39 @@ WebServer::start(WebFileSystem* wfs, int port)
         return -1;
     }
 
-    if (fcntl(fdServer, F_SETFL, O_NONBLOCK) < 0) {
+    if (!setNonBlocking(fdServer)) {
         perror("Failed to set server socket to non-blocking");
         close(fdServer);
         return -1;
     }
 
     //listens on socket.
-    if (listen(fdServer, 5) < 0) {
+    if (listen(fdServer, SOMAXCONN) < 0) {
         printf("Failed to listen on server socket.\n");
         return -1;
     }
     
+    // Create the event queue and the pipe process() uses to wake the server thread
+#if defined __APPLE__
+    _pollFD = kqueue();
+#else
+    _pollFD = epoll_create1(0);
+#endif
+    if (_pollFD < 0) {
+        perror("Failed to create event queue");
+        close(fdServer);
+        return -1;
+    }
+    
+    if (pipe(_wakeFD) < 0 || !setNonBlocking(_wakeFD[0]) || !setNonBlocking(_wakeFD[1])) {
+        perror("Failed to create wake pipe");
+        close(fdServer);
+        return -1;
+    }
+    
+    watchFD(_pollFD, fdServer, true, false, true);
+    watchFD(_pollFD, _wakeFD[0], true, false, true);
+    
     printf("Server started on port : %d\n", port);
 
     std::thread serverThread([this, fdServer]() { handleServer(fdServer); });
@@ -73,14 +526,173 @@ WebServer::start(WebFileSystem* wfs, int port)
     return fdServer;
 }
 
+void
+RouteTable::add(std::string_view route, WiFiPortal::HTTPMethod method, Type type, int32_t handler)
+{
+    // "/" is the root node and a trailing '/' doesn't matter for a Prefix route
+    if (route == "/" || (type == Type::Prefix && route.size() > 1 && route.back() == '/')) {
+        route.remove_suffix(1);
+    }
+    
+    Node* node = &_root;
+    while (!route.empty()) {
+        size_t start = (route[0] == '/') ? 1 : 0;
+        size_t end = route.find('/', start);
+        if (end == std::string_view::npos) {
+            end = route.size();
+        }
+        std::string_view segment = route.substr(start, end - start);
+        route.remove_prefix(end);
+        
+        if (segment == "*") {
+            if (!node->wildcard) {
+                node->wildcard = std::make_unique<Node>(segment);
+            }
+            node = node->wildcard.get();
+            continue;
+        }
+        
+        auto it = std::lower_bound(node->children.begin(), node->children.end(), segment, SegmentLess());
+        if (it == node->children.end() || (*it)->segment != segment) {
+            it = node->children.insert(it, std::make_unique<Node>(segment));
+        }
+        node = it->get();
+    }
+    
+    int32_t* handlers = (type == Type::Exact) ? node->exact : node->prefix;
+    if (handlers[size_t(method)] < 0) {
+        handlers[size_t(method)] = handler;
+    }
+}
+
+RouteTable::Match
+RouteTable::find(std::string_view path, std::string_view method) const
+{
+    // Same order as WiFiPortal::HTTPMethod
+    static constexpr std::string_view methods[MethodCount] = { "GET", "POST", "PUT" };
+    
+    size_t index = MethodCount;
+    for (size_t i = 0; i < MethodCount; ++i) {
+        if (method == methods[i]) {
+            index = i;
+            break;
+        }
+    }
+    
+    Match match;
+    if (path == "/") {
+        path = "";
+    }
+    if (path.empty() || path[0] == '/') {
+        find(&_root, path, index, match);
+    }
+    return match;
+}
+
+// Record the methods in handlers and set the handler if there's one for method
+static bool matchMethod(const int32_t* handlers, size_t count, size_t method, RouteTable::Match& match)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (handlers[i] >= 0) {
+            match.allowed |= 1 << i;
+        }
+    }
+    if (method < count && handlers[method] >= 0) {
+        match.handler = handlers[method];
+        return true;
+    }
+    return false;
+}
+
+bool
+RouteTable::find(const Node* node, std::string_view rest, size_t method, Match& match)
+{
+    if (rest.empty()) {
+        if (matchMethod(node->exact, MethodCount, method, match)) {
+            return true;
+        }
+    } else {
+        size_t end = rest.find('/', 1);
+        if (end == std::string_view::npos) {
+            end = rest.size();
+        }
+        std::string_view segment = rest.substr(1, end - 1);
+        std::string_view next = rest.substr(end);
+        
+        auto it = std::lower_bound(node->children.begin(), node->children.end(), segment, SegmentLess());
+        if (it != node->children.end() && (*it)->segment == segment && find(it->get(), next, method, match)) {
+            return true;
+        }
+        if (node->wildcard && find(node->wildcard.get(), next, method, match)) {
+            return true;
+        }
+    }
+    
+    if (matchMethod(node->prefix, MethodCount, method, match)) {
+        match.tail = rest;
+        return true;
+    }
+    return false;
+}
+
+std::string
+RouteTable::allowHeader(uint8_t allowed)
+{
+    static const char* methods[MethodCount] = { "GET", "POST", "PUT" };
+    
+    std::string s;
+    for (size_t i = 0; i < MethodCount; ++i) {
+        if (allowed & (1 << i)) {
+            if (!s.empty()) {
+                s += ", ";
+            }
+            s += methods[i];
+        }
+    }
+    return s;
+}
+
+WebServer::WebServer()
+{
+}
+
+WebServer::~WebServer()
+{
+    stopWorkers();
+    stop();
+}
+
 void
 WebServer::process()
 {
-    // Handle one client at a time so we don't overload
-    if (!_clientsToProcess.empty()) {
-        handleClient(_clientsToProcess[0]);
-        _clientsToProcess.erase(_clientsToProcess.begin());
+    // Handle all the clients that have a complete request header. The lists
+    // are swapped and cleared so neither allocates once it has grown
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _processing.swap(_clientsToProcess);
+    }
+    
+    for (Connection* conn : _processing) {
+        RequestContext& context = conn->context;
+        _context = &context;
+        
+        if (parseRequest(context)) {
+            if (_workers.empty() || context.match.handler < 0) {
+                handleRequest(context);
+            } else if (queueRequest(context)) {
+                // A worker handles and finishes it
+                _context = nullptr;
+                continue;
+            } else {
+                context.setHeader("Retry-After", "1");
+                sendHTTPResponse(context, 503, "text/plain", "Service Unavailable");
+            }
+        }
+        
+        finishRequest(context);
+        _context = nullptr;
     }
+    _processing.clear();
 }
 
 static const char* responseCodeToString(int code)
@@ -120,6 +732,8 @@ static const char* responseCodeToString(int code)
         case 415: return "Unsupported Media Type";
         case 416: return "Requested range not satisfiable";
         case 417: return "Expectation Failed";
+        case 426: return "Upgrade Required";
+        case 431: return "Request Header Fields Too Large";
         case 500: return "Internal Server Error";
         case 501: return "Not Implemented";
         case 502: return "Bad Gateway";
@@ -130,199 +744,1295 @@ static const char* responseCodeToString(int code)
     }
 }
 
-std::string
-WebServer::buildHTTPHeader(int statuscode, size_t contentLength, const char* mimetype, const HTTPParser::ArgMap& extraHeaders)
+const std::string&
+WebServer::buildHTTPHeader(RequestContext& context, int statuscode, size_t contentLength, const char* mimetype)
 {
-    std::ostringstream buffer;
-    buffer << "HTTP/1.1 " << statuscode << " " << responseCodeToString(statuscode) << "\r\n";
-    buffer << "content-type" << ": " << (mimetype ?: "text/plain") << "\r\n";
-    buffer << "content-length" << ": " << std::to_string(contentLength) << "\r\n";
+    std::string& buffer = context.conn->header;
+    buffer.clear();
+    
+    buffer += "HTTP/1.1 ";
+    appendNumber(buffer, statuscode);
+    buffer += " ";
+    buffer += responseCodeToString(statuscode);
+    buffer += "\r\n";
+    
+    // A 304 has no body. Its headers describe the cached copy. A 101 has no
+    // body either, after it the connection speaks the new protocol
+    if (statuscode != 304 && statuscode != 101) {
+        appendHeader(buffer, "content-type", mimetype ?: "text/plain");
+        if (contentLength != UnknownLength) {
+            buffer += "content-length: ";
+            appendNumber(buffer, contentLength);
+            buffer += "\r\n";
+        } else if (context.chunked) {
+            buffer += "transfer-encoding: chunked\r\n";
+        }
+    }
+    
+    if (statuscode == 101) {
+        // The handshake sets the Connection header
+    } else if (context.conn->keepAlive) {
+        buffer += "connection: keep-alive\r\nkeep-alive: timeout=";
+        appendNumber(buffer, _keepAliveTimeout / 1000);
+        buffer += ", max=";
+        appendNumber(buffer, _keepAliveMaxRequests - context.conn->requestCount);
+        buffer += "\r\n";
+    } else {
+        buffer += "connection: close\r\n";
+    }
     
-    for (const auto& it : extraHeaders) {
-        buffer << it.first << ": " << it.second << "\r\n";
+    if (statuscode == 200 || statuscode == 206 || statuscode == 304) {
+        const std::string& cacheControl = HTTPParser::cacheControl(_cacheControl, context.requestPath);
+        if (!cacheControl.empty()) {
+            appendHeader(buffer, "cache-control", cacheControl);
+        }
+    }
+    
+    for (const auto& it : context.responseHeaders) {
+        appendHeader(buffer, it.name, it.value);
     }
+    context.responseHeaders.clear();
     
-    buffer << "\r\n";
-    return buffer.str();
+    buffer += "\r\n";
+    return buffer;
 }
 
 void
-WebServer::sendHTTPResponse(int code, const char* mimetype, const char* data, const HTTPParser::ArgMap& extraHeaders)
+WebServer::sendHTTPResponse(RequestContext& context, int code, const char* mimetype, const char* data)
 {
-    if (code != 200) {
+    if (code >= 400) {
         printf("Error Response code (%d): %s\n", code, responseCodeToString(code));
     }
     
-    std::string body(data);
-    std::string response = buildHTTPHeader(code, body.size(), mimetype, extraHeaders);
-    response += body;
-    write(_fdClient, response.c_str(), response.length());
+    size_t length = strlen(data);
+    const std::string& header = buildHTTPHeader(context, code, length, mimetype);
+    send(context, header.data(), header.size(), data, length);
 }
 
 void
-WebServer::sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip, const HTTPParser::ArgMap& extraHeaders)
+WebServer::sendHTTPResponse(RequestContext& context, int code, const char* mimetype, const char* data, size_t length, bool gzip)
 {
-    HTTPParser::ArgMap headers = extraHeaders;
-    
     if (gzip) {
-        headers["Content-Encoding"] = "gzip";
+        context.setHeader("Content-Encoding", "gzip");
     }
-
-    std::string response = buildHTTPHeader(code, length, mimetype, headers);
-    write(_fdClient, response.c_str(), response.length());    
-    write(_fdClient, data, length);    
+    
+    const std::string& header = buildHTTPHeader(context, code, length, mimetype);
+    send(context, header.data(), header.size(), data, length);
 }
 
 void
-WebServer::streamHTTPResponse(fs::File& file, const char* mimetype, bool attach, const HTTPParser::ArgMap& extraHeaders)
+WebServer::streamHTTPResponse(RequestContext& context, fs::File& file, const char* mimetype, bool attach)
 {
-    HTTPParser::ArgMap headers = extraHeaders;
-
     // For now assume this is a file download. So set Content-Disposition
     std::string disp = attach ? "attachment" : "inline";
     disp += "; filename=\"";
     disp += file.name();
     disp += "\"";
     
-    headers["Content-Disposition"] = disp;
-
-    std::string response = buildHTTPHeader(200, file.size(), mimetype, headers);
-    write(_fdClient, response.c_str(), response.length());
+    context.setHeader("Content-Disposition", disp);
+    context.setHeader("Accept-Ranges", "bytes");
     
-    while (true) {
-        uint8_t buf[1024];
-        int size = file.read(buf, 1024);
-        if (size < 0) {
-            printf("**** Error reading file\n");
-            if (_parser) {
-                _parser->setErrorResponse(404, "Error reading file");
-            }
-            break;
-        }
+    size_t size = file.size();
+    
+    // Validators come from the file's size and modification time
+    std::string etag;
+    time_t lastWrite = file.getLastWrite();
+    if (lastWrite) {
+        etag = HTTPParser::makeETag(size, lastWrite);
+        std::string lastModified = HTTPParser::httpDate(lastWrite);
+        context.setHeader("ETag", etag);
+        context.setHeader("Last-Modified", lastModified);
         
-        write(_fdClient, buf, size);
-        if (size < 1024) {
-            break;
+        if (HTTPParser::notModified(context.header("If-None-Match"), context.header("If-Modified-Since"), etag, lastModified)) {
+            sendHTTPResponse(context, 304, mimetype, "");
+            return;
+        }
+    }
+    
+    // Send the whole file unless a single satisfiable range was asked for
+    int code = 200;
+    size_t start = 0;
+    size_t length = size;
+    
+    std::string range = context.header("Range");
+    if (!range.empty() && HTTPParser::ifRangeMatches(context.header("If-Range"), etag)) {
+        switch (HTTPParser::parseRange(range, size, start, length)) {
+            case HTTPParser::RangeStatus::None:
+                break;
+            case HTTPParser::RangeStatus::Partial:
+                code = 206;
+                context.setHeader("Content-Range", HTTPParser::contentRange(start, length, size));
+                break;
+            case HTTPParser::RangeStatus::Unsatisfiable:
+                context.setHeader("Content-Range", HTTPParser::contentRange(0, 0, size));
+                sendHTTPResponse(context, 416, "text/plain", "");
+                return;
         }
     }
+
+    // Hold the header until the file data can go with it
+    Connection* conn = context.conn;
+    if (length && file.isFile() && !conn->failed) {
+        setCork(conn->fd, true);
+        conn->corked = true;
+    }
+    
+    const std::string& header = buildHTTPHeader(context, code, length, mimetype);
+    send(context, header.data(), header.size());
+    
+    // The server thread streams the file contents as the socket becomes writable.
+    // The caller's file is left closed.
+    conn->fileOffset = start;
+    conn->fileRemaining = length;
+    conn->useSendFile = true;
+    conn->file = std::move(file);
 }
 
 void
-WebServer::sendStaticFile(const char* filename, const char* path)
+WebServer::beginChunked(RequestContext& context, int code, const char* mimetype)
 {
-    std::string f(path);
-    f += filename;
-    
-    if (!_wfs || !_wfs->exists(f.c_str())) {
-       if (_parser) {
-            _parser->setErrorResponse(404, "File not found");
-            sendHTTPResponse(404, "text/plain", "File not found");
-        }
-    } else {
-        fs::File file = _wfs->open(f.c_str(), "r");
-        streamHTTPResponse(file, HTTPParser::suffixToMimeType(f).c_str(), false);
-        file.close();
+    context.chunked = context.parser.version() == "HTTP/1.1";
+    if (!context.chunked) {
+        context.conn->keepAlive = false;
     }
+    
+    const std::string& header = buildHTTPHeader(context, code, UnknownLength, mimetype);
+    send(context, header.data(), header.size());
 }
 
 void
-WebServer::handleClient(int fdClient)
+WebServer::sendChunk(RequestContext& context, const char* data, size_t length)
 {
-    // Set the member variable, only valid for the duration of this call
-    _fdClient = fdClient;
-
-    if (_parser) {
-        System::logW(TAG, "***** Already in the middle of a request\n");
-        _parser.reset();
+    Connection* conn = context.conn;
+    if (conn->failed) {
         return;
     }
     
-    _parser = std::make_unique<HTTPParser>();
-    
-    _parser->parseRequest([fdClient](uint8_t* buf, size_t size) -> ssize_t {
-        return read(fdClient, buf, size);
-    });
-    
-    bool isUpload = _parser->method() == "POST";
-    std::string filePath = _parser->path();
+    if (context.chunked) {
+        // Put the size line, data and trailing CRLF together so they go out in one write
+        char size[20];
+        snprintf(size, sizeof(size), "%zx\r\n", length);
+        conn->output += size;
+        if (length) {
+            conn->output.append(data, length);
+        }
+        conn->output += "\r\n";
+        if (length == 0) {
+            context.chunked = false;
+        }
+        send(context, "", 0);
+    } else if (length) {
+        send(context, data, length);
+    }
     
-    // Go through all the handlers
-    if (filePath[0] != '/') {
-        filePath = "/" + filePath;
+    // The server thread isn't watching the socket while the handler runs,
+    // so wait here rather than let a slow client make the output grow
+    while (!conn->failed && conn->output.size() - conn->outputOffset > MaxChunkedOutput) {
+        struct pollfd pfd = { conn->fd, POLLOUT, 0 };
+        if (poll(&pfd, 1, ReceiveTimeout) <= 0 || flush(conn, false) < 0) {
+            conn->failed = true;
+        }
+    }
+}
+
+void
+WebServer::send(RequestContext& context, const char* data, size_t length, const char* data2, size_t length2)
+{
+    Connection* conn = context.conn;
+    if (conn->failed) {
+        return;
     }
     
-    std::string endpointTail;
+    conn->responded = true;
     
-    for (const auto& it : _handlers) {
-        if (it.type == HTTPHandler::EndpointType::Static || it.type == HTTPHandler::EndpointType::Wildcard) {
-             // Match the front of the filePath with it.endpoint
-            if (it.endpoint == filePath.substr(0, it.endpoint.length())) {
-                endpointTail = filePath.substr(it.endpoint.length()).c_str();
-            } else {
-                continue;
+    // If nothing is waiting to go out, write both buffers straight from
+    // where they are with one call and only queue what doesn't fit
+    size_t written = 0;
+    if (conn->outputOffset == conn->output.size()) {
+        struct iovec iov[2] = { { const_cast<char*>(data), length }, { const_cast<char*>(data2), length2 } };
+        ssize_t size = writev(conn->fd, iov, length2 ? 2 : 1);
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->failed = true;
+                return;
             }
-        } else if (it.endpoint != filePath) {
-            continue;
+            size = 0;
+        }
+        written = size;
+    }
+    
+    if (written < length) {
+        conn->output.append(data + written, length - written);
+        written = 0;
+    } else {
+        written -= length;
+    }
+    if (written < length2) {
+        conn->output.append(data2 + written, length2 - written);
+    }
+    
+    if (flush(conn, false) < 0) {
+        conn->failed = true;
+    }
+}
+
+int
+WebServer::flush(Connection* conn, bool streamFile)
+{
+    while (true) {
+        while (conn->outputOffset < conn->output.size()) {
+            ssize_t size = write(conn->fd, conn->output.data() + conn->outputOffset, conn->output.size() - conn->outputOffset);
+            if (size < 0) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            conn->outputOffset += size;
         }
         
-        if (it.type == HTTPHandler::EndpointType::Static) {
-            sendStaticFile(endpointTail.c_str(), it.path.c_str());
-        } else {
-            if (isUpload) {
-                std::string contentType = _parser->getHTTPHeader("Content-Type");
-                if (contentType.empty()) {
-                    _parser->setErrorResponse(501, "no Content-Type");
-                } else {
-                    std::vector<std::string> multipart = HTTPParser::parseFormData(contentType);
-                    if (multipart[0] != "multipart/form-data" || multipart[1] != "boundary") {
-                        // This is not a multipart, Handle it normally
-                        if (it.requestCB) {
-                            it.requestCB();
-                        }
-                    } else {
-                        std::string lengthString = _parser->getHTTPHeader("Content-Length");
-                        size_t contentLength = std::stoi(lengthString);
-                        _parser->parseMultipart(contentLength, multipart[2], it.requestCB, [fdClient](uint8_t* buf, size_t size) -> ssize_t
-                        {
-                            return read(fdClient, buf, size);
-                        });
-                    }
+        conn->output.clear();
+        conn->outputOffset = 0;
+
+        if (!streamFile || !conn->file.isFile()) {
+            return 1;
+        }
+        
+        if (conn->fileRemaining == 0) {
+            conn->file.close();
+            if (conn->corked) {
+                setCork(conn->fd, false);
+                conn->corked = false;
+            }
+            return 1;
+        }
+        
+        int fileFD = fileno(conn->file.rawFile());
+        
+        if (conn->useSendFile) {
+            // Have the kernel send straight from the page cache
+            ssize_t size = sendFile(conn->fd, fileFD, conn->fileOffset, std::min(conn->fileRemaining, MaxSendFileSize));
+            if (size < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
                 }
-                if (_parser->errorCode()) {
-                    sendHTTPResponse(_parser->errorCode(), "text/plain", _parser->errorReason().c_str());
-                    System::logE(TAG, "HTTP parser error (%d):%s", _parser->errorCode(), _parser->errorReason().c_str());
+                if (errno != EINVAL && errno != ENOSYS && errno != ENOTSUP) {
+                    return -1;
                 }
-            } else {
+                
+                // Not supported for this file. Copy it instead
+                conn->useSendFile = false;
+                continue;
+            }
+            if (size == 0) {
+                // The file got shorter than the content-length we sent
+                printf("**** Error reading file\n");
+                return -1;
+            }
+            conn->fileOffset += size;
+            conn->fileRemaining -= size;
+            continue;
+        }
+        
+        // Refill the output from the file
+        conn->output.resize(std::min(conn->fileRemaining, FileChunkSize));
+        ssize_t size = pread(fileFD, conn->output.data(), conn->output.size(), conn->fileOffset);
+        if (size <= 0) {
+            printf("**** Error reading file\n");
+            return -1;
+        }
+        conn->output.resize(size);
+        conn->fileOffset += size;
+        conn->fileRemaining -= size;
+    }
+}
+
+ssize_t
+WebServer::receive(int fd, uint8_t* buf, size_t size)
+{
+    // The socket is non-blocking for the event loop, so wait for more data here
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, ReceiveTimeout);
+    if (ready <= 0) {
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+        }
+        return -1;
+    }
+    return read(fd, buf, size);
+}
+
+void
+WebServer::discardBody(Connection* conn)
+{
+    if (conn->input.limit() > MaxDiscardSize) {
+        conn->keepAlive = false;
+        return;
+    }
+    
+    while (conn->input.limit() > 0) {
+        if (conn->input.read(conn->input.limit()).empty()) {
+            conn->keepAlive = false;
+            return;
+        }
+    }
+}
+
+int
+WebServer::receiveHTTPResponse(RequestContext& context, char* buf, size_t size)
+{
+    // Part of the body may already be buffered, so keep reading until we have it all
+    size_t total = 0;
+    while (total < size) {
+        std::string_view data = context.conn->input.read(size - total);
+        if (data.empty()) {
+            return total ? int(total) : -1;
+        }
+        memcpy(buf + total, data.data(), data.size());
+        total += data.size();
+    }
+    return int(total);
+}
+
+void
+WebServer::sendStaticFile(RequestContext& context, const char* filename, const char* path)
+{
+    std::string f(path);
+    f += filename;
+    
+    // If there's a precompressed sibling and the client takes gzip, send
+    // that instead. The mime type still comes from the uncompressed name
+    std::string gz = f + ".gz";
+    bool hasGzip = _wfs && _wfs->exists(gz.c_str());
+    const char* mimetype = HTTPParser::suffixToMimeType(f);
+    
+    if (hasGzip) {
+        context.setHeader("Vary", "Accept-Encoding");
+        if (HTTPParser::acceptsGzip(context.header("Accept-Encoding"))) {
+            context.setHeader("Content-Encoding", "gzip");
+            f = gz;
+        }
+    }
+    
+    if (!_wfs || !_wfs->exists(f.c_str())) {
+        context.parser.setErrorResponse(404, "File not found");
+        sendHTTPResponse(context, 404, "text/plain", "File not found");
+    } else if (std::shared_ptr<const FileCache::Entry> entry = context.header("Range").empty() ? _wfs->getCachedFile(f.c_str()) : nullptr) {
+        // Small files come from the cache. Ranges are only handled when streaming
+        context.setHeader("ETag", entry->etag);
+        if (!entry->lastModified.empty()) {
+            context.setHeader("Last-Modified", entry->lastModified);
+        }
+        if (HTTPParser::notModified(context.header("If-None-Match"), context.header("If-Modified-Since"), entry->etag, entry->lastModified)) {
+            sendHTTPResponse(context, 304, mimetype, "");
+        } else {
+            sendHTTPResponse(context, 200, mimetype, entry->data.data(), entry->data.size(), false);
+        }
+    } else {
+        fs::File file = _wfs->open(f.c_str(), "r");
+        streamHTTPResponse(context, file, mimetype, false);
+        file.close();
+    }
+}
+
+bool
+WebServer::parseRequest(RequestContext& context)
+{
+    Connection* conn = context.conn;
+    HTTPParser& parser = context.parser;
+    
+    conn->responded = false;
+    conn->requestCount++;
+
+    // The server thread has already parsed the header
+    if (parser.status() != HTTPParser::ParseStatus::Complete) {
+        conn->keepAlive = false;
+        if (parser.errorCode()) {
+            sendHTTPResponse(context, parser.errorCode(), "text/plain", parser.errorReason().c_str());
+        }
+        return false;
+    }
+    
+    // HTTP/1.1 connections persist unless the client says otherwise, HTTP/1.0
+    // connections only persist if the client asks. We can't find the end of a
+    // chunked request body so those connections are closed.
+    std::string_view connection = parser.getHTTPHeader("Connection");
+    bool isHTTP11 = parser.version() == "HTTP/1.1";
+    conn->keepAlive = (isHTTP11 ? !equalsIgnoreCase(connection, "close") : equalsIgnoreCase(connection, "keep-alive"))
+                      && parser.getHTTPHeader("Transfer-Encoding").empty()
+                      && conn->requestCount < _keepAliveMaxRequests;
+    
+    // Never read past the body, anything after it is the next pipelined request
+    size_t contentLength = 0;
+    std::string_view lengthString = parser.getHTTPHeader("Content-Length");
+    std::from_chars(lengthString.data(), lengthString.data() + lengthString.size(), contentLength);
+    conn->input.setLimit(contentLength);
+
+    // Find the handler for the path and method
+    context.requestPath = parser.path();
+    if (context.requestPath.empty() || context.requestPath[0] != '/') {
+        char* path = static_cast<char*>(conn->arena.allocate(context.requestPath.size() + 1, 1));
+        path[0] = '/';
+        memcpy(path + 1, context.requestPath.data(), context.requestPath.size());
+        context.requestPath = std::string_view(path, context.requestPath.size() + 1);
+    }
+    
+    context.match = _routes.find(context.requestPath, parser.method());
+    
+    if (!_workers.empty() && context.match.handler >= 0) {
+        std::lock_guard<std::mutex> lock(_workerMutex);
+        auto it = _routeLimits.find(_handlers[context.match.handler].endpoint);
+        if (it != _routeLimits.end()) {
+            context.limit = &it->second;
+        }
+    }
+    return true;
+}
+
+void
+WebServer::handleRequest(RequestContext& context)
+{
+    HTTPParser& parser = context.parser;
+    const RouteTable::Match& match = context.match;
+    
+    if (match.handler < 0) {
+        if (match.allowed) {
+            context.setHeader("Allow", RouteTable::allowHeader(match.allowed));
+            sendHTTPResponse(context, 405, "text/plain", "Method Not Allowed");
+        } else {
+            sendHTTPResponse(context, 404, "text/plain", "Not Found");
+        }
+        return;
+    }
+    
+    const HTTPHandler& it = _handlers[match.handler];
+    
+    if (it.type == HTTPHandler::EndpointType::WebSocket) {
+        upgradeToWebSocket(context, match.handler);
+    } else if (it.type == HTTPHandler::EndpointType::EventStream) {
+        beginEventStream(context);
+    } else if (it.type == HTTPHandler::EndpointType::Static) {
+        sendStaticFile(context, std::string(match.tail).c_str(), it.path.c_str());
+    } else if (parser.method() == "POST") {
+        std::string contentType(parser.getHTTPHeader("Content-Type"));
+        if (contentType.empty()) {
+            parser.setErrorResponse(501, "no Content-Type");
+        } else {
+            std::vector<std::string> multipart = HTTPParser::parseFormData(contentType);
+            if (multipart[0] != "multipart/form-data" || multipart[1] != "boundary") {
+                // This is not a multipart, Handle it normally
                 if (it.requestCB) {
-                    it.requestCB();
+                    it.requestCB(context, context);
                 }
+            } else {
+                // None of the body has been read, so the limit is its Content-Length
+                parser.parseMultipart(context.conn->input.limit(), multipart[2], [&context, &it]() { it.requestCB(context, context); }, context.conn->input);
+            }
+        }
+        if (parser.errorCode()) {
+            sendHTTPResponse(context, parser.errorCode(), "text/plain", parser.errorReason().c_str());
+            System::logE(TAG, "HTTP parser error (%d):%s", parser.errorCode(), parser.errorReason().c_str());
+        }
+    } else if (it.requestCB) {
+        it.requestCB(context, context);
+    }
+}
+
+void
+WebServer::upgradeToWebSocket(RequestContext& context, int32_t handler)
+{
+    HTTPParser& parser = context.parser;
+    std::string_view key = parser.getHTTPHeader("Sec-WebSocket-Key");
+    
+    if (!equalsIgnoreCase(parser.getHTTPHeader("Upgrade"), "websocket") ||
+            !hasToken(parser.getHTTPHeader("Connection"), "upgrade") || key.empty()) {
+        sendHTTPResponse(context, 400, "text/plain", "Bad WebSocket Request");
+        return;
+    }
+    
+    if (parser.getHTTPHeader("Sec-WebSocket-Version") != "13") {
+        context.setHeader("Sec-WebSocket-Version", "13");
+        sendHTTPResponse(context, 426, "text/plain", "Upgrade Required");
+        return;
+    }
+    
+    // The accept value is the base64 SHA-1 of the key and a fixed GUID
+    std::string accept(key);
+    accept += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t digest[20];
+    sha1(accept, digest);
+    accept.clear();
+    appendBase64(accept, digest, sizeof(digest));
+    
+    context.setHeader("Upgrade", "websocket");
+    context.setHeader("Connection", "Upgrade");
+    context.setHeader("Sec-WebSocket-Accept", accept);
+    
+    // The server thread takes over the connection once the response is written
+    Connection* conn = context.conn;
+    conn->keepAlive = true;
+    conn->webSocket = handler;
+    sendHTTPResponse(context, 101, nullptr, "");
+}
+
+void
+WebServer::finishRequest(RequestContext& context)
+{
+    Connection* conn = context.conn;
+    
+    // If the handler didn't respond the client has no way to know the
+    // response is complete, so the connection has to close
+    if (!conn->responded) {
+        conn->keepAlive = false;
+    }
+    
+    if (conn->keepAlive) {
+        discardBody(conn);
+    }
+    
+    conn->input.setLimit(HTTPReader::NoLimit);
+    
+    // Give it back to the server thread to finish writing the response
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _clientsProcessed.push_back(conn);
+    }
+    uint8_t c = 0;
+    write(_wakeFD[1], &c, 1);
+}
+
+void
+WebServer::setWorkerThreads(uint8_t count, uint16_t maxQueued)
+{
+    stopWorkers();
+    
+    _maxQueued = maxQueued;
+    _stopWorkers = false;
+    for (uint8_t i = 0; i < count; ++i) {
+        _workers.emplace_back([this]() { runWorker(); });
+    }
+}
+
+void
+WebServer::setRouteConcurrency(const char* endpoint, uint8_t max)
+{
+    std::lock_guard<std::mutex> lock(_workerMutex);
+    _routeLimits[endpoint].max = max;
+}
+
+WebServer::WorkerStats
+WebServer::workerStats() const
+{
+    std::lock_guard<std::mutex> lock(_workerMutex);
+    WorkerStats stats = _workerStats;
+    stats.queueDepth = _queue.size();
+    if (stats.handled) {
+        stats.averageWaitTime = uint32_t(_totalWaitTime / stats.handled);
+        stats.averageServiceTime = uint32_t(_totalServiceTime / stats.handled);
+    }
+    return stats;
+}
+
+WebServer::ArenaStats
+WebServer::arenaStats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _arenaStats;
+}
+
+bool
+WebServer::queueRequest(RequestContext& context)
+{
+    {
+        std::lock_guard<std::mutex> lock(_workerMutex);
+        if (_queue.size() >= _maxQueued) {
+            _workerStats.rejected++;
+            return false;
+        }
+        
+        context.queuedTime = std::chrono::steady_clock::now();
+        _queue.push_back(&context);
+        _workerStats.maxQueueDepth = std::max(_workerStats.maxQueueDepth, _queue.size());
+    }
+    _workerCond.notify_one();
+    return true;
+}
+
+void
+WebServer::runWorker()
+{
+    while (true) {
+        RequestContext* context;
+        {
+            // Take the oldest request whose route isn't at its limit
+            std::unique_lock<std::mutex> lock(_workerMutex);
+            auto next = _queue.end();
+            _workerCond.wait(lock, [this, &next]() {
+                next = std::find_if(_queue.begin(), _queue.end(), [](const RequestContext* it) {
+                    return !it->limit || it->limit->active < it->limit->max;
+                });
+                return _stopWorkers || next != _queue.end();
+            });
+            
+            if (_stopWorkers) {
+                return;
+            }
+            
+            context = *next;
+            _queue.erase(next);
+            if (context->limit) {
+                context->limit->active++;
             }
-            break;
         }
+        
+        auto start = std::chrono::steady_clock::now();
+        
+        _context = context;
+        handleRequest(*context);
+        _context = nullptr;
+        
+        auto end = std::chrono::steady_clock::now();
+        
+        // The connection owns the context, and once it's handed back the
+        // server thread can reuse or free it. So this is done first
+        {
+            std::lock_guard<std::mutex> lock(_workerMutex);
+            if (context->limit) {
+                context->limit->active--;
+            }
+            
+            uint32_t serviceTime = uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+            _workerStats.handled++;
+            _workerStats.maxServiceTime = std::max(_workerStats.maxServiceTime, serviceTime);
+            _totalServiceTime += serviceTime;
+            _totalWaitTime += std::chrono::duration_cast<std::chrono::microseconds>(start - context->queuedTime).count();
+        }
+        
+        finishRequest(*context);
+        
+        // A request waiting on this route's limit can run now
+        _workerCond.notify_all();
+    }
+}
+
+void
+WebServer::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(_workerMutex);
+        _stopWorkers = true;
     }
+    _workerCond.notify_all();
     
-    close(_fdClient);
-    _fdClient = -1;
-    _parser.reset();
+    for (auto& it : _workers) {
+        it.join();
+    }
+    _workers.clear();
 }
 
 void
 WebServer::handleServer(int fdServer)
 {
-    struct sockaddr_in clientAddr;
-    socklen_t clientAddrSize = sizeof(struct sockaddr_in); 
+    ReadyEvent events[MaxEvents];
+    serverThreadOwner = this;
+    
+    while (true) {
+        // Event streams are sent new events when there are any, so poll for them while there are clients
+        int n = waitForEvents(_pollFD, events, MaxEvents, _eventStreams.empty() ? IdleCheckInterval : EventStreamInterval);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for server events");
+            return;
+        }
+        
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].fd;
+            
+            if (fd == fdServer) {
+                acceptClients(fdServer);
+                continue;
+            }
+            
+            if (fd == _wakeFD[0]) {
+                uint8_t buf[64];
+                while (read(_wakeFD[0], buf, sizeof(buf)) > 0) { }
+                rearmProcessedClients();
+                continue;
+            }
+            
+            // The connection might have been closed by an earlier event in this batch
+            auto it = _connections.find(fd);
+            if (it == _connections.end()) {
+                continue;
+            }
+            
+            Connection* conn = it->second.get();
+            if (conn->state == Connection::State::Reading && events[i].readable) {
+                readClient(conn);
+            } else if (conn->state == Connection::State::Writing && events[i].writable) {
+                writeClient(conn);
+            } else if (conn->state == Connection::State::WebSocket) {
+                if (events[i].readable && !conn->closing) {
+                    // This writes anything waiting too
+                    readWebSocket(conn);
+                } else if (events[i].writable) {
+                    flushStream(conn);
+                }
+            } else if (conn->state == Connection::State::EventStream) {
+                if (events[i].readable) {
+                    readEventStream(conn);
+                } else if (events[i].writable) {
+                    flushStream(conn);
+                }
+            }
+        }
+        
+        sendQueuedWebSocketMessages();
+        sendEventStreams();
+        closeIdleClients();
+    }
+}
+
+void
+WebServer::acceptClients(int fdServer)
+{
+    while (true) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrSize = sizeof(struct sockaddr_in); 
 
-    while (1) {
         int fdClient = accept(fdServer, (struct sockaddr*)&clientAddr, &clientAddrSize);
         if (fdClient < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
                 perror("Failed to accept client request");
+            }
+            return;
+        }
+        
+        if (!setNonBlocking(fdClient)) {
+            perror("Failed to set client socket to non-blocking");
+            close(fdClient);
+            continue;
+        }
+        
+        int noDelay = 1;
+        setsockopt(fdClient, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        
+        std::unique_ptr<Connection> conn = std::make_unique<Connection>(this);
+        conn->fd = fdClient;
+        conn->input.setReadCB([fdClient](uint8_t* buf, size_t size) -> ssize_t { return receive(fdClient, buf, size); });
+        Connection* c = conn.get();
+        _connections[fdClient] = std::move(conn);
+        startReading(c);
+    }
+}
+
+// Feed buffered data to the connection's parser. The lines it takes are
+// consumed, a partial line stays buffered until the rest of it arrives.
+// Returns true once the header is complete or has an error. Either way
+// process() takes it from there
+static bool parseHeader(HTTPReader& input, HTTPParser& parser)
+{
+    size_t used;
+    HTTPParser::ParseStatus status = parser.parse(input.peek(), used);
+    input.consume(used);
+    return status != HTTPParser::ParseStatus::Incomplete;
+}
+
+void
+WebServer::readClient(Connection* conn)
+{
+    while (!parseHeader(conn->input, conn->parser)) {
+        // The parser limits the header to less than the buffer, so there
+        // is always space for more of it
+        size_t space;
+        uint8_t* buf = conn->input.prepare(space);
+        
+        ssize_t size = read(conn->fd, buf, space);
+        if (size < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return;
             }
-            System::delay(10);
+            closeConnection(conn);
+            return;
+        }
+        if (size == 0) {
+            // Client closed the connection
+            closeConnection(conn);
+            return;
+        }
+        conn->input.commit(size);
+        conn->lastActivity = std::chrono::steady_clock::now();
+    }
+    
+    // Hand the connection to process()
+    conn->state = Connection::State::Processing;
+    watch(conn, false, false);
+    
+    std::lock_guard<std::mutex> lock(_mutex);
+    _clientsToProcess.push_back(conn);
+}
+
+void
+WebServer::writeClient(Connection* conn)
+{
+    int result = flush(conn, true);
+    if (result < 0 || (result > 0 && !conn->keepAlive)) {
+        closeConnection(conn);
+    } else if (result > 0) {
+        startReading(conn);
+    }
+}
+
+void
+WebServer::startReading(Connection* conn)
+{
+    conn->state = Connection::State::Reading;
+    conn->lastActivity = std::chrono::steady_clock::now();
+    
+    // Everything from the last request is freed at once
+    updateArenaStats(conn);
+    conn->arena.reset();
+    conn->parser.reset();
+    conn->context.reset();
+    
+    if (conn->webSocket >= 0) {
+        startWebSocket(conn);
+        return;
+    }
+    
+    // A pipelined request might already be buffered
+    if (parseHeader(conn->input, conn->parser)) {
+        conn->state = Connection::State::Processing;
+        watch(conn, false, false);
+        
+        std::lock_guard<std::mutex> lock(_mutex);
+        _clientsToProcess.push_back(conn);
+    } else {
+        watch(conn, true, false);
+    }
+}
+
+void
+WebServer::rearmProcessedClients()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _rearming.swap(_clientsProcessed);
+    }
+    
+    for (Connection* conn : _rearming) {
+        if (conn->failed) {
+            closeConnection(conn);
+        } else if (conn->eventStream) {
+            startEventStream(conn);
+        } else if (!conn->output.empty() || conn->file.isFile()) {
+            conn->state = Connection::State::Writing;
+            watch(conn, false, true);
+        } else if (conn->keepAlive) {
+            startReading(conn);
+        } else {
+            closeConnection(conn);
+        }
+    }
+    _rearming.clear();
+}
+
+void
+WebServer::closeIdleClients()
+{
+    auto now = std::chrono::steady_clock::now();
+    std::vector<Connection*> idle;
+    
+    for (const auto& it : _connections) {
+        Connection* conn = it.second.get();
+        if (conn->state == Connection::State::Reading && now - conn->lastActivity > std::chrono::milliseconds(_keepAliveTimeout)) {
+            idle.push_back(conn);
+        }
+    }
+    
+    for (Connection* conn : idle) {
+        closeConnection(conn);
+    }
+}
+
+void
+WebServer::watch(Connection* conn, bool read, bool write)
+{
+    watchFD(_pollFD, conn->fd, read, write, !conn->watched);
+    conn->watched = read || write;
+}
+
+void
+WebServer::closeConnection(Connection* conn)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _arenaStats.highWater = std::max(_arenaStats.highWater, conn->arena.highWater());
+        _arenaStats.capacity -= conn->arenaCapacity;
+    }
+    
+    if (conn->webSocketClient) {
+        _webSocketClients.erase(conn->webSocketClient);
+        notifyWebSocket(conn, WiFiPortal::WebSocketEvent::Disconnect);
+    }
+    
+    if (conn->events) {
+        _eventStreams.erase(std::find(_eventStreams.begin(), _eventStreams.end(), conn));
+    }
+    
+    // Closing the fd removes it from the event queue
+    int fd = conn->fd;
+    close(fd);
+    _connections.erase(fd);
+}
+
+void
+WebServer::updateArenaStats(Connection* conn)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _arenaStats.highWater = std::max(_arenaStats.highWater, conn->arena.highWater());
+    _arenaStats.capacity += conn->arena.capacity() - conn->arenaCapacity;
+    conn->arenaCapacity = conn->arena.capacity();
+}
+
+void
+WebServer::sendWebSocketMessage(uint32_t client, std::string_view message)
+{
+    if (client) {
+        queueWebSocketMessage(client, -1, message, 0);
+    }
+}
+
+void
+WebServer::broadcastWebSocketMessage(const char* endpoint, std::string_view message, uint32_t except)
+{
+    for (size_t i = 0; i < _handlers.size(); ++i) {
+        if (_handlers[i].type == HTTPHandler::EndpointType::WebSocket && _handlers[i].endpoint == endpoint) {
+            queueWebSocketMessage(0, int32_t(i), message, except);
+            return;
+        }
+    }
+}
+
+void
+WebServer::queueWebSocketMessage(uint32_t client, int32_t handler, std::string_view message, uint32_t except)
+{
+    // The frame is the same for every client, so build it once
+    WebSocketMessage queued { client, handler, except, std::string() };
+    appendWebSocketFrame(queued.frame, OpText, message);
+    
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _webSocketMessages.push_back(std::move(queued));
+    }
+    
+    // The server thread sends what's queued each time through its loop.
+    // Other threads have to wake it
+    if (serverThreadOwner != this) {
+        uint8_t c = 0;
+        write(_wakeFD[1], &c, 1);
+    }
+}
+
+void
+WebServer::sendQueuedWebSocketMessages()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _sendingWebSocketMessages.swap(_webSocketMessages);
+    }
+    
+    if (_sendingWebSocketMessages.empty()) {
+        return;
+    }
+    
+    auto queueFrame = [](Connection* conn, const std::string& frame)
+    {
+        if (conn->closing || conn->failed) {
+            return;
+        }
+        
+        // A client that can't keep up is dropped rather than let its output grow without limit
+        if (conn->output.size() - conn->outputOffset > MaxWebSocketOutput) {
+            System::logW(TAG, "WebSocket client %u is too slow, closing", conn->webSocketClient);
+            conn->failed = true;
+            return;
+        }
+        conn->output += frame;
+    };
+    
+    for (const WebSocketMessage& it : _sendingWebSocketMessages) {
+        if (it.client) {
+            auto client = _webSocketClients.find(it.client);
+            if (client != _webSocketClients.end()) {
+                queueFrame(client->second, it.frame);
+            }
         } else {
-            // process() will process the client
-            _clientsToProcess.push_back(fdClient);
+            for (const auto& client : _webSocketClients) {
+                if (client.second->webSocket == it.handler && client.first != it.except) {
+                    queueFrame(client.second, it.frame);
+                }
+            }
+        }
+    }
+    _sendingWebSocketMessages.clear();
+    
+    // Write everything queued for each client at once. Flushing can close
+    // a connection, so find them first
+    for (const auto& client : _webSocketClients) {
+        Connection* conn = client.second;
+        if (conn->failed || (!conn->output.empty() && !conn->writeWatched)) {
+            _flushing.push_back(conn);
+        }
+    }
+    for (Connection* conn : _flushing) {
+        flushStream(conn);
+    }
+    _flushing.clear();
+}
+
+void
+WebServer::notifyWebSocket(Connection* conn, WiFiPortal::WebSocketEvent event, std::string_view message)
+{
+    const WiFiPortal::WebSocketCB& cb = _handlers[conn->webSocket].webSocketCB;
+    if (cb) {
+        cb(conn->webSocketClient, event, message);
+    }
+}
+
+void
+WebServer::startWebSocket(Connection* conn)
+{
+    conn->state = Connection::State::WebSocket;
+    conn->webSocketClient = _nextWebSocketClient++;
+    _webSocketClients[conn->webSocketClient] = conn;
+    
+    watch(conn, true, false);
+    notifyWebSocket(conn, WiFiPortal::WebSocketEvent::Connect);
+    
+    // The client might not have waited for the handshake response
+    readWebSocket(conn);
+}
+
+void
+WebServer::readWebSocket(Connection* conn)
+{
+    while (handleWebSocketFrames(conn)) {
+        // Data frame payloads are consumed as they arrive and control
+        // frames are small, so there is always space for more
+        size_t space;
+        uint8_t* buf = conn->input.prepare(space);
+        
+        ssize_t size = read(conn->fd, buf, space);
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Write any pongs
+            if (!conn->output.empty()) {
+                flushStream(conn);
+            }
+            return;
+        }
+        if (size <= 0) {
+            closeConnection(conn);
+            return;
+        }
+        conn->input.commit(size);
+        conn->lastActivity = std::chrono::steady_clock::now();
+    }
+}
+
+bool
+WebServer::handleWebSocketFrames(Connection* conn)
+{
+    while (true) {
+        std::string_view data = conn->input.peek();
+        
+        if (conn->inFrame) {
+            // Unmask the payload into the message as it arrives
+            size_t size = size_t(std::min(conn->frameRemaining, uint64_t(data.size())));
+            size_t start = conn->message.size();
+            conn->message.append(data.data(), size);
+            unmask(conn->message.data() + start, size, conn->frameMask, conn->maskIndex);
+            conn->input.consume(size);
+            conn->frameRemaining -= size;
+            
+            if (conn->frameRemaining) {
+                return true;
+            }
+            
+            conn->inFrame = false;
+            if (conn->frameFin) {
+                notifyWebSocket(conn, WiFiPortal::WebSocketEvent::Message, conn->message);
+                conn->message.clear();
+                conn->messageOpcode = 0;
+            }
+            continue;
+        }
+        
+        WebSocketFrameHeader header;
+        size_t headerSize = parseWebSocketFrameHeader(data, header);
+        if (headerSize == 0) {
+            return true;
+        }
+        
+        // Clients have to mask their frames
+        if (headerSize == InvalidFrameHeader || header.reserved || !header.masked) {
+            closeWebSocket(conn, CloseProtocolError);
+            return false;
+        }
+        
+        if (header.opcode & 0x8) {
+            // Control frames can come between the frames of a message. They
+            // are small and handled once they're all here
+            if (!header.fin || header.length > 125) {
+                closeWebSocket(conn, CloseProtocolError);
+                return false;
+            }
+            if (data.size() < headerSize + header.length) {
+                return true;
+            }
+            
+            char payload[125];
+            uint8_t index = 0;
+            size_t length = size_t(header.length);
+            memcpy(payload, data.data() + headerSize, length);
+            unmask(payload, length, header.mask, index);
+            conn->input.consume(headerSize + length);
+            
+            switch (header.opcode) {
+                case OpClose:
+                    // Answer with the client's status
+                    closeWebSocket(conn, (length >= 2) ? uint16_t(uint8_t(payload[0]) << 8 | uint8_t(payload[1])) : CloseNoStatus);
+                    return false;
+                case OpPing:
+                    appendWebSocketFrame(conn->output, OpPong, std::string_view(payload, length));
+                    break;
+                case OpPong:
+                    break;
+                default:
+                    closeWebSocket(conn, CloseProtocolError);
+                    return false;
+            }
+            continue;
+        }
+        
+        // A continuation needs a message to continue, anything else starts a new one
+        bool valid = (header.opcode == OpContinuation) ? conn->messageOpcode != 0
+                                                       : (header.opcode == OpText || header.opcode == OpBinary) && conn->messageOpcode == 0;
+        if (!valid) {
+            closeWebSocket(conn, CloseProtocolError);
+            return false;
+        }
+        if (header.length > MaxWebSocketMessage - conn->message.size()) {
+            closeWebSocket(conn, CloseTooBig);
+            return false;
+        }
+        
+        if (header.opcode != OpContinuation) {
+            conn->messageOpcode = header.opcode;
+        }
+        conn->input.consume(headerSize);
+        conn->inFrame = true;
+        conn->frameFin = header.fin;
+        conn->frameRemaining = header.length;
+        memcpy(conn->frameMask, header.mask, 4);
+        conn->maskIndex = 0;
+    }
+}
+
+void
+WebServer::closeWebSocket(Connection* conn, uint16_t status)
+{
+    // A close without a status is answered without one
+    char payload[2] = { char(status >> 8), char(status) };
+    appendWebSocketFrame(conn->output, OpClose, std::string_view(payload, (status == CloseNoStatus) ? 0 : 2));
+    conn->closing = true;
+    flushStream(conn);
+}
+
+void
+WebServer::flushStream(Connection* conn)
+{
+    int result = conn->failed ? -1 : flush(conn, false);
+    if (result < 0 || (result > 0 && conn->closing)) {
+        closeConnection(conn);
+        return;
+    }
+    
+    // Only watch for writes while output is waiting. Once closing, the
+    // client's frames are ignored
+    bool write = result == 0;
+    if (write != conn->writeWatched || conn->closing) {
+        watch(conn, !conn->closing, write);
+        conn->writeWatched = write;
+    }
+}
+
+void
+WebServer::beginEventStream(RequestContext& context)
+{
+    // There is no length, the stream goes until the connection is closed
+    Connection* conn = context.conn;
+    conn->keepAlive = false;
+    conn->eventStream = true;
+    if (HTTPParser::cacheControl(_cacheControl, context.requestPath).empty()) {
+        context.setHeader("Cache-Control", "no-cache");
+    }
+    
+    const std::string& header = buildHTTPHeader(context, 200, UnknownLength, "text/event-stream");
+    send(context, header.data(), header.size());
+}
+
+void
+WebServer::startEventStream(Connection* conn)
+{
+    conn->state = Connection::State::EventStream;
+    conn->events = std::make_unique<EventLog::Reader>();
+    _eventStreams.push_back(conn);
+    
+    // The client has nothing more to say, but reading tells us when it goes away
+    watch(conn, true, false);
+    flushStream(conn);
+}
+
+void
+WebServer::readEventStream(Connection* conn)
+{
+    uint8_t buf[256];
+    while (true) {
+        ssize_t size = read(conn->fd, buf, sizeof(buf));
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (size <= 0) {
+            closeConnection(conn);
+            return;
         }
     }
 }
+
+void
+WebServer::sendEventStreams()
+{
+    EventLog::Event event;
+    
+    for (Connection* conn : _eventStreams) {
+        // A client that isn't keeping up gets nothing more until it has
+        // taken what it has. Meanwhile the log moves on without it and it
+        // is told how many events it missed
+        while (conn->output.size() - conn->outputOffset < MaxEventStreamOutput && conn->events->next(event)) {
+            if (uint64_t dropped = conn->events->takeDropped()) {
+                EventLog::appendDropped(conn->output, dropped);
+            }
+            EventLog::appendServerSentEvent(conn->output, event);
+        }
+        
+        // Flushing can close a connection, so find the ones to flush first
+        if (!conn->output.empty() && !conn->writeWatched) {
+            _flushing.push_back(conn);
+        }
+    }
+    
+    for (Connection* conn : _flushing) {
+        flushStream(conn);
+    }
+    _flushing.clear();
+}
@@ -13,13 +13,55 @@ All rights reserved.
 //
 // Adapted from https://github.com/Aryandev12/webby-http-server/
 //
+// A server thread runs a readiness based event loop (kqueue on Mac, epoll
+// on Linux) which accepts connections, reads request headers and writes
+// responses for any number of clients concurrently. When a connection has
+// a complete header block it is queued for process(), which runs the
+// handlers on the caller's thread. Handler output is buffered in the
+// connection and handed back to the event loop to be written.
+//
+// Optionally handlers can run on a pool of worker threads instead, so a
+// slow handler doesn't hold up other clients. process() parses and routes
+// each request and queues it for the workers. If the queue is full the
+// request gets a 503. A route can be limited to a number of concurrent
+// requests, which also keeps handlers that aren't thread safe on one
+// thread at a time. Everything a handler can see about its request is in
+// a RequestContext, which is passed to the handler as its Request and
+// Response. It is also current for the thread handling it, for callers of
+// the WiFiPortal calls that don't take a request.
+//
+// Connections are persistent (HTTP/1.1 keep-alive) unless the client asks
+// otherwise. Pipelined requests on a connection are handled in order, each
+// one after the previous response has been written. Idle connections are
+// closed after a timeout.
+//
+// A GET to a WebSocket endpoint upgrades the connection. After that the
+// server thread reads and writes its frames itself, calling the endpoint's
+// callback with each message. It doesn't go back to process().
+// Messages sent from other threads are queued and the server thread is
+// woken to write them.
+//
+// An event stream endpoint serves the EventLog as Server-Sent Events. Once
+// the response header is written the server thread owns the connection
+// too. It polls the log for new events while there are stream clients,
+// so adding an event never has to wake it.
+//
 
 #pragma once
 
 #include "WiFiPortal.h"
 #include "HTTPParser.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 namespace fs {
     class File;
@@ -29,18 +71,127 @@ namespace mil {
 
 class WebFileSystem;
 
+// Maps request paths to handlers. Routes are stored in a trie with one node
+// per path segment, so a lookup walks the segments of the path once and
+// doesn't allocate. A route is either Exact, which only matches its own
+// path, or Prefix, which also matches any path below it. A "*" segment in a
+// route matches any one segment. When more than one route matches, a
+// literal segment beats "*", an Exact route beats a Prefix route and a
+// longer Prefix beats a shorter one. Each route is registered for one
+// method, and registering the same route and method twice keeps the first.
+
+class RouteTable
+{
+  public:
+    enum class Type { Exact, Prefix };
+    
+    struct Match
+    {
+        // Value passed to add(), or -1 if nothing matched
+        int32_t handler = -1;
+        
+        // For a Prefix route, the part of the path after the route, starting
+        // with '/'. Points into the path passed to find()
+        std::string_view tail;
+        
+        // Bit per HTTPMethod with a route for this path. If it's non-zero
+        // when there's no handler the path exists but not for the method
+        uint8_t allowed = 0;
+    };
+    
+    void add(std::string_view route, WiFiPortal::HTTPMethod, Type, int32_t handler);
+    Match find(std::string_view path, std::string_view method) const;
+    
+    // Value for an Allow header from Match::allowed
+    static std::string allowHeader(uint8_t allowed);
+
+  private:
+    static constexpr size_t MethodCount = 3;
+    
+    struct Node
+    {
+        Node(std::string_view s) : segment(s) { }
+        
+        std::string segment;
+        
+        // Literal children sorted with SegmentLess and the "*" child
+        std::vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> wildcard;
+        
+        int32_t exact[MethodCount] = { -1, -1, -1 };
+        int32_t prefix[MethodCount] = { -1, -1, -1 };
+    };
+    
+    // Children are ordered by length first, which is all most comparisons need
+    struct SegmentLess
+    {
+        bool operator()(const std::unique_ptr<Node>& node, std::string_view segment) const
+        {
+            if (node->segment.size() != segment.size()) {
+                return node->segment.size() < segment.size();
+            }
+            return std::string_view(node->segment) < segment;
+        }
+    };
+    
+    // rest is the unmatched part of the path, empty or starting with '/'
+    static bool find(const Node*, std::string_view rest, size_t method, Match&);
+    
+    Node _root { "" };
+};
+
 class WebServer
 {
 public:
-    WebServer() { }
-    ~WebServer() { stop(); }
+    struct WorkerStats
+    {
+        size_t queueDepth = 0;          // Requests waiting for a worker now
+        size_t maxQueueDepth = 0;
+        uint32_t handled = 0;
+        uint32_t rejected = 0;          // Sent a 503 because the queue was full
+        uint32_t averageWaitTime = 0;   // us from queued to started
+        uint32_t averageServiceTime = 0;// us in the handler
+        uint32_t maxServiceTime = 0;
+    };
+    
+    // Each connection has an arena which everything for a request is
+    // allocated from. It's reset when the request is done
+    struct ArenaStats
+    {
+        size_t highWater = 0;           // Most any one request has used
+        size_t capacity = 0;            // Held by all open connections
+    };
+    
+    WebServer();
+    ~WebServer();
 
     int start(WebFileSystem* fs, int port);
     void stop() { }
     
     void process();
     
-    int32_t addHTTPHandler(const char* endpoint, WiFiPortal::HTTPMethod method, HTTPParser::HandlerCB requestCB)
+    // Close connections that have been idle for idleTimeout ms and close a
+    // connection after it has handled maxRequests requests. A maxRequests
+    // of 1 disables keep-alive.
+    void setKeepAlive(uint32_t idleTimeout, uint32_t maxRequests)
+    {
+        _keepAliveTimeout = idleTimeout;
+        _keepAliveMaxRequests = maxRequests;
+    }
+    
+    // Run handlers on count worker threads with up to maxQueued requests
+    // waiting for one. A count of 0 (the default) runs them in process().
+    // Add all the handlers before starting the workers
+    void setWorkerThreads(uint8_t count, uint16_t maxQueued);
+    
+    // Run at most max requests for endpoint at once, for all methods. Other
+    // requests for it wait in the queue. Only applies with worker threads
+    void setRouteConcurrency(const char* endpoint, uint8_t max);
+    
+    WorkerStats workerStats() const;
+    ArenaStats arenaStats() const;
+    
+    int32_t addHTTPHandler(const char* endpoint, WiFiPortal::HTTPMethod method, WiFiPortal::RequestHandlerCB requestCB)
     {
         // We handle only a very simple wildcard type. If the endpoint ends with "/*" then we
         // strip it off and set the type to Wildcard
@@ -54,54 +205,249 @@ public:
             }
         }
         _handlers.emplace_back(std::string(endpoint, len).c_str(), "", requestCB, type);
+        _routes.add(_handlers.back().endpoint, method,
+                    (type == HTTPHandler::EndpointType::Fixed) ? RouteTable::Type::Exact : RouteTable::Type::Prefix,
+                    int32_t(_handlers.size() - 1));
         return int32_t(_handlers.size());
     }
 
     void addStaticHTTPHandler(const char* uri, const char* path)
     {
         _handlers.emplace_back(uri, path, nullptr, HTTPHandler::EndpointType::Static);
+        _routes.add(uri, WiFiPortal::HTTPMethod::Get, RouteTable::Type::Prefix, int32_t(_handlers.size() - 1));
+    }
+    
+    void addWebSocketHandler(const char* endpoint, WiFiPortal::WebSocketCB cb)
+    {
+        _handlers.emplace_back(endpoint, "", nullptr, HTTPHandler::EndpointType::WebSocket, cb);
+        _routes.add(endpoint, WiFiPortal::HTTPMethod::Get, RouteTable::Type::Exact, int32_t(_handlers.size() - 1));
     }
-
-    void sendHTTPResponse(int code, const char* mimetype = nullptr, const char* data = "", const HTTPParser::ArgMap& extraHeaders = HTTPParser::ArgMap());
-    void sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip, const HTTPParser::ArgMap& extraHeaders = HTTPParser::ArgMap());
-    void streamHTTPResponse(fs::File& file, const char* mimetype, bool attach, const HTTPParser::ArgMap& extraHeaders = HTTPParser::ArgMap());
-
-    std::string getHTTPArg(const char* name) { return _parser ? _parser->getHTTPArg(name) : ""; }
-    void parseQuery(const char* queryString) { if (_parser) _parser->parseQuery(queryString); }
-    std::string getHTTPHeader(const char* name) { return _parser ? _parser->getHTTPHeader(name) : ""; }
-    WiFiPortal::HTTPUploadStatus httpUploadStatus() const { return _parser ? _parser->httpUploadStatus() : WiFiPortal::HTTPUploadStatus::None; }
-    std::string httpUploadFilename() const { return _parser ? _parser->httpUploadFilename() : ""; }
-    size_t httpUploadTotalSize() const { return _parser ? _parser->httpUploadTotalSize() : 0; }
-    size_t httpUploadCurrentSize() const { return _parser ? _parser->httpUploadCurrentSize() : 0; }
-    const uint8_t* httpUploadBuffer() const { return _parser ? _parser->httpUploadBuffer() : nullptr; }
-
-    int receiveHTTPResponse(char* buf, size_t size) { return int(read(_fdClient, buf, size)); }
+    
+    void addEventStreamHandler(const char* endpoint)
+    {
+        _handlers.emplace_back(endpoint, "", nullptr, HTTPHandler::EndpointType::EventStream);
+        _routes.add(endpoint, WiFiPortal::HTTPMethod::Get, RouteTable::Type::Exact, int32_t(_handlers.size() - 1));
+    }
+    
+    // Can be called from any thread. A client of 0 is ignored
+    void sendWebSocketMessage(uint32_t client, std::string_view message);
+    void broadcastWebSocketMessage(const char* endpoint, std::string_view message, uint32_t except = 0);
+    
+    // Cache-Control sent with 200, 206 and 304 responses to requests under uri.
+    // The longest matching uri wins
+    void setCacheControl(const char* uri, const char* value) { _cacheControl[uri] = value; }
+    
+    // Request being handled by the calling thread and its response, or null
+    static WiFiPortal::Request* currentRequest() { return _context; }
+    static WiFiPortal::Response* currentResponse() { return _context; }
     
 private:
-    void handleClient(int fdClient);
+    struct Connection;
+    
+    struct RouteLimit
+    {
+        uint8_t max = 0;
+        uint8_t active = 0;
+    };
+    
+    struct RequestContext : public WiFiPortal::Request, public WiFiPortal::Response
+    {
+        RequestContext(WebServer* s, Connection* c);
+        
+        // Ready for the next request on the connection
+        void reset();
+        
+        // Add a header to the response, replacing one with the same name.
+        // The name and value are copied into the connection's arena
+        void setHeader(std::string_view name, std::string_view value);
+        
+        virtual std::string path() const override { return std::string(requestPath); }
+        virtual std::string arg(const char* name) const override { return std::string(parser.getHTTPArg(name)); }
+        virtual std::string header(const char* name) const override { return std::string(parser.getHTTPHeader(name)); }
+        virtual void parseQuery(const char* queryString) override { parser.parseQuery(queryString); }
+        virtual WiFiPortal::HTTPUploadStatus uploadStatus() const override { return parser.httpUploadStatus(); }
+        virtual std::string uploadFilename() const override { return std::string(parser.httpUploadFilename()); }
+        virtual size_t uploadTotalSize() const override { return parser.httpUploadTotalSize(); }
+        virtual size_t uploadCurrentSize() const override { return parser.httpUploadCurrentSize(); }
+        virtual const uint8_t* uploadBuffer() const override { return parser.httpUploadBuffer(); }
+        virtual uint32_t uploadRate() const override { return parser.httpUploadRate(); }
+        virtual int read(char* buf, size_t size) override { return server->receiveHTTPResponse(*this, buf, size); }
+        
+        using WiFiPortal::Response::send;
+        virtual void addHeader(const char* name, const char* value) override { setHeader(name, value); }
+        virtual void send(int code, const char* mimetype, const char* data, size_t length, bool gzip) override
+        {
+            server->sendHTTPResponse(*this, code, mimetype, data, length, gzip);
+        }
+        virtual void stream(fs::File& file, const char* mimetype, bool attach) override
+        {
+            server->streamHTTPResponse(*this, file, mimetype, attach);
+        }
+        virtual void beginChunked(int code, const char* mimetype) override { server->beginChunked(*this, code, mimetype); }
+        virtual void sendChunk(const char* data, size_t length) override { server->sendChunk(*this, data, length); }
+        
+        WebServer* server;
+        Connection* conn;
+        HTTPParser& parser;                     // Owned by the connection, it parsed the header as it arrived
+        std::vector<HTTPParser::Field> responseHeaders; // Sent with the next header built
+        RouteTable::Match match;
+        std::string_view requestPath;           // In the arena, match.tail points into this
+        RouteLimit* limit = nullptr;            // Only set with worker threads
+        std::chrono::steady_clock::time_point queuedTime;
+        bool chunked = false;                   // Body is being sent with chunked encoding
+    };
+    
+    // Request being handled by this thread, or null
+    static thread_local RequestContext* _context;
+    
+    // Returns false if the request couldn't be parsed. An error response has been sent
+    bool parseRequest(RequestContext&);
+    void handleRequest(RequestContext&);
+    
+    // Clean up after the handler and give the connection back to the server thread
+    void finishRequest(RequestContext&);
+    
+    // Returns false if the queue is full
+    bool queueRequest(RequestContext&);
+    void runWorker();
+    void stopWorkers();
+    
     void handleServer(int fdServer);
 
-    void sendStaticFile(const char* filename, const char* path);
+    // Event loop helpers, only called from the server thread
+    void acceptClients(int fdServer);
+    void readClient(Connection*);
+    void writeClient(Connection*);
+    void startReading(Connection*);
+    void rearmProcessedClients();
+    void closeIdleClients();
+    void watch(Connection*, bool read, bool write);
+    void closeConnection(Connection*);
+    void updateArenaStats(Connection*);
     
-    std::string buildHTTPHeader(int statuscode, size_t contentLength, const char* mimetype, const HTTPParser::ArgMap& extraHeaders = HTTPParser::ArgMap());
+    // Answer the handshake, or send an error response if it isn't a valid
+    // upgrade request
+    void upgradeToWebSocket(RequestContext&, int32_t handler);
+    
+    // WebSocket helpers, only called from the server thread
+    void startWebSocket(Connection*);
+    void notifyWebSocket(Connection*, WiFiPortal::WebSocketEvent, std::string_view message = std::string_view());
+    void readWebSocket(Connection*);
+    
+    // Handle the frames buffered in the connection's input. Returns false
+    // once the connection is closing
+    bool handleWebSocketFrames(Connection*);
+    void closeWebSocket(Connection*, uint16_t status);
+    
+    // Write the queued output of a WebSocket or event stream and watch for
+    // writes if it doesn't all fit. Closes the connection on error or when
+    // a WebSocket close has been sent
+    void flushStream(Connection*);
+    void sendQueuedWebSocketMessages();
+    
+    // client of 0 sends to all the clients of handler except except
+    void queueWebSocketMessage(uint32_t client, int32_t handler, std::string_view message, uint32_t except);
+    
+    // Send the response header. The server thread takes the connection
+    // when it's written
+    void beginEventStream(RequestContext&);
+    
+    // Event stream helpers, only called from the server thread
+    void startEventStream(Connection*);
+    void readEventStream(Connection*);
+    void sendEventStreams();
+
+    // ReadCB for a connection's HTTPReader, waits for data on the non-blocking socket
+    static ssize_t receive(int fd, uint8_t* buf, size_t size);
+    
+    // Read and throw away any part of the request body the handler didn't use
+    void discardBody(Connection*);
+    
+    // Headers added to the context with setHeader are sent with the response
+    void sendHTTPResponse(RequestContext&, int code, const char* mimetype = nullptr, const char* data = "");
+    void sendHTTPResponse(RequestContext&, int code, const char* mimetype, const char* data, size_t length, bool gzip);
+    void streamHTTPResponse(RequestContext&, fs::File& file, const char* mimetype, bool attach);
+    int receiveHTTPResponse(RequestContext&, char* buf, size_t size);
+    
+    // HTTP/1.0 clients don't understand chunked encoding. They get the body
+    // as is and the connection is closed to end it
+    void beginChunked(RequestContext&, int code, const char* mimetype);
+    void sendChunk(RequestContext&, const char* data, size_t length);
+    
+    // Queue response data and write as much as the socket will take without
+    // blocking. A header and body can be passed together to go out in one write
+    void send(RequestContext&, const char* data, size_t length, const char* data2 = nullptr, size_t length2 = 0);
+    
+    // Returns -1 on error, 0 if the socket would block and 1 when all pending output is written
+    static int flush(Connection*, bool streamFile);
+
+    void sendStaticFile(RequestContext&, const char* filename, const char* path);
+    
+    // A contentLength of UnknownLength sends no Content-Length, for chunked responses
+    static constexpr size_t UnknownLength = SIZE_MAX;
+    
+    // Returns the header in the connection's header buffer, which is reused for each response
+    const std::string& buildHTTPHeader(RequestContext&, int statuscode, size_t contentLength, const char* mimetype);
     
     struct HTTPHandler
     {
-        enum class EndpointType { Fixed, Static, Wildcard };
+        enum class EndpointType { Fixed, Static, Wildcard, WebSocket, EventStream };
         std::string endpoint, path;
-        HTTPParser::HandlerCB requestCB;
+        WiFiPortal::RequestHandlerCB requestCB;
         EndpointType type;
+        WiFiPortal::WebSocketCB webSocketCB = nullptr;
+    };
+    
+    struct WebSocketMessage
+    {
+        uint32_t client;
+        int32_t handler;
+        uint32_t except;
+        std::string frame;
     };
     
     std::vector<HTTPHandler> _handlers;
-        
-    int _fdClient = -1; // This is only valis during handleClient
+    RouteTable _routes;
+    HTTPParser::ArgMap _cacheControl;
+    
+    uint32_t _keepAliveTimeout = 5000;
+    uint32_t _keepAliveMaxRequests = 100;
+    
+    // Owned by the server thread
+    int _pollFD = -1;
+    int _wakeFD[2] = { -1, -1 };
+    std::map<int, std::unique_ptr<Connection>> _connections;
+    std::vector<Connection*> _rearming;
+    std::map<uint32_t, Connection*> _webSocketClients;
+    uint32_t _nextWebSocketClient = 1;
+    std::vector<WebSocketMessage> _sendingWebSocketMessages;
+    std::vector<Connection*> _eventStreams;
+    std::vector<Connection*> _flushing;
     
-    std::vector<int> _clientsToProcess;
+    // Hand off between the server thread and process(), WebSocket messages
+    // from other threads and the arena stats
+    mutable std::mutex _mutex;
+    std::vector<Connection*> _clientsToProcess;
+    std::vector<Connection*> _clientsProcessed;
+    std::vector<WebSocketMessage> _webSocketMessages;
+    ArenaStats _arenaStats;
+    
+    std::vector<Connection*> _processing;  // Only used by process()
     
     WebFileSystem* _wfs = nullptr;
     
-    std::unique_ptr<HTTPParser> _parser;
+    // Worker pool. _routeLimits and _queue are protected by _workerMutex
+    std::vector<std::thread> _workers;
+    std::deque<RequestContext*> _queue;
+    std::map<std::string, RouteLimit> _routeLimits;
+    uint16_t _maxQueued = 0;
+    bool _stopWorkers = false;
+    mutable std::mutex _workerMutex;
+    std::condition_variable _workerCond;
+    
+    WorkerStats _workerStats;
+    uint64_t _totalWaitTime = 0;
+    uint64_t _totalServiceTime = 0;
 };
 
 }
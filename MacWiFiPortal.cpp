@@ -41,9 +41,9 @@ MacWiFiPortal::setConfigHandler(HandlerCB)
 }
 
 int32_t
-MacWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB requestCB)
+MacWiFiPortal::addHTTPHandler(const char* endpoint, HTTPMethod method, RequestHandlerCB requestCB)
 {
-   _server.addHTTPHandler(endpoint, method, [this, requestCB]() { requestCB(this); });
+   _server.addHTTPHandler(endpoint, method, requestCB);
     return 0;
 }
 
@@ -78,60 +78,6 @@ MacWiFiPortal::getSSID()
     return "My Network";
 }
 
-void
-MacWiFiPortal::sendHTTPResponse(int code, const char* mimetype, const char* data)
-{
-    _server.sendHTTPResponse(code, mimetype, data);
-}
-
-void
-MacWiFiPortal::sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip)
-{
-    _server.sendHTTPResponse(code, mimetype, data, length, gzip);
-}    
-
-void
-MacWiFiPortal::streamHTTPResponse(fs::File& file, const char* mimetype, bool attach)
-{
-    _server.streamHTTPResponse(file, mimetype, attach);
-}
-
-WiFiPortal::HTTPUploadStatus
-MacWiFiPortal::httpUploadStatus() const
-{
-    return _server.httpUploadStatus();
-}
-
-std::string
-MacWiFiPortal::httpUploadFilename() const
-{
-    return _server.httpUploadFilename();
-}
-
-size_t
-MacWiFiPortal::httpUploadTotalSize() const
-{
-    return _server.httpUploadTotalSize();
-}
-
-size_t
-MacWiFiPortal::httpUploadCurrentSize() const
-{
-    return _server.httpUploadCurrentSize();
-}
-
-const uint8_t*
-MacWiFiPortal::httpUploadBuffer() const
-{
-    return _server.httpUploadBuffer();
-}
-
-int
-MacWiFiPortal::receiveHTTPResponse(char* buf, size_t size)
-{
-    return _server.receiveHTTPResponse(buf, size);
-}
-
 std::string
 MacWiFiPortal::getCPUModel() const
 {
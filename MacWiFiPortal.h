@@ -24,24 +24,25 @@ public:
     virtual void begin(WebFileSystem*) override;
 
     virtual void setConfigHandler(HandlerCB) override;
-    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB requestCB) override;
+    using WiFiPortal::addHTTPHandler;
+    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod method, RequestHandlerCB requestCB) override;
     virtual void addStaticHTTPHandler(const char *uri, const char *path) override;
     virtual bool autoConnect(char const *apName, char const *apPassword = NULL) override;
     virtual void process() override;
     virtual std::string getIP() override;
     virtual const char* getSSID() override;
-    virtual void sendHTTPResponse(int code, const char* mimetype = nullptr, const char* data = "") override;
-    virtual void sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip) override;
-    virtual void streamHTTPResponse(fs::File& file, const char* mimetype, bool attach) override;
-    virtual HTTPUploadStatus httpUploadStatus() const override;
-    virtual std::string httpUploadFilename() const override;
-    virtual size_t httpUploadTotalSize() const override;
-    virtual size_t httpUploadCurrentSize() const override;
-    virtual const uint8_t* httpUploadBuffer() const override;
-    virtual int receiveHTTPResponse(char* buf, size_t size) override;
-    virtual std::string getHTTPArg(const char* name) override { return _server.getHTTPArg(name); }
-    virtual void parseQuery(const char* queryString) override { return _server.parseQuery(queryString); }
-    virtual std::string getHTTPHeader(const char* name) override { return _server.getHTTPHeader(name); }
+    virtual Request* currentRequest() const override { return WebServer::currentRequest(); }
+    virtual Response* currentResponse() const override { return WebServer::currentResponse(); }
+    virtual void setCacheControl(const char* uri, const char* value) override { _server.setCacheControl(uri, value); }
+    virtual void setWorkerThreads(uint8_t count, uint16_t maxQueued) override { _server.setWorkerThreads(count, maxQueued); }
+    virtual void setRouteConcurrency(const char* endpoint, uint8_t max) override { _server.setRouteConcurrency(endpoint, max); }
+    virtual void addWebSocketHandler(const char* endpoint, WebSocketCB cb) override { _server.addWebSocketHandler(endpoint, cb); }
+    virtual void sendWebSocketMessage(uint32_t client, std::string_view message) override { _server.sendWebSocketMessage(client, message); }
+    virtual void broadcastWebSocketMessage(const char* endpoint, std::string_view message, uint32_t except) override
+    {
+        _server.broadcastWebSocketMessage(endpoint, message, except);
+    }
+    virtual void addEventStreamHandler(const char* endpoint) override { _server.addEventStreamHandler(endpoint); }
     virtual std::string getCPUModel() const override;
     virtual uint32_t getCPUUptime() const override;
 
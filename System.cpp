@@ -87,6 +87,12 @@ System::millis()
     return ::millis();
 }
 
+uint32_t
+System::freeHeap()
+{
+    return ESP.getFreeHeap();
+}
+
 void
 System::restart()
 {
@@ -267,6 +273,12 @@ System::millis()
     return uint32_t(esp_timer_get_time() / 1000);
 }
 
+uint32_t
+System::freeHeap()
+{
+    return esp_get_free_heap_size();
+}
+
 void
 System::restart()
 {
@@ -414,6 +426,12 @@ System::millis()
     return ((std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - _startTime)).count()) * 1000;
 }
 
+uint32_t
+System::freeHeap()
+{
+    return 0;
+}
+
 static bool _restarting = false;
 
 void
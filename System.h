@@ -11,6 +11,8 @@ All rights reserved.
 
 #include "mil.h"
 
+#include "EventLog.h"
+
 #include <string>
 
 // System level functions with specializations for each platform
@@ -191,6 +193,9 @@ class System
     
     static uint32_t millis();
     
+    // Bytes of heap free. Not tracked on Mac, where it's always 0
+    static uint32_t freeHeap();
+    
     static void restart();
     static bool isRestarting();
     
@@ -268,7 +273,9 @@ class System
 
 static void log(char type, const char* color, const char* tag, const char* fmt, va_list args)
     {
-        printf("%s%c %s: %s%s\n", color, type, tag, vformat(fmt, args).c_str(), NoColor);
+        std::string s = vformat(fmt, args);
+        printf("%s%c %s: %s%s\n", color, type, tag, s.c_str(), NoColor);
+        EventLog::add(EventLog::Type::Log, { std::string_view(&type, 1), " ", tag, ": ", s });
     }
 };
 
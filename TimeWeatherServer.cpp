@@ -16,140 +16,33 @@ using namespace mil;
 
 static const char* TAG = "TimeWeatherServer";
 
-class MyJSONParser : public JSONParser
+// Fetch url until everything filter subscribes to is found, retrying a
+// few times
+static bool
+fetchJSON(const std::string& url, JSONPathFilter& filter, const char* what)
 {
-  public:
-    virtual bool handleKey(const std::string& key) override
+    HTTPFetchClient client([&filter](const char* buf, uint32_t size)
     {
-        switch(_state) {
-            default: break;
-            case State::None:
-            if (key == "timestamp") {
-                _state = State::Timestamp;
-            } else if (key == "lat") {
-                _state = State::Latitude;
-            } else if (key == "lon") {
-                _state = State::Longitude;
-            } else if (key == "current") {
-                _state = State::Current;
-            } else if (key == "forecast") {
-                _state = State::Forecast;
-            }
-            break;
-            case State::Current:
-            if (key == "temp_f") {
-                _state = State::CurrentTemp;
-            } else if (key == "condition") {
-                _state = State::Condition;
-            }
-            break;
-            case State::Condition:
-            if (key == "text") {
-                _state = State::ConditionText;
-            }
-            break;
-            case State::Forecast:
-            if (key == "forecastday") {
-                _state = State::ForecastDay;
-            }
-            break;
-            case State::ForecastDay:
-            if (key == "day") {
-                _state = State::Day;
-            }
-            break;
-            case State::Day:
-            if (key == "maxtemp_f") {
-                _state = State::MaxTemp;
-            } else if (key == "mintemp_f") {
-                _state = State::MinTemp;
-            }
-            break;
+        // Once it fails the rest of the feed is ignored
+        if (!filter.failed() && !filter.parse(buf, size)) {
+            System::logE(TAG, filter.errorString().c_str());
         }
-        return true;
-    }
-    
-    virtual bool handleValue(const std::string& value) override
-    {
-        switch(_state) {
-            default: break;
-            case State::Timestamp:
-            _currentTime = uint32_t(atol(value.c_str()));
-            _state = State::None;
-            break;
-           case State::Latitude:
-            _latitude = float(atof(value.c_str()));
-            _state = State::None;
-            break;
-          case State::Longitude:
-            _longitude = float(atof(value.c_str()));
-            _state = State::None;
-            break;
-            case State::ConditionText: 
-            _conditions = value;
-            _state = State::Current;
-            break;
-            case State::CurrentTemp: 
-            _currentTemp = int32_t(std::stof(value) + 0.5);
-            _state = State::Current;
-            break;
-            case State::MinTemp:
-            _lowTemp = int32_t(std::stof(value) + 0.5);
-            _state = State::Day;
-            break;
-            case State::MaxTemp: 
-            _highTemp = int32_t(std::stof(value) + 0.5);
-            _state = State::Day;
-            break;
+    });
+
+    for (int i = 0; i < 5; ++i) {
+        filter.reset();
+        if (client.fetch(url.c_str()) && filter.foundAll()) {
+            return true;
         }
-        return true;
+        System::logW(TAG, "Failed to get %s data, retrying...", what);
     }
-    
-    virtual bool handleEndObject() override { _state = State::None; return true; }
-
-    std::optional<uint32_t> currentTime() const { return _currentTime; }
-    std::optional<float> latitude() const { return _latitude; }
-    std::optional<float> longitude() const { return _longitude; }
-    std::optional<int32_t> currentTemp() const { return _currentTemp; }
-    std::optional<int32_t> lowTemp() const { return _lowTemp; }
-    std::optional<int32_t> highTemp() const { return _highTemp; }
-    std::optional<std::string> conditions() const { return _conditions; }
-    std::optional<std::string> timeZone() const { return _timeZone; }
-
-  private:
-    enum class State {
-        None,
-        Timestamp,
-        Latitude,
-        Longitude,
-        Current,
-            CurrentTemp,
-            Condition,
-                ConditionText,
-        Forecast,
-            ForecastDay,
-                Day,
-                    MinTemp,	
-                    MaxTemp,	
-    };
-
-    State _state = State::None;
-
-    std::optional<uint32_t> _currentTime = std::nullopt;
-    std::optional<float> _longitude = std::nullopt;
-    std::optional<float> _latitude = std::nullopt;
-    std::optional<int32_t> _currentTemp = 0;
-    std::optional<int32_t> _lowTemp = 0;
-    std::optional<int32_t> _highTemp = 0;
-    std::optional<std::string> _conditions;
-    std::optional<std::string> _timeZone;
-};
+    return false;
+}
 
 bool
 TimeWeatherServer::update(const char* zipCode)
 {
     std::string apiURL;
-    std::unique_ptr<MyJSONParser> parser = std::make_unique<MyJSONParser>();
 
     System::logI(TAG, "Getting geolocation feed...");
 
@@ -158,30 +51,21 @@ TimeWeatherServer::update(const char* zipCode)
     apiURL +="&appid=";
     apiURL += GeoLocationAPIKey;
 
-    bool failed = true;
+    // Values are parsed into locals and only kept if the whole fetch
+    // succeeds, so a failed update leaves the last good ones in place
+    float latitude;
+    float longitude;
+    JSONPathFilter geoFilter {
+        { "$.lat", &latitude },
+        { "$.lon", &longitude },
+    };
 
-    HTTPFetchClient client([p = parser.get()](const char* buf, uint32_t size)
-    {
-        for (size_t i = 0; i < size; ++i) {
-            if (!p->parseNextChar(buf[i])) {
-                System::logE(TAG, p->errorString().c_str());
-                return;
-            }
-        }
-    });
-    
-    for (int i = 0; i < 5; ++i) {
-        if (client.fetch(apiURL.c_str()) && parser->latitude() && parser->longitude()) {
-            _latitude = *parser->latitude();
-            _longitude = *parser->longitude();
-            failed = false;
-            break;
-        } else {
-            System::logW(TAG, "Failed to get geolocation data, retrying...");
-        }
-    }
+    bool failed = !fetchJSON(apiURL, geoFilter, "geolocation");
     
     if (!failed) {    
+        _latitude = latitude;
+        _longitude = longitude;
+        
         System::logI(TAG, "Getting time feed...");
 
         apiURL = "http://api.timezonedb.com";
@@ -191,21 +75,15 @@ TimeWeatherServer::update(const char* zipCode)
         apiURL += std::to_string(_latitude);
         apiURL +="&lng=";
         apiURL += std::to_string(_longitude);
-     
-        apiURL += parser->timeZone() ? *parser->timeZone() : "00000";
 
-        parser->reset();
+        uint32_t currentTime;
+        JSONPathFilter timeFilter {
+            { "$.timestamp", &currentTime },
+        };
 
-        failed = true;
-
-        for (int i = 0; i < 5; ++i) {
-            if (client.fetch(apiURL.c_str()) && parser->currentTime()) {
-                _currentTime = *parser->currentTime();
-                failed = false;
-                break;
-            } else {
-                System::logW(TAG, "Failed to get time data, retrying...");
-            }
+        failed = !fetchJSON(apiURL, timeFilter, "time");
+        if (!failed) {
+            _currentTime = currentTime;
         }
 
         System::logI(TAG, "Epoch: %u", (unsigned int) _currentTime);
@@ -220,21 +98,23 @@ TimeWeatherServer::update(const char* zipCode)
         apiURL += std::to_string(_longitude);
         apiURL +="&days=1";
 
-        parser->reset();
-        
-        failed = true;
-        
-        for (int i = 0; i < 5; ++i) {
-            if (client.fetch(apiURL.c_str()) && parser->currentTemp() && parser->lowTemp() && parser->highTemp() && parser->conditions()) {
-                _currentTemp = *parser->currentTemp();
-                _lowTemp = *parser->lowTemp();
-                _highTemp = *parser->highTemp();
-                _conditions = *parser->conditions();
-                failed = false;
-                break;
-            } else {
-                System::logW(TAG, "Failed to get weather data, retrying...");
-            }
+        float currentTemp;
+        float lowTemp;
+        float highTemp;
+        std::string conditions;
+        JSONPathFilter weatherFilter {
+            { "$.current.temp_f", &currentTemp },
+            { "$.current.condition.text", &conditions },
+            { "$.forecast.forecastday[0].day.maxtemp_f", &highTemp },
+            { "$.forecast.forecastday[0].day.mintemp_f", &lowTemp },
+        };
+
+        failed = !fetchJSON(apiURL, weatherFilter, "weather");
+        if (!failed) {
+            _conditions = std::move(conditions);
+            _currentTemp = int32_t(currentTemp + 0.5);
+            _lowTemp = int32_t(lowTemp + 0.5);
+            _highTemp = int32_t(highTemp + 0.5);
         }
         System::logI(TAG, "Weather: conditions='%s', curTemp=%d, loTemp=%d, hiTemp=%d", _conditions.c_str(), int(_currentTemp), int(_lowTemp), int(_highTemp));
     }
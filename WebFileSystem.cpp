@@ -51,6 +51,7 @@ const
 #endif
 
 std::string WebFileSystem::_cwd = "/";
+FileCache WebFileSystem::_cache;
 static const char* TAG = "WebFileSystem";
 
 // If return is true path has path to use and the file or dir exists
@@ -70,16 +71,55 @@ WebFileSystem::prepareFile(WiFiPortal* p, std::string& path)
     return true;
 }
 
+// Send one of the pages compiled into the image, or a 304 if the browser
+// already has it. The pages only change with the firmware, so the ETag is a
+// hash of the content
+static void sendEmbeddedPage(WiFiPortal* portal, const unsigned char* data, size_t length, const std::string& etag)
+{
+    portal->addHTTPResponseHeader("ETag", etag.c_str());
+    if (HTTPParser::notModified(portal->getHTTPHeader("If-None-Match"), "", etag, "")) {
+        portal->sendHTTPResponse(304, "text/html", "");
+        return;
+    }
+    portal->sendHTTPResponse(200, "text/html", reinterpret_cast<const char*>(data), length, HTML_IS_GZIP);
+}
+
 void
 WebFileSystem::sendLandingPage(WiFiPortal* portal)
 {
-    portal->sendHTTPResponse(200, "text/html", reinterpret_cast<const char*>(LANDING_NAME), LANDING_LEN_NAME, HTML_IS_GZIP);
+    static const std::string etag = HTTPParser::makeETag(LANDING_NAME, LANDING_LEN_NAME);
+    sendEmbeddedPage(portal, LANDING_NAME, LANDING_LEN_NAME, etag);
 }
 
 void
 WebFileSystem::sendWiFiPage(WiFiPortal* portal)
 {
-    portal->sendHTTPResponse(200, "text/html", reinterpret_cast<const char*>(WIFI_NAME), WIFI_LEN_NAME, HTML_IS_GZIP);
+    static const std::string etag = HTTPParser::makeETag(WIFI_NAME, WIFI_LEN_NAME);
+    sendEmbeddedPage(portal, WIFI_NAME, WIFI_LEN_NAME, etag);
+}
+
+bool
+WebFileSystem::sendCachedFile(WiFiPortal::Request& request, WiFiPortal::Response& response, const char* path, const char* mimetype)
+{
+    if (!request.header("Range").empty()) {
+        return false;
+    }
+    
+    std::shared_ptr<const FileCache::Entry> entry = getCachedFile(path);
+    if (!entry) {
+        return false;
+    }
+    
+    response.addHeader("ETag", entry->etag.c_str());
+    if (!entry->lastModified.empty()) {
+        response.addHeader("Last-Modified", entry->lastModified.c_str());
+    }
+    if (HTTPParser::notModified(request.header("If-None-Match"), request.header("If-Modified-Since"), entry->etag, entry->lastModified)) {
+        response.send(304, mimetype, "");
+    } else {
+        response.send(200, mimetype, entry->data.data(), entry->data.size(), false);
+    }
+    return true;
 }
 
 static std::string makeRedirectPage(const char* text)
@@ -110,6 +150,21 @@ static std::string makeUIPanelPage(const std::string& panelName)
     return s;
 }
 
+// Value of name in a message of the form "<name>=<value>&...", still encoded
+static std::string_view messageArg(std::string_view message, std::string_view name)
+{
+    while (!message.empty()) {
+        size_t end = message.find('&');
+        std::string_view pair = message.substr(0, end);
+        message = (end == std::string_view::npos) ? std::string_view() : message.substr(end + 1);
+        
+        if (pair.size() > name.size() && pair[name.size()] == '=' && pair.substr(0, name.size()) == name) {
+            return pair.substr(name.size() + 1);
+        }
+    }
+    return std::string_view();
+}
+
 bool
 WebFileSystem::begin(Application* app, bool format)
 {
@@ -117,6 +172,16 @@ WebFileSystem::begin(Application* app, bool format)
     if (!retval) {
         System::logE(TAG, "***** error mounting littlefs");
     }
+    
+    // Have browsers revalidate pages and files on every load. With ETags
+    // that costs a 304 unless something changed. Use setCacheControl with a
+    // longer uri to let assets that rarely change be cached outright
+    app->setCacheControl("/", "no-cache");
+    
+    // These share state in WebFileSystem, so with worker threads only one
+    // request for each can run at a time
+    app->setRouteConcurrency("/uipanel", 1);
+    app->setRouteConcurrency("/upload", 1);
 
     app->addHTTPHandler("/", WiFiPortal::HTTPMethod::Get, [this](WiFiPortal* p)
     {
@@ -153,7 +218,7 @@ WebFileSystem::begin(Application* app, bool format)
         p->sendHTTPResponse(204, "text/plain", "No Content");
     });
     
-    app->addHTTPHandler("/uipanel", [this](WiFiPortal* p)
+    auto uipanelHandler = [this](WiFiPortal* p)
     {
         std::string op = p->getHTTPArg("op");
         std::string name = p->getHTTPArg("name");
@@ -192,6 +257,7 @@ WebFileSystem::begin(Application* app, bool format)
             }
 
             LuaManager::sendEvent(_currentLuaUICommand, { widget, value });
+            p->broadcastWebSocketMessage("/uipanel/ws", "widget=" + HTTPParser::urlEncode(widget) + "&value=" + HTTPParser::urlEncode(value));
             p->sendHTTPResponse(200, "text/plain", "OK");
         } else if (op == "widgetValues") {
             std::string sizeString = p->getHTTPHeader("Content-Length");
@@ -203,9 +269,16 @@ WebFileSystem::begin(Application* app, bool format)
     
                 int actualSize = p->receiveHTTPResponse(buf, size);
                 buf[actualSize] = '\0';
-                
-                // Save the JSON widget values
+
+                // Save the JSON widget values, as long as they're a whole
+                // object. A cut off post shouldn't replace the ones saved
                 std::string filename = std::string("/sys/ui/") + name + ".widgetValues.json";
+                JSONDocument doc;
+                if (!doc.parse(buf, actualSize) || !doc.root().isObject()) {
+                    System::logE(TAG, "Invalid widget values for '%s': %s", name.c_str(), doc.errorString().c_str());
+                    delete [ ] buf;
+                    return false;
+                }
                 fs::File file = open(filename.c_str(), "w");
                 if (!file) {
                     System::logI(TAG, "Can't open file '%s' for write", filename.c_str());
@@ -220,25 +293,53 @@ WebFileSystem::begin(Application* app, bool format)
             p->sendHTTPResponse(400, "text/plain", "Bad Request");
         }
         return true;
+    };
+    
+    // The widgetValues op is a POST, the others are GETs
+    app->addHTTPHandler("/uipanel", uipanelHandler);
+    app->addHTTPHandler("/uipanel", WiFiPortal::HTTPMethod::Post, uipanelHandler);
+    
+    // The panel sends widget changes over a WebSocket, as messages of the
+    // form "name=<panel name>&widget=<widget>&value=<value>". Dragging a
+    // color picker sends dozens a second, which would each be an HTTP
+    // request otherwise. A change is passed on to any other browsers
+    // showing the panel, and so are widgets set by the Lua program
+    app->addWebSocketHandler("/uipanel/ws", [this, app](uint32_t client, WiFiPortal::WebSocketEvent event, std::string_view message)
+    {
+        if (event != WiFiPortal::WebSocketEvent::Message) {
+            return;
+        }
+        
+        int8_t command = _currentLuaUICommand;
+        if (command == -1) {
+            System::logW(TAG, "No Lua uipanel command running");
+        } else {
+            std::string widget = HTTPParser::urlDecode(std::string(messageArg(message, "widget")));
+            std::string value = HTTPParser::urlDecode(std::string(messageArg(message, "value")));
+            LuaManager::sendEvent(command, { widget, value });
+        }
+        app->broadcastWebSocketMessage("/uipanel/ws", message, client);
+    });
+    
+    LuaManager::setWidgetHandler([app](const LuaManager::Event& event)
+    {
+        std::string message = "widget=" + HTTPParser::urlEncode(event.first) + "&value=" + HTTPParser::urlEncode(event.second);
+        app->broadcastWebSocketMessage("/uipanel/ws", message);
     });
 
     app->addHTTPHandler("/filemgr", [this](WiFiPortal* p)
     {
-        p->sendHTTPResponse(200, "text/html", reinterpret_cast<const char*>(FILEMGR_NAME), FILEMGR_LEN_NAME, HTML_IS_GZIP);
+        static const std::string etag = HTTPParser::makeETag(FILEMGR_NAME, FILEMGR_LEN_NAME);
+        sendEmbeddedPage(p, FILEMGR_NAME, FILEMGR_LEN_NAME, etag);
         return true;
     });
 
-    app->addHTTPHandler("/get-folder-contents", [this](WiFiPortal* p)
+    app->addHTTPHandler("/get-folder-contents", WiFiPortal::HTTPMethod::Get, [this](WiFiPortal::Request& request, WiFiPortal::Response& response)
     {
-        std::string s = "0,";
-        s += std::to_string(totalBytes()) + "," + std::to_string(usedBytes());
-        std::string dir = listDir(HTTPParser::urlDecode(p->getHTTPArg("path")).c_str(), 0);
-        if (!dir.empty()) {
-            s += ":";
-            s += dir;
-        }
-        p->sendHTTPResponse(200, "text/html", s.c_str());
-        return true;
+        // Large directories are sent as they're read
+        WiFiPortal::ResponseWriter writer(response, 200, "text/html");
+        writer.write("0," + std::to_string(totalBytes()) + "," + std::to_string(usedBytes()));
+        listDir(HTTPParser::urlDecode(request.arg("path")).c_str(), 0, writer);
     });
 
     app->addHTTPHandler("/newfolder", [this](WiFiPortal* p)
@@ -300,13 +401,13 @@ WebFileSystem::begin(Application* app, bool format)
         std::string path;
         if (prepareFile(p, path)) {
             fs::File file = open(path.c_str(), "r");
-            std::string mime = HTTPParser::suffixToMimeType(path);
-            System::logI(TAG, "File: path='%s', mime-type='%s'", path.c_str(), mime.c_str());
+            const char* mime = HTTPParser::suffixToMimeType(path);
+            System::logI(TAG, "File: path='%s', mime-type='%s'", path.c_str(), mime);
                 
-            if (mime.empty()) {
+            if (mime[0] == '\0') {
                 p->sendHTTPResponse(404, "text/html", "<center><h1>File cannot be displayed</h1><h2>Use Download</h2></center>");
             } else {
-                p->streamHTTPResponse(file, mime.c_str(), false);
+                p->streamHTTPResponse(file, mime, false);
             }
         }
         return true;
@@ -358,13 +459,19 @@ WebFileSystem::exists(const char* path)
 bool
 WebFileSystem::remove(const char* path)
 {
-    return LittleFS.remove(realPath(path).c_str());
+    std::string p = realPath(path);
+    _cache.invalidate(p);
+    return LittleFS.remove(p.c_str());
 }
 
 bool
 WebFileSystem::rename(const char* fromPath, const char* toPath)
 {
-    return LittleFS.rename(realPath(fromPath).c_str(), realPath(toPath).c_str());
+    std::string from = realPath(fromPath);
+    std::string to = realPath(toPath);
+    _cache.invalidate(from);
+    _cache.invalidate(to);
+    return LittleFS.rename(from.c_str(), to.c_str());
 }
 
 bool
@@ -379,26 +486,22 @@ WebFileSystem::rmdir(const char* path)
     return LittleFS.rmdir(realPath(path).c_str());
 }
 
-std::string
-WebFileSystem::listDir(const char* dirname, uint8_t levels)
+void
+WebFileSystem::listDir(const char* dirname, uint8_t levels, WiFiPortal::ResponseWriter& writer)
 {
-    std::string s;
-    
     // First see if it's a directory
     fs::File root = open(dirname);
     if (!root){
         System::logE(TAG, "Failed to open directory\n");
-        return "";
+        return;
     }
     
     if (!root.isDirectory()){
         printf("Not a directory\n");
         root.close();
-        return "";
+        return;
     }
     
-    bool first_files = true;
-    
     while (true) {
         fs::File f = root.openNextFile();
         std::string path = f.name();
@@ -406,23 +509,233 @@ WebFileSystem::listDir(const char* dirname, uint8_t levels)
             break;
         }
 
-        if (first_files)
-            first_files = false;
-        else 
-            s += ":";
-
         if (f.isDirectory()) {
-            s += "1,";
-            s += path;
+            writer.write(":1,");
+            writer.write(path);
         } else {
-            s += "0,";
-            s += path;
-            s += ",";
-            s += std::to_string(f.size());
+            writer.write(":0,");
+            writer.write(path);
+            writer.write(",");
+            writer.write(std::to_string(f.size()));
         }
     }
+}
+
+bool
+UploadWriter::begin(fs::File&& file)
+{
+    finish();
+    
+    _file = std::move(file);
+    if (!_file) {
+        return false;
+    }
     
-    return s;
+    for (auto& it : _buffers) {
+        it.resize(BufferSize);
+    }
+    _fillIndex = 0;
+    _fillSize = 0;
+    _writeSize = 0;
+    _done = false;
+    _error = false;
+    
+    _thread = std::thread([this]() { run(); });
+    return true;
+}
+
+bool
+UploadWriter::write(const uint8_t* buf, size_t size)
+{
+    while (size > 0) {
+        size_t sizeToCopy = std::min(size, BufferSize - _fillSize);
+        memcpy(_buffers[_fillIndex].data() + _fillSize, buf, sizeToCopy);
+        _fillSize += sizeToCopy;
+        buf += sizeToCopy;
+        size -= sizeToCopy;
+        
+        if (_fillSize == BufferSize && !submit()) {
+            return false;
+        }
+    }
+    
+    std::unique_lock<std::mutex> lk(_mutex);
+    return !_error;
+}
+
+bool
+UploadWriter::submit()
+{
+    // Wait for the writer thread to finish with the other buffer, then
+    // hand it this one
+    std::unique_lock<std::mutex> lk(_mutex);
+    _cond.wait(lk, [this]() { return _writeSize == 0; });
+    if (_error) {
+        return false;
+    }
+    
+    _writeSize = _fillSize;
+    _fillIndex ^= 1;
+    _fillSize = 0;
+    _cond.notify_all();
+    return true;
+}
+
+void
+UploadWriter::run()
+{
+    std::unique_lock<std::mutex> lk(_mutex);
+    
+    while (true) {
+        _cond.wait(lk, [this]() { return _writeSize != 0 || _done; });
+        if (_writeSize == 0) {
+            break;
+        }
+        
+        // The buffer being written is the one not being filled
+        const uint8_t* buf = _buffers[_fillIndex ^ 1].data();
+        size_t size = _writeSize;
+        
+        lk.unlock();
+        bool success = _file.write(buf, size) == int(size) && _file;
+        lk.lock();
+        
+        if (!success) {
+            _error = true;
+        }
+        _writeSize = 0;
+        _cond.notify_all();
+    }
+}
+
+bool
+UploadWriter::finish()
+{
+    if (!_thread.joinable()) {
+        return !_error;
+    }
+    
+    if (_fillSize > 0) {
+        submit();
+    }
+    
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        _done = true;
+        _cond.notify_all();
+    }
+    _thread.join();
+    
+    _file.close();
+    
+    // Don't hold onto the buffers between uploads
+    for (auto& it : _buffers) {
+        std::vector<uint8_t>().swap(it);
+    }
+    return !_error;
+}
+
+void
+FileCache::setBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _budget = bytes;
+    trim();
+}
+
+std::shared_ptr<const FileCache::Entry>
+FileCache::get(const std::string& realPath)
+{
+    uint32_t generation;
+    size_t maxFileSize;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        
+        // The cache is off
+        if (_budget == 0) {
+            return nullptr;
+        }
+        
+        auto it = _entries.find(realPath);
+        if (it != _entries.end()) {
+            _lru.splice(_lru.begin(), _lru, it->second);
+            _stats.hits++;
+            return it->second->second;
+        }
+        _stats.misses++;
+        generation = _generation;
+        maxFileSize = _budget / 4;
+    }
+    
+    // Read the file without holding the lock
+    fs::File file = LittleFS.open(realPath.c_str(), "r");
+    if (!file || file.isDirectory() || file.size() > maxFileSize) {
+        return nullptr;
+    }
+    
+    auto entry = std::make_shared<Entry>();
+    entry->data.resize(file.size());
+    if (file.read(reinterpret_cast<uint8_t*>(entry->data.data()), entry->data.size()) != int(entry->data.size())) {
+        return nullptr;
+    }
+    
+    time_t lastWrite = file.getLastWrite();
+    if (lastWrite) {
+        entry->etag = HTTPParser::makeETag(entry->data.size(), lastWrite);
+        entry->lastModified = HTTPParser::httpDate(lastWrite);
+    } else {
+        entry->etag = HTTPParser::makeETag(entry->data.data(), entry->data.size());
+    }
+    
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (generation == _generation && _entries.find(realPath) == _entries.end()) {
+        _lru.emplace_front(realPath, entry);
+        _entries[realPath] = _lru.begin();
+        _stats.size += entry->data.size();
+        trim();
+    }
+    return entry;
+}
+
+void
+FileCache::invalidate(const std::string& realPath)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _generation++;
+    auto it = _entries.find(realPath);
+    if (it != _entries.end()) {
+        _stats.size -= it->second->second->data.size();
+        _lru.erase(it->second);
+        _entries.erase(it);
+    }
+}
+
+void
+FileCache::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _generation++;
+    _lru.clear();
+    _entries.clear();
+    _stats.size = 0;
+}
+
+FileCache::Stats
+FileCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+void
+FileCache::trim()
+{
+    while (_stats.size > _budget && !_lru.empty()) {
+        _stats.size -= _lru.back().second->data.size();
+        _stats.evictions++;
+        _entries.erase(_lru.back().first);
+        _lru.pop_back();
+    }
 }
 
 void
@@ -435,35 +748,40 @@ WebFileSystem::handleUpload(WiFiPortal* p)
             _uploadFilename = HTTPParser::urlDecode(p->getHTTPArg("path")) + "/" + p->httpUploadFilename();
             _uploadAborted = false;
         
-            // Open file for writing
-            _uploadFile = open(_uploadFilename.c_str(), "w");
-            if (!_uploadFile) {
+            // Open file for writing. Data is written on the UploadWriter's thread
+            if (!_uploadWriter.begin(open(_uploadFilename.c_str(), "w"))) {
                 printf("Failed to open file for writing\n");
                 _uploadAborted = true;
             }
             break;
         case WiFiPortal::HTTPUploadStatus::Write:
             if (!_uploadAborted) {
-                // Write the received chunk to the file
-                if (_uploadFile) {
-                    size_t currentSize = p->httpUploadCurrentSize();
-                    size_t bytesWritten = _uploadFile.write(p->httpUploadBuffer(), currentSize);
+                // Queue the received chunk. This only waits if the previous
+                // chunk is still being written
+                if (!_uploadWriter.write(p->httpUploadBuffer(), p->httpUploadCurrentSize())) {
+                    printf("Error writing chunk to file. Deleting '%s'\n", _uploadFilename.c_str());
                     
-                    if (!_uploadFile || bytesWritten != currentSize) {
-                        printf("Error writing chunk to file. Deleting '%s'\n", _uploadFilename.c_str());
-                        
-                        // Delete the file
-                        _uploadFile.close();
-                        remove(_uploadFilename.c_str());
-                        _uploadAborted = true;
-                        return;
-                    }
+                    // Delete the file
+                    _uploadWriter.finish();
+                    remove(_uploadFilename.c_str());
+                    _uploadAborted = true;
+                    return;
                 }
             }
             break;
         case WiFiPortal::HTTPUploadStatus::End:
-            if (_uploadFile) {
-                _uploadFile.close();
+            if (!_uploadAborted) {
+                if (!_uploadWriter.finish()) {
+                    printf("Error writing end of file. Deleting '%s'\n", _uploadFilename.c_str());
+                    remove(_uploadFilename.c_str());
+                    _uploadAborted = true;
+                } else {
+                    printf("Uploaded %d bytes at %d bytes/sec\n", int(p->httpUploadTotalSize()), int(p->httpUploadRate()));
+                }
+                
+                // The file was being written since Start, so drop anything
+                // cached from it in the meantime
+                _cache.invalidate(realPath(_uploadFilename.c_str()));
             } else {
                 printf("handleUpload: END received but file not open.\n");
             }
@@ -471,11 +789,10 @@ WebFileSystem::handleUpload(WiFiPortal* p)
             break;
         case WiFiPortal::HTTPUploadStatus::Aborted:
             printf("handleUpload: Upload Aborted\n");
-            if (_uploadFile) {
+            if (!_uploadAborted) {
                // Delete the file
-                std::string filename = _uploadFile.name();
-                _uploadFile.close();
-                remove(filename.c_str());
+                _uploadWriter.finish();
+                remove(_uploadFilename.c_str());
             }
             _uploadAborted = true;
             finished = true;
@@ -519,6 +836,22 @@ WebFileSystem::makeJSON(const KeyValues& json)
     return s;
 }
 
+void
+WebFileSystem::writeJSON(WiFiPortal::ResponseWriter& writer, const KeyValues& json)
+{
+    writer.write("{");
+    bool first = true;
+    for (const auto& it : json) {
+        if (first) {
+            first = false;
+        } else {
+            writer.write(",");
+        }
+        writer.write(jsonParam(it.first, it.second));
+    }
+    writer.write("}");
+}
+
 void
 WebFileSystem::handleLandingSetup(WiFiPortal* portal)
 {
@@ -537,7 +870,8 @@ WebFileSystem::handleLandingSetup(WiFiPortal* portal)
         customMenu += "</form><br/>";
     }
     
-    std::string response = makeJSON(
+    WiFiPortal::ResponseWriter writer(*portal->currentResponse(), 200, "application/json");
+    writeJSON(writer,
         {
             { "title", portal->getTitle() },
             { "ssid", portal->getSSID() },
@@ -556,7 +890,6 @@ WebFileSystem::handleLandingSetup(WiFiPortal* portal)
             { "customInfoHTML", portal->getCustomInfoHTML() }
         }
     );
-    portal->sendHTTPResponse(200, "application/json", response.c_str(), response.length(), false);
 }
 
 void
@@ -566,8 +899,9 @@ WebFileSystem::handleWiFiSetup(WiFiPortal* portal)
     portal->getNVSParam("wifi_ssid", ssid);
     portal->getNVSParam("hostname", hostname);
 
-    std::string response = "{" + jsonParam("ssid", ssid) + "," + jsonParam("hostname", hostname) + ",";
-    response += quote("knownNetworks") + ":[";
+    WiFiPortal::ResponseWriter writer(*portal->currentResponse(), 200, "application/json");
+    writer.write("{" + jsonParam("ssid", ssid) + "," + jsonParam("hostname", hostname) + ",");
+    writer.write(quote("knownNetworks") + ":[");
 
     const std::vector<WiFiPortal::KnownNetwork>* knownNetworks = portal->getKnownNetworks();
     
@@ -576,23 +910,21 @@ WebFileSystem::handleWiFiSetup(WiFiPortal* portal)
         
         for (const auto& it : *knownNetworks) {
             if (!first) {
-                response += ",";
+                writer.write(",");
             } else {
                 first = false;
             }
             
-            response += "{" + jsonParam("ssid", it.ssid) + ",";
-            response += jsonParam("rssi", std::to_string(it.rssi)) + ",";
-            response += jsonParam("open", std::string(it.open ? "true" : "false")) + "}";
+            writer.write("{" + jsonParam("ssid", it.ssid) + ",");
+            writer.write(jsonParam("rssi", std::to_string(it.rssi)) + ",");
+            writer.write(jsonParam("open", std::string(it.open ? "true" : "false")) + "}");
         }
     }
     
-    response += "],";
-    response += quote("customTextForms") + ":";
-    response += portal->getCustomTextForms();
-    response += "}";
-
-    portal->sendHTTPResponse(200, "application/json", response.c_str(), response.length(), false);
+    writer.write("],");
+    writer.write(quote("customTextForms") + ":");
+    portal->writeCustomTextForms(writer);
+    writer.write("}");
 }
 
 void
@@ -653,7 +985,13 @@ WebFileSystem::handleConnect(WiFiPortal* portal)
 fs::File
 WebFileSystem::open(const char* path, const char* mode, bool create)
 {
-    return LittleFS.open(realPath(path).c_str(), mode);
+    std::string p = realPath(path);
+    
+    // Any mode other than "r" can change the file
+    if (strcmp(mode, "r") != 0) {
+        _cache.invalidate(p);
+    }
+    return LittleFS.open(p.c_str(), mode);
 }
 
 std::string
@@ -15,6 +15,17 @@ All rights reserved.
 #include "LittleFSShim.h"
 #endif
 
+#include "WiFiPortal.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 // Web based filesystem. It can be integrated with WebServer
 // so HTTP requests can be made to upload files, read existing
 // files, create directories, delete files and directories and do
@@ -23,7 +34,108 @@ All rights reserved.
 namespace mil {
 
 class Application;
-class WiFiPortal;
+
+// Writes uploaded data to a file on its own thread. Data is copied into
+// one buffer while the other one is being written, so receiving from the
+// network and writing to flash overlap. If the writes fall behind, write()
+// waits for the other buffer to free up, which slows the sender down
+// through TCP flow control.
+
+class UploadWriter
+{
+  public:
+    static constexpr size_t BufferSize = 8192;
+    
+    ~UploadWriter() { finish(); }
+    
+    // Takes ownership of the file. Returns false if it's not open
+    bool begin(fs::File&& file);
+    
+    // Returns false if an earlier write to the file failed
+    bool write(const uint8_t* buf, size_t size);
+    
+    // Write any remaining data, wait for it and close the file. Returns
+    // false if any write failed
+    bool finish();
+
+  private:
+    bool submit();
+    void run();
+    
+    fs::File _file;
+    std::vector<uint8_t> _buffers[2];
+    uint8_t _fillIndex = 0;
+    size_t _fillSize = 0;
+    
+    // Size of the buffer the writer thread is working on, 0 when idle
+    size_t _writeSize = 0;
+    bool _done = false;
+    bool _error = false;
+    
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+};
+
+// Keeps the contents of small files that are read often (the UI panel
+// css, js and json files) in memory so they don't have to be read from
+// flash on every request. Entries are keyed by real path. When the total
+// size goes over the budget the least recently used entries are dropped.
+// WebFileSystem invalidates an entry whenever its file is opened for
+// writing, removed or renamed.
+
+class FileCache
+{
+  public:
+    static constexpr size_t DefaultBudget = 32 * 1024;
+    
+    struct Entry
+    {
+        std::string data;
+        std::string etag;
+        std::string lastModified;
+    };
+    
+    struct Stats
+    {
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+        uint32_t evictions = 0;
+        size_t size = 0;
+    };
+    
+    // A budget of 0 disables the cache. Files bigger than a quarter of the
+    // budget are never cached so one file can't push out everything else
+    void setBudget(size_t bytes);
+    size_t budget() const { return _budget; }
+    
+    // Returns the contents of the file, reading and caching it on a miss.
+    // Returns null if the file can't be opened or is too big to cache
+    std::shared_ptr<const Entry> get(const std::string& realPath);
+    
+    void invalidate(const std::string& realPath);
+    void clear();
+    
+    Stats stats() const;
+
+  private:
+    using LRUList = std::list<std::pair<std::string, std::shared_ptr<const Entry>>>;
+    
+    // Drop least recently used entries until the size fits. Call with the mutex held
+    void trim();
+    
+    // Most recently used entry is at the front
+    LRUList _lru;
+    std::unordered_map<std::string, LRUList::iterator> _entries;
+    size_t _budget = DefaultBudget;
+    Stats _stats;
+    
+    // Bumped on every invalidation so a file that changes while it's being
+    // read isn't added to the cache
+    uint32_t _generation = 0;
+    
+    mutable std::mutex _mutex;
+};
 
 class WebFileSystem
 {
@@ -44,6 +156,11 @@ class WebFileSystem
     static bool rmdir(const char* path);
 
     static std::string realPath(const char* path);
+    
+    // Contents of the file from the cache, or null if it can't be cached
+    static std::shared_ptr<const FileCache::Entry> getCachedFile(const char* path) { return _cache.get(realPath(path)); }
+    static FileCache& cache() { return _cache; }
+
     static void setCWD(const char* cwd) { _cwd = cwd; }
     
     static std::string lexicallyNormal(const std::string& path);
@@ -51,30 +168,40 @@ class WebFileSystem
     
     void sendLandingPage(WiFiPortal*);
     void sendWiFiPage(WiFiPortal*);
+    
+    // Send a file from the cache, or a 304 if the client's copy is current.
+    // Returns false if the file can't be cached or a range was asked for.
+    // The caller should stream the file in that case
+    bool sendCachedFile(WiFiPortal::Request&, WiFiPortal::Response&, const char* path, const char* mimetype);
 
     static inline std::string quote(const std::string& s) { return "\"" + s + "\""; }
     static inline std::string jsonParam(const std::string& n, const std::string& v) { return quote(n) + ":" + quote(v); }
     static std::string makeJSON(const KeyValues& json);
+    static void writeJSON(WiFiPortal::ResponseWriter&, const KeyValues& json);
     
     // Deserialize a subset of JSON that contains a single object of key/value strings
     static void deserializeKeyValuePairs(KeyValues& v, const std::string& s);
     
   private:
     bool prepareFile(WiFiPortal* p, std::string& path);
-    std::string listDir(const char* dirname, uint8_t levels);
+    
+    // Write each entry in dirname preceded by ':'
+    void listDir(const char* dirname, uint8_t levels, WiFiPortal::ResponseWriter&);
     
     void handleUpload(WiFiPortal*);
     void handleLandingSetup(WiFiPortal*);
     void handleWiFiSetup(WiFiPortal*);
     void handleConnect(WiFiPortal*);
 
-    fs::File _uploadFile;
+    UploadWriter _uploadWriter;
     bool _uploadAborted = false;
     std::string _uploadFilename;
     
     static std::string _cwd;
+    static FileCache _cache;
     
-    int8_t _currentLuaUICommand = -1;
+    // Widget changes come in on the web server's thread, the panel is started from a handler
+    std::atomic<int8_t> _currentLuaUICommand = -1;
 };
 
 }
@@ -12,6 +12,7 @@ All rights reserved.
 #include "System.h"
 
 #include <map>
+#include <string_view>
 
 // WiFiPortal is a generic class for handling connecting to WiFi. If
 // there are saved WiFi credentials an attempt will be made to connect
@@ -53,9 +54,125 @@ class WiFiPortal
 public:
     enum class HTTPUploadStatus { None, Start, Write, End, Aborted };
     enum class HTTPMethod { Get, Post, Put };
+    enum class WebSocketEvent { Connect, Message, Disconnect };
 
     using HandlerCB = std::function<void(WiFiPortal*)>;
 
+    // The request being handled and its response. Handlers added with a
+    // RequestHandlerCB get both as arguments, so they don't depend on the
+    // portal having a single current request and more than one request can
+    // be in flight. They are only valid until the handler returns.
+    class Request
+    {
+      public:
+        virtual ~Request() { }
+        
+        // Path part of the uri, without the query
+        virtual std::string path() const = 0;
+        
+        virtual std::string arg(const char* name) const = 0;
+        virtual std::string header(const char* name) const = 0;
+        
+        // Add values to the arg list, for instance from a form-data response
+        virtual void parseQuery(const char* queryString) = 0;
+        
+        // State of a multipart upload. The handler is called for each part
+        virtual HTTPUploadStatus uploadStatus() const = 0;
+        virtual std::string uploadFilename() const = 0;
+        virtual size_t uploadTotalSize() const = 0;
+        virtual size_t uploadCurrentSize() const = 0;
+        virtual const uint8_t* uploadBuffer() const = 0;
+        virtual uint32_t uploadRate() const = 0;
+        
+        // Read the body of a non-multipart POST
+        virtual int read(char* buf, size_t size) = 0;
+    };
+    
+    class Response
+    {
+      public:
+        virtual ~Response() { }
+        
+        // Add a header to the next response sent
+        virtual void addHeader(const char* name, const char* value) = 0;
+        
+        void send(int code, const char* mimetype = nullptr, const char* data = "") { send(code, mimetype, data, strlen(data), false); }
+        virtual void send(int code, const char* mimetype, const char* data, size_t length, bool gzip) = 0;
+        virtual void stream(fs::File& file, const char* mimetype, bool attach) = 0;
+        
+        // Send a response whose length isn't known up front, using
+        // Transfer-Encoding: chunked. Call beginChunked, then sendChunk for
+        // each part of the body. A zero length chunk ends the response.
+        // Usually used through a ResponseWriter
+        virtual void beginChunked(int code, const char* mimetype) = 0;
+        virtual void sendChunk(const char* data, size_t length) = 0;
+    };
+    
+    // Writes a response body a piece at a time. Writes are collected and
+    // sent as chunks of about ChunkSize bytes, so a large listing or JSON
+    // document never has to be in memory all at once. The response is
+    // ended when the writer is destroyed, if end() hasn't been called
+    class ResponseWriter
+    {
+      public:
+        static constexpr size_t ChunkSize = 1024;
+        
+        ResponseWriter(Response& response, int code, const char* mimetype)
+            : _response(response)
+        {
+            _buffer.reserve(ChunkSize);
+            _response.beginChunked(code, mimetype);
+        }
+        
+        ~ResponseWriter() { end(); }
+        
+        ResponseWriter& write(const char* data, size_t length)
+        {
+            if (_buffer.size() + length > ChunkSize) {
+                flush();
+                if (length >= ChunkSize) {
+                    // Big enough to go out on its own
+                    _response.sendChunk(data, length);
+                    return *this;
+                }
+            }
+            _buffer.append(data, length);
+            return *this;
+        }
+        
+        ResponseWriter& write(const char* s) { return write(s, strlen(s)); }
+        ResponseWriter& write(const std::string& s) { return write(s.data(), s.size()); }
+        
+        void flush()
+        {
+            if (!_buffer.empty()) {
+                _response.sendChunk(_buffer.data(), _buffer.size());
+                _buffer.clear();
+            }
+        }
+        
+        void end()
+        {
+            if (!_ended) {
+                flush();
+                _response.sendChunk(nullptr, 0);
+                _ended = true;
+            }
+        }
+        
+      private:
+        Response& _response;
+        std::string _buffer;
+        bool _ended = false;
+    };
+    
+    using RequestHandlerCB = std::function<void(Request&, Response&)>;
+    
+    // Called when a WebSocket client connects, for each message it sends and
+    // when it goes away. Clients are identified by a non-zero id. message is
+    // only valid until the callback returns
+    using WebSocketCB = std::function<void(uint32_t client, WebSocketEvent, std::string_view message)>;
+
     struct KnownNetwork
     {
         bool operator==(const KnownNetwork& other) const { return ssid == other.ssid; }
@@ -76,7 +193,14 @@ public:
     // Call the passed handler function when a request is made to the endpoint with the passed name.
     // Returns an id of the request for later use in deleting the request (not yet implemented).
     // The callback return true if it handled the request and false if not.
-    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod, HandlerCB requestCB) { return -1; }
+    virtual int32_t addHTTPHandler(const char* endpoint, HTTPMethod, RequestHandlerCB requestCB) { return -1; }
+    
+    // Handlers that take the portal use the request calls below, which work
+    // on the request the handler was called for
+    int32_t addHTTPHandler(const char* endpoint, HTTPMethod method, HandlerCB requestCB)
+    {
+        return addHTTPHandler(endpoint, method, [this, requestCB](Request&, Response&) { requestCB(this); });
+    }
     
     // Serve static pages. When an endpoint starting in uri is seen it responds with the file at
     // the passed path as its root.
@@ -104,31 +228,85 @@ public:
     // Get the SSID of the captive portal if in config mode. Otherwise get the SSID of the network currently connected to
     virtual const char* getSSID() { return "unknown"; }
     
+    // The request being handled by the calling thread and its response, or
+    // null outside of a handler. The request calls below use these
+    virtual Request* currentRequest() const { return nullptr; }
+    virtual Response* currentResponse() const { return nullptr; }
+    
     // Send a response to the requestor. The second form allows sending of binary data, possibly in GZIP format
-    virtual void sendHTTPResponse(int code, const char* mimetype = nullptr, const char* data = "") { }
-    virtual void sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip) { }
+    virtual void sendHTTPResponse(int code, const char* mimetype = nullptr, const char* data = "")
+    {
+        sendHTTPResponse(code, mimetype, data, strlen(data), false);
+    }
+    virtual void sendHTTPResponse(int code, const char* mimetype, const char* data, size_t length, bool gzip)
+    {
+        if (Response* r = currentResponse()) r->send(code, mimetype, data, length, gzip);
+    }
     
-    // Send a response with the contents of the passed File
-    virtual void streamHTTPResponse(fs::File& file, const char* mimetype, bool attach) { }
+    // Send a response with the contents of the passed File. Range and conditional
+    // (If-None-Match, If-Modified-Since) requests are handled using validators
+    // based on the file's size and modification time
+    virtual void streamHTTPResponse(fs::File& file, const char* mimetype, bool attach)
+    {
+        if (Response* r = currentResponse()) r->stream(file, mimetype, attach);
+    }
+    
+    // Add a header to the next response sent for the current request
+    virtual void addHTTPResponseHeader(const char* name, const char* value)
+    {
+        if (Response* r = currentResponse()) r->addHeader(name, value);
+    }
+    
+    // Set the Cache-Control sent with successful and 304 responses to requests
+    // under the passed uri. The longest matching uri wins
+    virtual void setCacheControl(const char* uri, const char* value) { }
+    
+    // Run handlers on a pool of count threads with up to maxQueued requests
+    // waiting. Requests that don't fit get a 503. setRouteConcurrency limits
+    // how many requests for an endpoint run at once, use 1 for handlers that
+    // aren't thread safe. Only the Mac server has a worker pool
+    virtual void setWorkerThreads(uint8_t count, uint16_t maxQueued) { }
+    virtual void setRouteConcurrency(const char* endpoint, uint8_t max) { }
+    
+    // Accept WebSocket (RFC 6455) connections at endpoint. Each message is
+    // a single small frame rather than a whole HTTP request, for things like
+    // UI events which come in quick succession. Callbacks run on the web
+    // server's thread, so they should be quick. Messages are sent as text
+    // and can be sent from any thread. A broadcast goes to every client of
+    // the endpoint except the one passed, usually the one that sent the
+    // message being passed on
+    virtual void addWebSocketHandler(const char* endpoint, WebSocketCB cb) { }
+    virtual void sendWebSocketMessage(uint32_t client, std::string_view message) { }
+    virtual void broadcastWebSocketMessage(const char* endpoint, std::string_view message, uint32_t except = 0) { }
+    
+    // Serve the EventLog (log lines, Lua print output and metrics) at
+    // endpoint as Server-Sent Events. Each client follows the log on its
+    // own. One that can't keep up is sent a dropped event with the count
+    // of events it missed rather than slowing anything down
+    virtual void addEventStreamHandler(const char* endpoint) { }
     
     // These methods get values for the current upload. Must be called inside a HandlerCB
-    virtual HTTPUploadStatus httpUploadStatus() const { return HTTPUploadStatus::None; }
-    virtual std::string httpUploadFilename() const { return ""; }
-    virtual size_t httpUploadTotalSize() const { return 0; }
-    virtual size_t httpUploadCurrentSize() const { return 0; }
-    virtual const uint8_t* httpUploadBuffer() const { return nullptr; }
+    virtual HTTPUploadStatus httpUploadStatus() const { Request* r = currentRequest(); return r ? r->uploadStatus() : HTTPUploadStatus::None; }
+    virtual std::string httpUploadFilename() const { Request* r = currentRequest(); return r ? r->uploadFilename() : ""; }
+    virtual size_t httpUploadTotalSize() const { Request* r = currentRequest(); return r ? r->uploadTotalSize() : 0; }
+    virtual size_t httpUploadCurrentSize() const { Request* r = currentRequest(); return r ? r->uploadCurrentSize() : 0; }
+    virtual const uint8_t* httpUploadBuffer() const { Request* r = currentRequest(); return r ? r->uploadBuffer() : nullptr; }
+    
+    // Bytes per second received since the upload started. Called at End,
+    // after the handler has finished writing, it is the end to end rate
+    virtual uint32_t httpUploadRate() const { Request* r = currentRequest(); return r ? r->uploadRate() : 0; }
     
     // This method receives data from an open response. It's used for non-multipart POST
-    virtual int receiveHTTPResponse(char* buf, size_t size) { return 0; }
+    virtual int receiveHTTPResponse(char* buf, size_t size) { Request* r = currentRequest(); return r ? r->read(buf, size) : 0; }
 
     // Extract the value for the passed name from the passed uri. Arguments start after the first '?' and are of the form
     // <name>=<value>. Args are separated with '&'.
-    virtual std::string getHTTPArg(const char* name) { return ""; }
+    virtual std::string getHTTPArg(const char* name) { Request* r = currentRequest(); return r ? r->arg(name) : ""; }
     
     // Add values to the arg list, for instance from a form-data response
-    virtual void parseQuery(const char* queryString) { }
+    virtual void parseQuery(const char* queryString) { if (Request* r = currentRequest()) r->parseQuery(queryString); }
 
-    virtual std::string getHTTPHeader(const char* name) { return ""; }
+    virtual std::string getHTTPHeader(const char* name) { Request* r = currentRequest(); return r ? r->header(name) : ""; }
 
     virtual void otaUpdate() { }
 
@@ -165,21 +343,27 @@ public:
             } else {
                 first = false;
             }
-            
-            // Get current value
-            std::string value;
-            getNVSParam(it.first.c_str(), value);
-        
-            forms += "{ \"id\" : \"" + it.first + 
-                     "\", \"label\" : \"" + it.second.label + 
-                     "\", \"maxLength\" : \"" + std::to_string(it.second.maxLength) + 
-                     "\", \"value\" : \"" + value + 
-                     "\", \"defaultValue\" : \"" + it.second.defaultValue + 
-                     "\" }";
+            forms += customTextForm(it.first, it.second);
         }
         forms += " ]";
         return forms;
     }
+    
+    // Same as getCustomTextForms, one form at a time
+    void writeCustomTextForms(ResponseWriter& writer) const
+    {
+        writer.write("[ ");
+        bool first = true;
+        for (const auto& it : _paramMap) {
+            if (!first) {
+                writer.write(", ");
+            } else {
+                first = false;
+            }
+            writer.write(customTextForm(it.first, it.second));
+        }
+        writer.write(" ]");
+    }
 
     const std::string& getGateway() const { return _currentGW; }
     const std::string& getMask() const { return _currentMSK; }
@@ -193,6 +377,20 @@ public:
     // Param Map
     struct ParamMapValue { std::string label; uint32_t maxLength; std::string defaultValue; };
     std::map<std::string, ParamMapValue> _paramMap;
+    
+    std::string customTextForm(const std::string& id, const ParamMapValue& param) const
+    {
+        // Get current value
+        std::string value;
+        getNVSParam(id.c_str(), value);
+    
+        return "{ \"id\" : \"" + id + 
+               "\", \"label\" : \"" + param.label + 
+               "\", \"maxLength\" : \"" + std::to_string(param.maxLength) + 
+               "\", \"value\" : \"" + value + 
+               "\", \"defaultValue\" : \"" + param.defaultValue + 
+               "\" }";
+    }
 
   public:
     void addFormEntry(const char *id, const char* label, const char* defaultValue, uint32_t maxLength)
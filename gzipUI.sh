@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# Make gzip compressed copies of the web UI assets. When foo.js.gz is
+# uploaded next to foo.js the web server sends it to clients that accept
+# gzip. With no args, compress uipanel.js and uipanel.css. Compressed
+# copies that aren't smaller than the original are deleted.
+
+if [ $# -eq 0 ]; then
+    set -- uipanel.js uipanel.css
+fi
+
+for file in "$@"
+do
+    case $file in
+        *.gz) continue ;;
+    esac
+    gzip -9 -k -n -f $file
+    orig=$(wc -c < $file)
+    comp=$(wc -c < $file.gz)
+    if [ $comp -lt $orig ]; then
+        echo "$file: $orig -> $comp bytes"
+    else
+        echo "$file: not compressible, skipped"
+        rm $file.gz
+    fi
+done
@@ -34,8 +34,12 @@
 //      "label" - Label that appears on the widget
 //      "list"  - (only for "select") array of values in the select button
 
-// When a UI widget is changed a response is sent to the server with the query
-// parameters "op=change&name=<panel name>&args=<list of params>
+// When a UI widget is changed a message is sent to the server over a
+// WebSocket at /uipanel/ws of the form "name=<panel name>&widget=<widget>&value=<value>",
+// with the values URI encoded. If the WebSocket isn't open a request is sent
+// instead with the query parameters "op=change&name=<panel name>&widget=<widget>&value=<value>".
+// The server sends messages of the same form when a widget is changed by the
+// Lua program or another browser, and the widget is set to match.
 //
 // The list of params is sent as a comma separated list of values in the 
 // "params" array order of the currently selected UI. For color values
@@ -45,6 +49,12 @@
 // Return a string with the HTML for the widget
 
 let _widgetValues = null;
+let _socket = null;
+let _pendingMessages = [ ];
+let _uploadTimer = null;
+
+// How long to wait after the last change before saving the widget values
+const uploadDelay = 500;
 
 function makeWidget(panelName, widget)
 {
@@ -154,12 +164,7 @@ function updateUIPanel(jsonPath)
                 if (_widgetValues.effects.hasOwnProperty(_widgetValues.currentEffect)) {
                     const items = _widgetValues.effects[_widgetValues.currentEffect]
                     for (const key in items) {
-                        let widget = document.getElementById(key);
-                        if (widget.type == "checkbox") {
-                            widget.checked = items[key] == "true";
-                        } else {
-                            widget.value = items[key];
-                        }
+                        setWidgetValue(key, items[key]);
                         sendWidgetChange(uipanelName, key, items[key]);
                     }
                 }
@@ -167,22 +172,70 @@ function updateUIPanel(jsonPath)
         });
 }
 
-function sendWidgetChange(name, widget, value)
+function setWidgetValue(name, value)
 {
-    const uri = `/uipanel?op=change&name=${name}&widget=${widget}&value=${encodeURIComponent(value)}`;
-    const http = new XMLHttpRequest();
-    http.open("GET", uri, true);
-    http.onreadystatechange = function()
+    let widget = document.getElementById(name);
+    if (!widget) {
+        return;
+    }
+    if (widget.type == "checkbox") {
+        widget.checked = value == "true";
+    } else {
+        widget.value = value;
+    }
+}
+
+function openSocket()
+{
+    _socket = new WebSocket(`ws://${location.host}/uipanel/ws`);
+    
+    _socket.onopen = function()
+    {
+        for (const message of _pendingMessages) {
+            _socket.send(message);
+        }
+        _pendingMessages = [ ];
+    }
+    
+    _socket.onmessage = function(event)
+    {
+        const params = new URLSearchParams(event.data);
+        setWidgetValue(params.get("widget"), params.get("value"));
+    }
+    
+    _socket.onclose = function()
     {
-        if (http.readyState == 4) {
-            if (http.status != 200) {
-                alert("sendWidgetChange error: status=" + http.status + "response=" + http.responseText);
+        // Changes go as requests until it's back
+        _socket = null;
+        setTimeout(openSocket, 2000);
+    }
+}
+
+function sendWidgetChange(name, widget, value)
+{
+    const params = `name=${name}&widget=${widget}&value=${encodeURIComponent(value)}`;
+    
+    if (_socket && _socket.readyState == WebSocket.OPEN) {
+        _socket.send(params);
+    } else if (_socket && _socket.readyState == WebSocket.CONNECTING) {
+        _pendingMessages.push(params);
+    } else {
+        const http = new XMLHttpRequest();
+        http.open("GET", "/uipanel?op=change&" + params, true);
+        http.onreadystatechange = function()
+        {
+            if (http.readyState == 4) {
+                if (http.status != 200) {
+                    alert("sendWidgetChange error: status=" + http.status + "response=" + http.responseText);
+                }
             }
         }
+        http.send();
     }
-    http.send();
     
-    uploadJSON(name);
+    // Save the values once the changes stop rather than on every one
+    clearTimeout(_uploadTimer);
+    _uploadTimer = setTimeout(() => uploadJSON(name), uploadDelay);
 }
 
 function uploadJSON(name)
@@ -194,5 +247,6 @@ function uploadJSON(name)
     xhr.send(JSON.stringify(_widgetValues));
 }
 
+openSocket();
 makeUIPanel(uipanelJSON);
 updateUIPanel(uipanelWidgetValues);